@@ -0,0 +1,136 @@
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <iterator>
+#include <memory>
+#include <sstream>
+#include <thread>
+
+#include "Benchmark.hpp"
+
+namespace bench {
+
+static std::vector<std::unique_ptr<Benchmark>>& registry() {
+  static std::vector<std::unique_ptr<Benchmark>> benchmarks;
+  return benchmarks;
+}
+
+Benchmark* registerBenchmark(std::string const& name, function const& run) {
+  registry().push_back(std::make_unique<Benchmark>(name, run));
+  return registry().back().get();
+}
+
+namespace {
+struct RunResult {
+  double seconds;
+  int64_t items;
+  int64_t bytes;
+};
+}  // namespace
+
+// Every thread does all the iterations; the wall time covers the slowest
+static RunResult runOnce(Benchmark const& benchmark,
+                         std::vector<int64_t> const& args, int nbThreads,
+                         uint64_t iterations) {
+  std::vector<std::unique_ptr<State>> states;
+  for (int i = 0; i < nbThreads; ++i) {
+    states.push_back(std::make_unique<State>(iterations, args, i, nbThreads));
+  }
+  auto start = std::chrono::steady_clock::now();
+  if (nbThreads == 1) {
+    benchmark.run()(*states[0]);
+  } else {
+    std::vector<std::thread> threads;
+    for (auto const& state : states) {
+      threads.emplace_back(
+          [&benchmark, &state]() { benchmark.run()(*state); });
+    }
+    for (std::thread& thread : threads) {
+      thread.join();
+    }
+  }
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  RunResult result{std::chrono::duration<double>(elapsed).count(), 0, 0};
+  for (auto const& state : states) {
+    result.items += state->itemsProcessed();
+    result.bytes += state->bytesProcessed();
+  }
+  return result;
+}
+
+static std::string formatRate(double perSecond, char const* unit) {
+  static char const* const prefixes[] = {"", "k", "M", "G", "T"};
+  std::size_t prefix = 0;
+  while (perSecond >= 1000.0 && prefix + 1 < std::size(prefixes)) {
+    perSecond /= 1000.0;
+    ++prefix;
+  }
+  std::ostringstream out;
+  out << std::fixed << std::setprecision(2) << perSecond << ' '
+      << prefixes[prefix] << unit;
+  return out.str();
+}
+
+static void report(std::ostream& out, std::string const& name,
+                   uint64_t iterations, RunResult const& result) {
+  double nsPerIteration = result.seconds * 1e9 / iterations;
+  out << std::left << std::setw(44) << name << std::right << std::setw(14)
+      << std::fixed << std::setprecision(1) << nsPerIteration << " ns"
+      << std::setw(12) << iterations;
+  if (result.items > 0) {
+    out << "  " << formatRate(result.items / result.seconds, "items/s");
+  }
+  if (result.bytes > 0) {
+    out << "  " << formatRate(result.bytes / result.seconds, "B/s");
+  }
+  out << std::endl;
+}
+
+int runBenchmarks(std::string const& filter, std::ostream& out) {
+  constexpr double kMinSeconds = 0.5;
+  constexpr uint64_t kMaxIterations = 1000000000;
+  out << std::left << std::setw(44) << "Benchmark" << std::right
+      << std::setw(17) << "Time" << std::setw(12) << "Iterations" << std::endl;
+  for (auto const& benchmark : registry()) {
+    std::vector<std::vector<int64_t>> argSets = benchmark->argSets();
+    if (argSets.empty()) {
+      argSets.emplace_back();
+    }
+    std::vector<int> threadCounts = benchmark->threadCounts();
+    if (threadCounts.empty()) {
+      threadCounts.push_back(1);
+    }
+    for (auto const& args : argSets) {
+      for (int nbThreads : threadCounts) {
+        std::string name = benchmark->name();
+        for (int64_t arg : args) {
+          name += "/" + std::to_string(arg);
+        }
+        if (benchmark->threadCounts().size() > 0) {
+          name += "/threads:" + std::to_string(nbThreads);
+        }
+        if (name.find(filter) == std::string::npos) {
+          continue;
+        }
+        // Grow the run until it lasts long enough to be measured
+        uint64_t iterations = 1;
+        RunResult result = runOnce(*benchmark, args, nbThreads, iterations);
+        while (result.seconds < kMinSeconds && iterations < kMaxIterations) {
+          double scale =
+              result.seconds > 0.0
+                  ? std::min(10.0, 1.4 * kMinSeconds / result.seconds)
+                  : 10.0;
+          iterations = std::min(
+              kMaxIterations,
+              std::max(iterations + 1,
+                       static_cast<uint64_t>(iterations * scale)));
+          result = runOnce(*benchmark, args, nbThreads, iterations);
+        }
+        report(out, name, iterations, result);
+      }
+    }
+  }
+  return 0;
+}
+
+}  // namespace bench
@@ -0,0 +1,113 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// A small stand-in for Google Benchmark: functions taking a State are
+// registered with BENCHMARK and time the body of their
+//   for (auto _ : state) { ... }
+// loop. The runner grows the iteration count until a run lasts long enough.
+namespace bench {
+
+class State {
+ public:
+  // What the loop variable gets; never used, so never warned about
+  struct [[maybe_unused]] Value {};
+  struct Iterator {
+    uint64_t left;
+    bool operator!=(Iterator const& other) const { return left != other.left; }
+    void operator++() { --left; }
+    Value operator*() const { return Value(); }
+  };
+
+  State(uint64_t iterations, std::vector<int64_t> const& args,
+        int threadIndex, int threads)
+      : iterations_(iterations),
+        args_(args),
+        threadIndex_(threadIndex),
+        threads_(threads),
+        itemsProcessed_(0),
+        bytesProcessed_(0) {}
+
+  Iterator begin() const { return Iterator{iterations_}; }
+  Iterator end() const { return Iterator{0}; }
+
+  uint64_t iterations() const { return iterations_; }
+  int64_t range(std::size_t index = 0) const { return args_.at(index); }
+  int threadIndex() const { return threadIndex_; }
+  int threads() const { return threads_; }
+
+  void setItemsProcessed(int64_t items) { itemsProcessed_ = items; }
+  void setBytesProcessed(int64_t bytes) { bytesProcessed_ = bytes; }
+  int64_t itemsProcessed() const { return itemsProcessed_; }
+  int64_t bytesProcessed() const { return bytesProcessed_; }
+
+ private:
+  uint64_t const iterations_;
+  std::vector<int64_t> const& args_;
+  int const threadIndex_;
+  int const threads_;
+  int64_t itemsProcessed_;
+  int64_t bytesProcessed_;
+};
+
+using function = std::function<void(State&)>;
+
+class Benchmark {
+ public:
+  Benchmark(std::string const& name, function const& run)
+      : name_(name), run_(run) {}
+
+  // Each call adds a run with these arguments, read with State::range()
+  Benchmark* arg(int64_t value) {
+    argSets_.push_back({value});
+    return this;
+  }
+  Benchmark* args(std::vector<int64_t> const& values) {
+    argSets_.push_back(values);
+    return this;
+  }
+  // Runs the function on that many threads at once, all timed together
+  Benchmark* threads(int count) {
+    threadCounts_.push_back(count);
+    return this;
+  }
+
+  std::string const& name() const { return name_; }
+  function const& run() const { return run_; }
+  std::vector<std::vector<int64_t>> const& argSets() const { return argSets_; }
+  std::vector<int> const& threadCounts() const { return threadCounts_; }
+
+ private:
+  std::string const name_;
+  function const run_;
+  std::vector<std::vector<int64_t>> argSets_;
+  std::vector<int> threadCounts_;
+};
+
+Benchmark* registerBenchmark(std::string const& name, function const& run);
+// Runs the benchmarks whose name contains filter, all of them if empty,
+// and writes their results to out
+int runBenchmarks(std::string const& filter, std::ostream& out);
+
+// Keeps the compiler from optimizing away the computation of value
+template <typename T>
+inline void doNotOptimize(T const& value) {
+#if defined(__GNUC__)
+  asm volatile("" : : "r,m"(value) : "memory");
+#else
+  static volatile char const* sink;
+  sink = reinterpret_cast<char const volatile*>(&value);
+#endif
+}
+
+}  // namespace bench
+
+#define BENCHMARK_CONCAT_(a, b) a##b
+#define BENCHMARK_NAME_(line) BENCHMARK_CONCAT_(benchmarkRegistered_, line)
+#define BENCHMARK(fn)                                                 \
+  static ::bench::Benchmark* BENCHMARK_NAME_(__LINE__) [[maybe_unused]] = \
+      ::bench::registerBenchmark(#fn, fn)
@@ -0,0 +1,291 @@
+// Server hot paths, run without any connection. FTP-Bench.vcxproj builds it
+// on Windows; on Linux, from the solution directory, as one command:
+//   g++ -std=c++17 -O2 -DNDEBUG -pthread -Inetworking-ts-impl/include
+//       -IFTP-Server FTP-Bench/*.cpp $(ls FTP-Server/*.cpp | grep -v main)
+//       -lz -o bench
+#include <experimental/io_context>
+
+#include <ctime>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#if defined(__linux__)
+#include <fcntl.h>
+#endif
+
+#include "Benchmark.hpp"
+#include "DirListing.hpp"
+#include "FTPMsgs.hpp"
+#include "FTPSession.hpp"
+#include "FTPUser.hpp"
+#include "Logger.hpp"
+#include "UserDatabase.hpp"
+
+namespace fs = std::filesystem;
+namespace net = std::experimental::net;
+
+namespace {
+// Directory tree the benchmarks work in, removed at exit
+class ScratchDir {
+ public:
+  static ScratchDir& instance() {
+    static ScratchDir scratch;
+    return scratch;
+  }
+  ~ScratchDir() {
+    std::error_code ec;
+    fs::remove_all(root_, ec);
+  }
+
+  fs::path const& root() const { return root_; }
+  // A directory holding nbFiles empty files, created on first use
+  fs::path const& dirWithFiles(int64_t nbFiles) {
+    fs::path dir = root_ / ("files-" + std::to_string(nbFiles));
+    if (!fs::exists(dir)) {
+      fs::create_directories(dir);
+      for (int64_t i = 0; i < nbFiles; ++i) {
+        std::ofstream(dir / ("file-" + std::to_string(i) + ".dat"));
+      }
+    }
+    return dirs_.emplace_back(dir);
+  }
+
+ private:
+  ScratchDir()
+      : root_(fs::temp_directory_path() /
+              ("ftp-bench-" +
+               std::to_string(std::random_device()() % 1000000))) {
+    fs::create_directories(root_ / "pub" / "docs");
+  }
+
+  fs::path const root_;
+  std::vector<fs::path> dirs_;
+};
+
+// Entries as a directory scan would read them, without touching the disk
+std::vector<ListingEntry> syntheticEntries(int64_t nbEntries) {
+  std::mt19937_64 random(nbEntries);
+  std::time_t now = std::time(nullptr);
+  std::vector<ListingEntry> entries;
+  entries.reserve(nbEntries);
+  for (int64_t i = 0; i < nbEntries; ++i) {
+    bool dir = i % 10 == 0;
+    // Half of them from this year, the others older
+    std::time_t age = static_cast<std::time_t>(random() % (2 * 31536000));
+    entries.push_back(ListingEntry{
+        (dir ? "dir-" : "file-") + std::to_string(i) + (dir ? "" : ".dat"),
+        dir, dir ? 0755u : 0644u, dir ? 4096 : random() % (1ull << 32),
+        now - age, 2049, static_cast<uint64_t>(1000000 + i)});
+  }
+  return entries;
+}
+
+// A logged in session without connections
+class SessionFixture {
+ public:
+  static SessionFixture& instance() {
+    static SessionFixture fixture;
+    return fixture;
+  }
+
+  FTPSession& session() { return *session_; }
+
+ private:
+  SessionFixture() : socket_(context_) {
+    userDb_.addUser("bench", "bench", ScratchDir::instance().root());
+    session_ = std::make_shared<FTPSession>(context_, socket_, userDb_,
+                                            [](session_ptr, bool) {});
+    session_->executeFTPCmd("USER bench");
+    session_->executeFTPCmd("PASS bench");
+  }
+
+  net::io_context context_;
+  net::ip::tcp::socket socket_;
+  UserDatabase userDb_;
+  session_ptr session_;
+};
+
+// Counts what a listing produces instead of sending it
+struct CountingSink {
+  std::shared_ptr<int64_t> bytes = std::make_shared<int64_t>(0);
+  void operator()(listing_chunk const& chunk) const {
+    *bytes += static_cast<int64_t>(chunk->size());
+  }
+};
+}  // namespace
+
+static void commandDispatch(bench::State& state) {
+  FTPSession& session = SessionFixture::instance().session();
+  static char const* const commands[] = {"NOOP", "TYPE I", "MODE S",
+                                         "PWD",  "SYST",   "XYZZ"};
+  std::size_t next = 0;
+  for (auto _ : state) {
+    bench::doNotOptimize(
+        session.executeFTPCmd(commands[next++ % std::size(commands)]));
+  }
+  state.setItemsProcessed(state.iterations());
+}
+BENCHMARK(commandDispatch);
+
+static void commandDispatchNoop(bench::State& state) {
+  FTPSession& session = SessionFixture::instance().session();
+  for (auto _ : state) {
+    bench::doNotOptimize(session.executeFTPCmd("NOOP"));
+  }
+  state.setItemsProcessed(state.iterations());
+}
+BENCHMARK(commandDispatchNoop);
+
+static void ftpToLocalPath(bench::State& state) {
+  fs::path const& root = ScratchDir::instance().root();
+  FTPUser user("", root);
+  fs::path workingDir = root / "pub";
+  // Relative, absolute, and one that has to be clamped to the root
+  static char const* const paths[] = {"docs/report.txt", "/pub/docs/a.bin",
+                                      "../../../etc/passwd"};
+  std::size_t next = 0;
+  for (auto _ : state) {
+    bench::doNotOptimize(
+        user.toLocalPath(workingDir, paths[next++ % std::size(paths)]));
+  }
+  state.setItemsProcessed(state.iterations());
+}
+BENCHMARK(ftpToLocalPath);
+
+static void localToFTPPath(bench::State& state) {
+  fs::path const& root = ScratchDir::instance().root();
+  FTPUser user("", root);
+  fs::path localPath = root / "pub" / "docs" / "report.txt";
+  for (auto _ : state) {
+    bench::doNotOptimize(user.toFTPPath(localPath));
+  }
+  state.setItemsProcessed(state.iterations());
+}
+BENCHMARK(localToFTPPath);
+
+// The lookup SIZE makes, from the root down
+static void rootDirStatus(bench::State& state) {
+  fs::path const& root = ScratchDir::instance().root();
+  FTPUser user("", root);
+  fs::path localPath = user.toLocalPath(root, "/pub/docs/report.txt");
+  std::ofstream(localPath).put('x');
+  for (auto _ : state) {
+    std::error_code ec;
+    bench::doNotOptimize(user.root_.status(localPath, ec).size);
+  }
+  state.setItemsProcessed(state.iterations());
+}
+BENCHMARK(rootDirStatus);
+
+static void formatListLines(bench::State& state) {
+  std::vector<ListingEntry> entries = syntheticEntries(state.range(0));
+  CountingSink sink;
+  for (auto _ : state) {
+    formatDirListing(entries, sink);
+  }
+  state.setItemsProcessed(state.iterations() * entries.size());
+  state.setBytesProcessed(*sink.bytes);
+}
+BENCHMARK(formatListLines)->arg(10000)->arg(100000);
+
+static void formatMlsdLines(bench::State& state) {
+  std::vector<ListingEntry> entries = syntheticEntries(state.range(0));
+  CountingSink sink;
+  for (auto _ : state) {
+    formatMachineListing(entries, sink);
+  }
+  state.setItemsProcessed(state.iterations() * entries.size());
+  state.setBytesProcessed(*sink.bytes);
+}
+BENCHMARK(formatMlsdLines)->arg(10000)->arg(100000);
+
+static void formatNlstLines(bench::State& state) {
+  std::vector<ListingEntry> entries = syntheticEntries(state.range(0));
+  CountingSink sink;
+  for (auto _ : state) {
+    formatNameList(entries, sink);
+  }
+  state.setItemsProcessed(state.iterations() * entries.size());
+  state.setBytesProcessed(*sink.bytes);
+}
+BENCHMARK(formatNlstLines)->arg(10000)->arg(100000);
+
+// Reading the directory included, as LIST does on a listing cache miss
+static void renderList(bench::State& state) {
+  fs::path const& dir = ScratchDir::instance().dirWithFiles(state.range(0));
+#if defined(__linux__)
+  listing_source source(std::make_shared<ListingSource>(
+      ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC)));
+#else
+  listing_source source(std::make_shared<ListingSource>(dir));
+#endif
+  std::size_t bytes = 0;
+  for (auto _ : state) {
+    listing_reader reader = readDirListing(source);
+    while (listing_chunk chunk = reader->next()) {
+      bytes += chunk->size();
+    }
+  }
+  state.setItemsProcessed(state.iterations() * state.range(0));
+  state.setBytesProcessed(bytes);
+}
+BENCHMARK(renderList)->arg(10000)->arg(100000);
+
+static void replyStr(bench::State& state) {
+  FTPMsgs reply(FTPReplyCode::FILE_STATUS_OK_OPENING_DATA_CONNECTION,
+                "Sending file");
+  for (auto _ : state) {
+    bench::doNotOptimize(reply.str());
+  }
+  state.setItemsProcessed(state.iterations());
+}
+BENCHMARK(replyStr);
+
+static void replyStrMultiLine(bench::State& state) {
+  FTPMsgs reply(FTPReplyCode::REPLY_SYSTEM_STATUS, "Features:",
+                " MDTM\r\n MLST type*;size*;modify*;\r\n REST STREAM\r\n"
+                " SIZE\r\n UTF8\r\n");
+  for (auto _ : state) {
+    bench::doNotOptimize(reply.str());
+  }
+  state.setItemsProcessed(state.iterations());
+}
+BENCHMARK(replyStrMultiLine);
+
+// Every thread looks users up in the same database
+static void userLookup(bench::State& state) {
+  static UserDatabase userDb;
+  static bool filled = [&]() {
+    for (int i = 0; i < 1000; ++i) {
+      userDb.addUser("user" + std::to_string(i), "pass",
+                     ScratchDir::instance().root());
+    }
+    return true;
+  }();
+  bench::doNotOptimize(filled);
+  std::vector<std::string> names;
+  for (int i = 0; i < 64; ++i) {
+    names.push_back("user" + std::to_string((i * 37 + state.threadIndex()) %
+                                            1000));
+  }
+  std::string const pass = "pass";
+  std::size_t next = 0;
+  for (auto _ : state) {
+    bench::doNotOptimize(userDb.getUser(names[next++ % names.size()], pass));
+  }
+  state.setItemsProcessed(state.iterations());
+}
+BENCHMARK(userLookup)->threads(1)->threads(2)->threads(4)->threads(8);
+
+int main(int argc, char* argv[]) {
+  // The standard output is left to the results
+  Logger::instance().setLevel(LogLevel::OFF);
+  // Optional argument: run only benchmarks whose name contains it
+  return bench::runBenchmarks(argc > 1 ? argv[1] : "", std::cout);
+}
@@ -1,370 +1,1395 @@
 #include <experimental/buffer>
+#include <experimental/timer>
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <filesystem>
+#include <future>
+#include <iomanip>
 #include <iostream>
+#include <limits>
+#include <string_view>
+#include <thread>
+
+#if defined(__unix__)
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 #include "FTPClient.hpp"
 
+// Visual Studio builds opt in to zlib with FTP_WITH_ZLIB, as the server does
+#if defined(_MSC_VER) ? defined(FTP_WITH_ZLIB) : __has_include(<zlib.h>)
+#include <zlib.h>
+#define FTP_HAVE_ZLIB 1
+#endif
+
 static bool isNegative(FTPMsg const& msg) { return msg.first >= 400; }
 
-static std::list<dir_entry> string_to_dir_list(std::string const& data) {
-  // <cai dong trong struct> \r\n
-  // <another> \r\n
-  std::stringstream s(data);
-  std::string line;
-  std::list<dir_entry> list;
+// Read and write size of file transfers
+static constexpr size_t kDataChunkSize = 1 << 20;
+static constexpr size_t kListingChunkSize = 1 << 16;
+static constexpr uint64_t kNoLimit = std::numeric_limits<uint64_t>::max();
+
+// Compressing these again in MODE Z only costs time
+static bool isCompressedFile(std::string const& path) {
+  static constexpr std::string_view extensions[] = {
+      ".7z",  ".avi", ".bz2", ".flac", ".gif", ".gz",  ".jpeg",
+      ".jpg", ".lz4", ".mkv", ".mov",  ".mp3", ".mp4", ".ogg",
+      ".png", ".rar", ".tgz", ".webm", ".webp", ".xz", ".zip",
+      ".zst"};
+  std::string extension = std::filesystem::path(path).extension().string();
+  std::transform(extension.begin(), extension.end(), extension.begin(),
+                 [](unsigned char c) { return std::tolower(c); });
+  return std::find(std::begin(extensions), std::end(extensions),
+                   extension) != std::end(extensions);
+}
 
-  while (!s.eof()) {
-    std::getline(s, line);
-    if (line.back() == '\r') line.pop_back();
-    if (line.empty()) continue;
-    std::stringstream lineStream(line);
-    std::string t1, t2, t3;
-    dir_entry mem;
+#if defined(FTP_HAVE_ZLIB)
+namespace {
+// zlib state of one MODE Z transfer
+class ZPipe {
+ public:
+  ZPipe(bool deflating, int level) : deflating_(deflating), stream_() {
+    good_ = (deflating_ ? deflateInit(&stream_, level)
+                        : inflateInit(&stream_)) == Z_OK;
+    initialized_ = good_;
+  }
+  ~ZPipe() {
+    if (initialized_) {
+      deflating_ ? deflateEnd(&stream_) : inflateEnd(&stream_);
+    }
+  }
+  ZPipe(ZPipe const&) = delete;
+  ZPipe& operator=(ZPipe const&) = delete;
 
-    lineStream >> t1;
-    mem.dir = t1.front() == 'd';
-    lineStream >> t1;  // delete 1
-    lineStream >> mem.ower >> mem.group >> mem.size;
+  // Passes the output on to out as it is produced. finish ends a deflate
+  // stream. Returns false on corrupt input.
+  template <typename Sink>
+  bool run(char const* data, size_t length, bool finish, Sink&& out) {
+    char output[1 << 16];
+    stream_.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+    stream_.avail_in = static_cast<uInt>(length);
+    int flush = finish ? Z_FINISH : Z_NO_FLUSH;
+    while (good_) {
+      stream_.next_out = reinterpret_cast<Bytef*>(output);
+      stream_.avail_out = sizeof(output);
+      int result = deflating_ ? deflate(&stream_, flush)
+                              : inflate(&stream_, Z_NO_FLUSH);
+      if (result != Z_OK && result != Z_STREAM_END && result != Z_BUF_ERROR) {
+        good_ = false;
+        break;
+      }
+      if (size_t produced = sizeof(output) - stream_.avail_out) {
+        out(output, produced);
+      }
+      if (result == Z_STREAM_END) {
+        finished_ = true;
+        good_ = false;
+        return stream_.avail_in == 0;
+      }
+      if (stream_.avail_out != 0 && !(deflating_ && finish)) {
+        return true;
+      }
+    }
+    return false;
+  }
+  bool finished() const { return finished_; }
 
-    lineStream >> t1 >> t2 >> t3;
-    mem.stringtime = t1 + t2 + t2;
-    lineStream >> mem.filename;
+ private:
+  bool const deflating_;
+  z_stream stream_;
+  bool initialized_;
+  bool good_;
+  bool finished_ = false;
+};
+}  // namespace
+#endif
 
-    list.push_back(mem);
+// Returns the next line of body without its line ending and moves pos past it
+static std::string_view nextLine(std::string_view body, size_t& pos) {
+  size_t end = body.find('\n', pos);
+  if (end == std::string_view::npos) {
+    end = body.size();
   }
-  return list;
+  std::string_view line = body.substr(pos, end - pos);
+  pos = end + 1;
+  if (!line.empty() && line.back() == '\r') {
+    line.remove_suffix(1);
+  }
+  return line;
 }
 
-FTPClient::FTPClient() : msgSocket_(ioContext_), dataSocket_(ioContext_) {}
-
-FTPClient::~FTPClient() {
-  close();
-  std::cout << "Client exited" << std::endl;
+// Splits off the next space separated token of line
+static std::string_view nextToken(std::string_view& line) {
+  size_t begin = line.find_first_not_of(' ');
+  if (begin == std::string_view::npos) {
+    line = std::string_view();
+    return line;
+  }
+  size_t end = std::min(line.find(' ', begin), line.size());
+  std::string_view token = line.substr(begin, end - begin);
+  line.remove_prefix(end);
+  return token;
 }
 
-bool FTPClient::connect(std::string const& ip, uint16_t port) {
-  net::ip::tcp::endpoint remote_endpoint(net::ip::make_address(ip), port);
-  try {
-    msgSocket_.connect(remote_endpoint);
-    FTPMsg reply = recvFTPMsg();
-    if (reply.first == 220) {
-      std::cout << "Connected to server" << std::endl;
-      return true;
-    }
+// "-rw-r--r--   1 owner group size Mon dd hh:mm name"
+static bool parseListLine(std::string_view line, dir_entry& entry) {
+  std::string_view perms = nextToken(line);
+  if (perms.empty()) {
     return false;
-  } catch (std::system_error const& er) {
-    std::cerr << "Server connection error: " << er.what() << std::endl;
+  }
+  entry.dir = perms.front() == 'd';
+  nextToken(line);  // link count
+  entry.ower = nextToken(line);
+  entry.group = nextToken(line);
+  entry.size = nextToken(line);
+  // The time spans three tokens, keep it as one view
+  std::string_view month = nextToken(line);
+  nextToken(line);
+  std::string_view timeOrYear = nextToken(line);
+  if (timeOrYear.empty()) {
     return false;
-    throw er;
-    // TODO1 retry
   }
+  entry.stringtime = std::string_view(
+      month.data(), timeOrYear.data() + timeOrYear.size() - month.data());
+  // Names may contain spaces: everything after the separator is the name
+  entry.filename = line.empty() ? line : line.substr(1);
+  return !entry.filename.empty();
 }
 
-void FTPClient::close() {
-  try {
-    if (msgSocket_.is_open()) {
-      msgSocket_.shutdown(net::ip::tcp::socket::shutdown_both);
-      msgSocket_.close();
+// "type=file;size=14;modify=20200101120000;unique=801U2a; name"
+static bool parseMachineLine(std::string_view line, dir_entry& entry) {
+  size_t nameSep = line.find(' ');
+  if (nameSep == std::string_view::npos) {
+    return false;
+  }
+  entry.filename = line.substr(nameSep + 1);
+  std::string_view facts = line.substr(0, nameSep);
+  while (!facts.empty()) {
+    size_t factEnd = std::min(facts.find(';'), facts.size());
+    std::string_view fact = facts.substr(0, factEnd);
+    facts.remove_prefix(std::min(factEnd + 1, facts.size()));
+    size_t eq = fact.find('=');
+    if (eq == std::string_view::npos) {
+      continue;
+    }
+    std::string_view name = fact.substr(0, eq), value = fact.substr(eq + 1);
+    // Fact names are case insensitive, servers mostly use lower case
+    auto factIs = [name](char const* expected) {
+      std::string_view wanted(expected);
+      return name.size() == wanted.size() &&
+             std::equal(name.begin(), name.end(), wanted.begin(),
+                        [](char a, char b) { return std::tolower(a) == b; });
+    };
+    if (factIs("type")) {
+      entry.dir = value == "dir" || value == "cdir" || value == "pdir";
+    } else if (factIs("size")) {
+      entry.size = value;
+    } else if (factIs("modify")) {
+      entry.stringtime = value;
+    } else if (factIs("unique")) {
+      entry.unique = value;
     }
-    // TODO1 data socket
-  } catch (std::system_error const& er) {
-    std::cerr << "Close error: " << er.what() << std::endl;
-    throw er;
-    // TODO1 retry
   }
+  // The current and parent directory entries are not part of the content
+  return !entry.filename.empty() && entry.filename != "." &&
+         entry.filename != "..";
 }
 
-bool FTPClient::signup(std::string const& uname, std::string const& pass) {
-  try {
-    sendCmd("UADD " + uname);
-    FTPMsg reply = recvFTPMsg();
-    if (reply.first == 331) {
-      sendCmd("PASS " + pass);
-      reply = recvFTPMsg();
-    } else if (reply.first == 332) {
-      // TONOTDO we don't support ACCT command
+dir_listing::dir_listing(std::string body, bool machineFormat)
+    : body_(std::make_shared<std::string const>(std::move(body))) {
+  std::string_view view(*body_);
+  for (size_t pos = 0; pos < view.size();) {
+    std::string_view line = nextLine(view, pos);
+    dir_entry entry{};
+    if (!line.empty() && (machineFormat ? parseMachineLine(line, entry)
+                                        : parseListLine(line, entry))) {
+      entries_.push_back(entry);
     }
-    return !isNegative(reply);
-  } catch (...) {
-    // TODOcatch
   }
 }
 
-bool FTPClient::login(std::string const& uname, std::string const& pass) {
-  try {
-    sendCmd("USER " + uname);
-    FTPMsg reply = recvFTPMsg();
-    if (reply.first == 331) {
-      sendCmd("PASS " + pass);
-      reply = recvFTPMsg();
-    } else if (reply.first == 332) {
-      // TONOTDO we don't support ACCT command
+#if defined(__unix__)
+static bool writeAt(int fd, char const* data, size_t length, uint64_t offset) {
+  while (length > 0) {
+    ssize_t written = ::pwrite(fd, data, length, static_cast<off_t>(offset));
+    if (written < 0 && errno == EINTR) {
+      continue;
     }
-
-    return !isNegative(reply);
-  } catch (...) {
-    // TODOcatch
-    return false;
+    if (written <= 0) {
+      return false;
+    }
+    data += written;
+    length -= written;
+    offset += written;
   }
+  return true;
 }
+#endif
 
-FTPMsg FTPClient::recvFTPMsg() {
-  std::error_code ec;
-  std::string line;
-  size_t len =
-      net::read_until(msgSocket_, net::dynamic_buffer(line), "\r\n", ec);
-  if (ec == net::error::eof) {
-    /* Ignore eof. */
-  } else if (ec) {
-    std::cerr << "Receive message error: " << ec.message() << std::endl;
-    throw ec;
-  }
-  int code = std::stoi(line.substr(0, 3));
-  std::string msg = std::string(line.begin() + 4, line.end() - 2);
-  std::cout << "CLI << " << code << ' ' << msg << std::endl;
-  return std::make_pair(code, msg);
-}
-
-void FTPClient::sendCmd(std::string const& cmd) {
-  std::cout << "CLI >> " << cmd << std::endl;
-  try {
-    net::write(msgSocket_, net::buffer(cmd + "\r\n"));
-  } catch (std::system_error const& er) {
-    std::cerr << "Send command error: " << er.what() << std::endl;
-    throw er;
-  }
+static bool succeeded(std::optional<FTPMsg> const& reply) {
+  return reply && !isNegative(*reply);
 }
 
-bool FTPClient::upload(std::string const& local_file,
-                       std::string const& remote_file) {
-  std::ifstream file(local_file, std::ios_base::binary);
-  if (!file.is_open()) {
-    std::cerr << "Cannot open local file " << std::endl;
-    return false;
+// The reply code at the start of line, -1 if there is none
+static int replyCode(std::string const& line) {
+  if (line.size() < 3 || !std::isdigit(static_cast<unsigned char>(line[0])) ||
+      !std::isdigit(static_cast<unsigned char>(line[1])) ||
+      !std::isdigit(static_cast<unsigned char>(line[2]))) {
+    return -1;
   }
+  return (line[0] - '0') * 100 + (line[1] - '0') * 10 + (line[2] - '0');
+}
+
+// "227 Entering Passive Mode (h1,h2,h3,h4,p1,p2)"
+static bool parsePassiveReply(std::string const& receivedMsg,
+                              net::ip::tcp::endpoint& endpoint) {
   try {
-    if (!resetDataSocket()) {
-      return false;
-    }
-    sendCmd("STOR " + remote_file);
-    FTPMsg reply = recvFTPMsg();
-    if (isNegative(reply)) {
-      return false;
+    // day la IP
+    size_t pos = receivedMsg.find("(") + 1, pos_1 = receivedMsg.find(",");
+    std::string IP = receivedMsg.substr(pos, pos_1 - pos);
+
+    for (int i = 0; i < 3; ++i) {
+      IP += ".";
+      pos = pos_1 + 1;
+      pos_1 = receivedMsg.find(",", pos_1 + 1, 1);
+      IP += receivedMsg.substr(pos, pos_1 - pos);
     }
-    /* Start file transfer. */
-    charbuf_ptr buffer(std::make_shared<std::vector<char>>(1 << 20));
-    while (!file.eof()) {
-      file.read(buffer->data(), buffer->size());
-      buffer->resize(file.gcount());
-      if (file.fail() && !file.eof()) {
-        std::cerr << "Read local file error" << std::endl;
+
+    // day là port
+    pos = pos_1 + 1;
+    pos_1 = receivedMsg.find(",", pos_1 + 1, 1);
+    uint8_t n1 = std::stoi(receivedMsg.substr(pos, pos_1 - pos));
+    pos = pos_1 + 1;
+    pos_1 = receivedMsg.find(")", pos_1 + 1, 1);
+    uint8_t n2 = std::stoi(receivedMsg.substr(pos, pos_1 - pos));
+    uint16_t port = (n1 << 8) | n2;
+    endpoint = net::ip::tcp::endpoint(net::ip::make_address(IP), port);
+    return true;
+  } catch (std::exception const&) {
+    return false;
+  }
+}
+
+// Puts an inflater in front of out for MODE Z data. complete then tells
+// whether the compressed stream has come to its proper end.
+static std::function<bool(char const*, size_t)> decodeInto(
+    bool compressed, std::function<bool(char const*, size_t)> out,
+    std::function<bool()>& complete) {
+#if defined(FTP_HAVE_ZLIB)
+  if (compressed) {
+    auto inflater = std::make_shared<ZPipe>(false, 0);
+    complete = [inflater]() { return inflater->finished(); };
+    return [inflater, out = std::move(out)](char const* data, size_t length) {
+      bool written = true;
+      if (!inflater->run(data, length, false,
+                         [&out, &written](char const* plain, size_t size) {
+                           written = written && out(plain, size);
+                         })) {
+        std::cerr << "Corrupt compressed data" << std::endl;
         return false;
       }
-      sendData(buffer);
+      return written;
+    };
+  }
+#else
+  (void)compressed;
+#endif
+  complete = []() { return true; };
+  return out;
+}
+
+// Completes a queued operation: the caller hears of the result before the
+// next operation of the client starts.
+template <typename Handler>
+static auto completing(Handler handler, std::function<void()> done) {
+  return [handler = std::move(handler),
+          done = std::move(done)](auto&&... results) {
+    handler(std::forward<decltype(results)>(results)...);
+    done();
+  };
+}
+
+namespace {
+// Shared by the range connections of one parallel download
+struct RangeDownload {
+  explicit RangeDownload(net::io_context& context) : timer(context) {}
+
+  std::vector<std::unique_ptr<FTPClient>> workers;
+#if defined(__unix__)
+  int fd = -1;
+#else
+  std::vector<std::unique_ptr<std::fstream>> outputs;
+#endif
+  uint64_t fileSize = 0;
+  std::atomic<uint64_t> received{0};
+  std::atomic<size_t> nbPending{0};
+  std::atomic<bool> failed{false};
+  // Used on the strand of the client that started the download
+  net::steady_timer timer;
+  std::chrono::steady_clock::time_point start, lastReport;
+  uint64_t lastReceived = 0;
+};
+}  // namespace
+
+// Reports the aggregate rate about once per second until the timer is
+// cancelled
+static void reportProgress(
+    std::shared_ptr<RangeDownload> const& state,
+    net::strand<net::io_context::executor_type> const& strand) {
+  state->timer.expires_after(std::chrono::seconds(1));
+  state->timer.async_wait(net::bind_executor(
+      strand, [state, strand](std::error_code const& ec) {
+        if (ec) {
+          return;
+        }
+        auto now = std::chrono::steady_clock::now();
+        double interval =
+            std::chrono::duration<double>(now - state->lastReport).count();
+        uint64_t received = state->received;
+        std::cout << std::fixed << std::setprecision(1)
+                  << (received - state->lastReceived) / interval / (1 << 20)
+                  << " MiB/s, "
+                  << received * 100.0 / std::max<uint64_t>(state->fileSize, 1)
+                  << "%" << std::endl;
+        state->lastReport = now;
+        state->lastReceived = received;
+        reportProgress(state, strand);
+      }));
+}
+
+FTPClient::FTPClient()
+    : remotePort_(0),
+      modeZ_(false),
+      modeZLevel_(-1),
+      ownContext_(std::make_unique<net::io_context>()),
+      context_(*ownContext_),
+      strand_(context_.get_executor()),
+      opRunning_(false),
+      msgSocket_(context_),
+      dataSocket_(context_) {}
+
+FTPClient::FTPClient(net::io_context& context)
+    : remotePort_(0),
+      modeZ_(false),
+      modeZLevel_(-1),
+      context_(context),
+      strand_(context_.get_executor()),
+      opRunning_(false),
+      msgSocket_(context_),
+      dataSocket_(context_) {}
+
+FTPClient::~FTPClient() {
+  close();
+  std::cout << "Client exited" << std::endl;
+}
+
+template <typename Result>
+Result FTPClient::runBlocking(
+    std::function<void(std::function<void(Result)>)> start,
+    size_t nbThreads) {
+  if (!ownContext_) {
+    std::promise<Result> promise;
+    std::future<Result> future = promise.get_future();
+    start([&promise](Result result) { promise.set_value(std::move(result)); });
+    return future.get();
+  }
+  std::optional<Result> result;
+  start([&result](Result value) { result = std::move(value); });
+  // run() returns once the operation and everything it started are done
+  ownContext_->restart();
+  std::vector<std::thread> helpers;
+  for (size_t i = 1; i < nbThreads; ++i) {
+    helpers.emplace_back([this]() { ownContext_->run(); });
+  }
+  ownContext_->run();
+  for (std::thread& helper : helpers) {
+    helper.join();
+  }
+  return result ? std::move(*result) : Result();
+}
+
+void FTPClient::enqueue(operation op) {
+  net::post(strand_, [this, op = std::move(op)]() mutable {
+    pendingOps_.push_back(std::move(op));
+    if (!opRunning_) {
+      startNextOp();
     }
-    /* Don't keep the data connection. */
-    file.close();
-    closeDataSocket();
+  });
+}
 
-    reply = recvFTPMsg();
-    return !isNegative(reply);
-  } catch (...) {
-    // TODOcatch
-    return false;
+void FTPClient::startNextOp() {
+  if (pendingOps_.empty()) {
+    opRunning_ = false;
+    return;
   }
+  opRunning_ = true;
+  operation op = std::move(pendingOps_.front());
+  pendingOps_.pop_front();
+  op([this]() { startNextOp(); });
 }
 
-bool FTPClient::mkdir(std::string const& dirName) {
-  try {
-    sendCmd("MKD " + dirName);
-    FTPMsg reply = recvFTPMsg();
-    return !isNegative(reply);
-  } catch (...) {
-    // TODOcatch
-    return false;
+bool FTPClient::connect(std::string const& ip, uint16_t port) {
+  return runBlocking<bool>([&](std::function<void(bool)> set) {
+    async_connect(ip, port, std::move(set));
+  });
+}
+
+void FTPClient::close() {
+  // Also runs from the destructor, so report errors instead of throwing
+  std::error_code ec;
+  if (msgSocket_.is_open()) {
+    msgSocket_.shutdown(net::ip::tcp::socket::shutdown_both, ec);
+    if (ec && ec != std::errc::not_connected) {
+      std::cerr << "Close error: " << ec.message() << std::endl;
+    }
+    msgSocket_.close(ec);
   }
+  closeDataSocket();
+}
+
+bool FTPClient::signup(std::string const& uname, std::string const& pass) {
+  return runBlocking<bool>([&](std::function<void(bool)> set) {
+    async_signup(uname, pass, std::move(set));
+  });
+}
+
+bool FTPClient::login(std::string const& uname, std::string const& pass) {
+  return runBlocking<bool>([&](std::function<void(bool)> set) {
+    async_login(uname, pass, std::move(set));
+  });
+}
+
+bool FTPClient::upload(std::string const& local_file,
+                       std::string const& remote_file) {
+  return runBlocking<bool>([&](std::function<void(bool)> set) {
+    async_upload(local_file, remote_file, std::move(set));
+  });
+}
+
+bool FTPClient::download(std::string const& remote_file,
+                         std::string const& local_file) {
+  return runBlocking<bool>([&](std::function<void(bool)> set) {
+    async_download(remote_file, local_file, std::move(set));
+  });
+}
+
+bool FTPClient::download_parallel(std::string const& remote_file,
+                                  std::string const& local_file,
+                                  size_t nbConnections) {
+  // The connections are spread over a few threads when the context is ours
+  size_t nbThreads = std::clamp<size_t>(
+      nbConnections, 1, std::max(std::thread::hardware_concurrency(), 1u));
+  return runBlocking<bool>(
+      [&](std::function<void(bool)> set) {
+        async_download_parallel(remote_file, local_file, nbConnections,
+                                std::move(set));
+      },
+      nbThreads);
+}
+
+bool FTPClient::mkdir(std::string const& dirName) {
+  return runBlocking<bool>([&](std::function<void(bool)> set) {
+    async_mkdir(dirName, std::move(set));
+  });
 }
 
 std::pair<bool, std::string> FTPClient::pwd() {
-  sendCmd("PWD");
-  FTPMsg reply = recvFTPMsg();
-  return std::make_pair(!isNegative(reply), reply.second);
+  using result = std::pair<bool, std::string>;
+  return runBlocking<result>([&](std::function<void(result)> set) {
+    async_pwd([set](bool ok, std::string dir) {
+      set(std::make_pair(ok, std::move(dir)));
+    });
+  });
 }
 
-std::pair<bool, std::optional<std::list<dir_entry>>> FTPClient::ls(
+std::pair<bool, std::optional<dir_listing>> FTPClient::ls(
     std::string const& remoteDir) {
-  try {
-    if (!resetDataSocket()) {
-      return std::make_pair<bool, std::optional<std::list<dir_entry>>>(
-          false, std::nullopt);
-    }
-    sendCmd("LIST " + remoteDir);
-    FTPMsg reply = recvFTPMsg();
-    if (isNegative(reply)) {
-      return std::make_pair<bool, std::optional<std::list<dir_entry>>>(
-          false, std::nullopt);
-    }
-    std::string listDirStr = recvListDir();
-    std::list<dir_entry> listEntry = string_to_dir_list(listDirStr);
-    closeDataSocket();
-    reply = recvFTPMsg();
-    return std::make_pair<bool, std::optional<std::list<dir_entry>>>(
-        !isNegative(reply), listEntry);
-  } catch (...) {
-    return std::make_pair<bool, std::optional<std::list<dir_entry>>>(
-        false, std::nullopt);
-  }
+  using result = std::pair<bool, std::optional<dir_listing>>;
+  return runBlocking<result>([&](std::function<void(result)> set) {
+    async_ls(remoteDir, [set](bool ok, std::optional<dir_listing> listing) {
+      set(std::make_pair(ok, std::move(listing)));
+    });
+  });
 }
 
 bool FTPClient::cd(std::string const& remoteDir) {
-  try {
-    sendCmd("CWD " + remoteDir);
-    FTPMsg reply = recvFTPMsg();
-    return !isNegative(reply);
-  } catch (...) {
-    // TODOcatch
-    return false;
+  return runBlocking<bool>([&](std::function<void(bool)> set) {
+    async_cd(remoteDir, std::move(set));
+  });
+}
+
+bool FTPClient::rmdir(std::string const& directory_name) {
+  return runBlocking<bool>([&](std::function<void(bool)> set) {
+    async_rmdir(directory_name, std::move(set));
+  });
+}
+
+bool FTPClient::rm(std::string const& remote_file) {
+  return runBlocking<bool>([&](std::function<void(bool)> set) {
+    async_rm(remote_file, std::move(set));
+  });
+}
+
+bool FTPClient::setCompression(bool enabled, int level) {
+  return runBlocking<bool>([&](std::function<void(bool)> set) {
+    async_setCompression(enabled, level, std::move(set));
+  });
+}
+
+void FTPClient::async_connect(std::string const& ip, uint16_t port,
+                              result_handler handler) {
+  enqueue([this, ip, port, handler](std::function<void()> done) {
+    connectTo(ip, port, completing(handler, std::move(done)));
+  });
+}
+
+void FTPClient::async_close(result_handler handler) {
+  enqueue([this, handler](std::function<void()> done) {
+    auto finish = completing(handler, std::move(done));
+    if (!msgSocket_.is_open()) {
+      finish(true);
+      return;
+    }
+    sendCmd("QUIT", [this, finish](std::optional<FTPMsg> reply) {
+      close();
+      finish(reply && reply->first == 221);
+    });
+  });
+}
+
+void FTPClient::async_signup(std::string const& uname, std::string const& pass,
+                             result_handler handler) {
+  enqueue([this, uname, pass, handler](std::function<void()> done) {
+    logIn("UADD", uname, pass, completing(handler, std::move(done)));
+  });
+}
+
+void FTPClient::async_login(std::string const& uname, std::string const& pass,
+                            result_handler handler) {
+  enqueue([this, uname, pass, handler](std::function<void()> done) {
+    auto remember = [this, uname, pass, handler](bool ok) {
+      if (ok) {
+        uname_ = uname;
+        pass_ = pass;
+      }
+      handler(ok);
+    };
+    logIn("USER", uname, pass, completing(remember, std::move(done)));
+  });
+}
+
+void FTPClient::async_upload(std::string const& local_file,
+                             std::string const& remote_file,
+                             result_handler handler) {
+  enqueue([this, local_file, remote_file,
+           handler](std::function<void()> done) {
+    uploadFile(local_file, remote_file, completing(handler, std::move(done)));
+  });
+}
+
+void FTPClient::async_download(std::string const& remote_file,
+                               std::string const& local_file,
+                               result_handler handler) {
+  enqueue([this, remote_file, local_file,
+           handler](std::function<void()> done) {
+    downloadFile(remote_file, local_file,
+                 completing(handler, std::move(done)));
+  });
+}
+
+void FTPClient::async_download_parallel(std::string const& remote_file,
+                                        std::string const& local_file,
+                                        size_t nbConnections,
+                                        result_handler handler) {
+  enqueue([this, remote_file, local_file, nbConnections,
+           handler](std::function<void()> done) {
+    result_handler finish = completing(handler, std::move(done));
+    remoteFileSize(remote_file, [this, remote_file, local_file, nbConnections,
+                                 finish](std::optional<uint64_t> fileSize) {
+      if (!fileSize || remoteIp_.empty()) {
+        finish(false);
+        return;
+      }
+      downloadRanges(remote_file, local_file, *fileSize, nbConnections,
+                     finish);
+    });
+  });
+}
+
+void FTPClient::async_mkdir(std::string const& dirName,
+                            result_handler handler) {
+  enqueue([this, dirName, handler](std::function<void()> done) {
+    simpleCommand("MKD " + dirName, completing(handler, std::move(done)));
+  });
+}
+
+void FTPClient::async_pwd(pwd_handler handler) {
+  enqueue([this, handler](std::function<void()> done) {
+    pwd_handler finish = completing(handler, std::move(done));
+    sendCmd("PWD", [finish](std::optional<FTPMsg> reply) {
+      finish(succeeded(reply), reply ? reply->second : std::string());
+    });
+  });
+}
+
+void FTPClient::async_ls(std::string const& remoteDir,
+                         listing_handler handler) {
+  enqueue([this, remoteDir, handler](std::function<void()> done) {
+    listDir(remoteDir, completing(handler, std::move(done)));
+  });
+}
+
+void FTPClient::async_cd(std::string const& remoteDir,
+                         result_handler handler) {
+  enqueue([this, remoteDir, handler](std::function<void()> done) {
+    simpleCommand("CWD " + remoteDir, completing(handler, std::move(done)));
+  });
+}
+
+void FTPClient::async_rmdir(std::string const& directory_name,
+                            result_handler handler) {
+  enqueue([this, directory_name, handler](std::function<void()> done) {
+    simpleCommand("RMD " + directory_name,
+                  completing(handler, std::move(done)));
+  });
+}
+
+void FTPClient::async_rm(std::string const& remote_file,
+                         result_handler handler) {
+  enqueue([this, remote_file, handler](std::function<void()> done) {
+    simpleCommand("DELE " + remote_file, completing(handler, std::move(done)));
+  });
+}
+
+void FTPClient::async_setCompression(bool enabled, int level,
+                                     result_handler handler) {
+  enqueue([this, enabled, level, handler](std::function<void()> done) {
+    changeMode(enabled, level, completing(handler, std::move(done)));
+  });
+}
+
+void FTPClient::connectTo(std::string const& ip, uint16_t port,
+                          result_handler handler) {
+  std::error_code ec;
+  net::ip::address address = net::ip::make_address(ip, ec);
+  if (ec) {
+    std::cerr << "Server connection error: " << ec.message() << std::endl;
+    handler(false);
+    return;
   }
+  msgInputStr_.clear();
+  msgSocket_.async_connect(
+      net::ip::tcp::endpoint(address, port),
+      net::bind_executor(strand_, [this, ip, port,
+                                   handler](std::error_code const& ec) {
+        if (ec) {
+          std::cerr << "Server connection error: " << ec.message()
+                    << std::endl;
+          handler(false);
+          return;
+        }
+        recvFTPMsg([this, ip, port, handler](std::optional<FTPMsg> reply) {
+          if (!reply || reply->first != 220) {
+            handler(false);
+            return;
+          }
+          remoteIp_ = ip;
+          remotePort_ = port;
+          std::cout << "Connected to server" << std::endl;
+          handler(true);
+        });
+      }));
 }
 
-bool FTPClient::download(std::string const& remote_file,
-                         std::string const& local_file) {
-  std::ofstream file(local_file, std::ios_base::binary);
-  if (!file.is_open()) {
+void FTPClient::logIn(std::string const& userCmd, std::string const& uname,
+                      std::string const& pass, result_handler handler) {
+  sendCmd(userCmd + " " + uname,
+          [this, pass, handler](std::optional<FTPMsg> reply) {
+            // TONOTDO we don't support ACCT command, 332 fails here
+            if (reply && reply->first == 331) {
+              sendCmd("PASS " + pass,
+                      [handler](std::optional<FTPMsg> reply) {
+                        handler(succeeded(reply));
+                      });
+              return;
+            }
+            handler(succeeded(reply));
+          });
+}
+
+void FTPClient::uploadFile(std::string const& local_file,
+                           std::string const& remote_file,
+                           result_handler handler) {
+  auto file = std::make_shared<std::ifstream>(local_file,
+                                              std::ios_base::binary);
+  if (!file->is_open()) {
     std::cerr << "Cannot open local file " << std::endl;
-    return false;
+    handler(false);
+    return;
   }
-  try {
-    if (!resetDataSocket()) {
-      return false;
-    }
-    sendCmd("RETR " + remote_file);
-    FTPMsg reply = recvFTPMsg();
-    if (isNegative(reply)) {
-      return false;
+  // A shorter remote file that starts like the local one is taken as an
+  // interrupted upload and resumed
+  remoteFileSize(remote_file, [this, file, local_file, remote_file, handler](
+                                  std::optional<uint64_t> remoteSize) {
+    std::error_code ec;
+    uint64_t localSize = std::filesystem::file_size(local_file, ec);
+    uint64_t offset = remoteSize.value_or(0);
+    if (ec || offset == 0 || offset > localSize) {
+      storeFile(file, local_file, remote_file, 0, handler);
+      return;
     }
+    samePrefix(remote_file, local_file, offset,
+               [this, file, local_file, remote_file, offset, localSize,
+                handler](bool same) {
+                 if (same && offset == localSize) {
+                   std::cout << "Remote file is already complete"
+                             << std::endl;
+                   handler(true);
+                   return;
+                 }
+                 storeFile(file, local_file, remote_file, same ? offset : 0,
+                           handler);
+               });
+  });
+}
 
-    /* Start file transfer. */
-    charbuf_ptr bufPtr = std::make_shared<std::vector<char>>(1 << 20);
-    while (size_t size = recvData(bufPtr)) {
-      file.write(bufPtr->data(), size);
-      if (file.fail()) {
-        std::cerr << "Write local file error" << std::endl;
-        return false;
+void FTPClient::storeFile(std::shared_ptr<std::ifstream> const& file,
+                          std::string const& local_file,
+                          std::string const& remote_file, uint64_t offset,
+                          result_handler handler) {
+  auto store = [this, file, local_file, remote_file,
+                handler](uint64_t offset) {
+    if (offset > 0) {
+      std::cout << "Resuming upload at byte " << offset << std::endl;
+      file->seekg(static_cast<std::streamoff>(offset));
+    }
+    sendCmd("STOR " + remote_file, [this, file, local_file, handler](
+                                       std::optional<FTPMsg> reply) {
+      if (!succeeded(reply)) {
+        closeDataSocket();
+        handler(false);
+        return;
       }
+      /* Start file transfer. */
+      chunk_filter filter;
+#if defined(FTP_HAVE_ZLIB)
+      if (modeZ_) {
+        auto deflater = std::make_shared<ZPipe>(
+            true, isCompressedFile(local_file) ? 0 : modeZLevel_);
+        filter = [deflater](charbuf_ptr const& chunk, bool last) {
+          charbuf_ptr packed(std::make_shared<std::vector<char>>());
+          deflater->run(chunk->data(), chunk->size(), last,
+                        [&packed](char const* data, size_t length) {
+                          packed->insert(packed->end(), data, data + length);
+                        });
+          return packed;
+        };
+      }
+#endif
+      sendData(file, std::make_shared<std::vector<char>>(kDataChunkSize),
+               std::move(filter), [this, file, handler](bool ok) {
+                 /* Don't keep the data connection. */
+                 file->close();
+                 endTransfer(ok, handler);
+               });
+    });
+  };
+  resetDataSocket([this, offset, store, handler](bool ok) {
+    if (!ok) {
+      handler(false);
+      return;
     }
-    /* Don't keep the data connection. */
-    file.close();
-    closeDataSocket();
-    reply = recvFTPMsg();
-    return !isNegative(reply);
-  } catch (...) {
-    // TODOcatch
-    return false;
-  }
+    if (offset == 0) {
+      store(0);
+      return;
+    }
+    restartAt(offset, [offset, store](bool accepted) {
+      store(accepted ? offset : 0);
+    });
+  });
 }
 
-bool FTPClient::resetDataSocket() {
-  // gui pasv goi port
-  sendCmd("PASV");
-  FTPMsg reply = recvFTPMsg();
-  if (isNegative(reply)) {
-    std::cerr << "Reset data socket error" << std::endl;
-    return false;
+void FTPClient::downloadFile(std::string const& remote_file,
+                             std::string const& local_file,
+                             result_handler handler) {
+  // A shorter local file that starts like the remote one is taken as an
+  // interrupted download and resumed
+  std::error_code ec;
+  uint64_t offset = std::filesystem::file_size(local_file, ec);
+  if (ec || offset == 0) {
+    retrieveFile(remote_file, local_file, 0, handler);
+    return;
   }
-  // day la IP
-  std::string& receivedMsg(reply.second);
-  size_t pos = receivedMsg.find("(") + 1, pos_1 = receivedMsg.find(",");
-  std::string IP = receivedMsg.substr(pos, pos_1 - pos);
+  remoteFileSize(remote_file, [this, remote_file, local_file, offset,
+                               handler](std::optional<uint64_t> remoteSize) {
+    if (!remoteSize || *remoteSize < offset) {
+      retrieveFile(remote_file, local_file, 0, handler);
+      return;
+    }
+    samePrefix(remote_file, local_file, offset,
+               [this, remote_file, local_file, offset,
+                remoteSize = *remoteSize, handler](bool same) {
+                 if (same && offset == remoteSize) {
+                   std::cout << "Local file is already complete" << std::endl;
+                   handler(true);
+                   return;
+                 }
+                 retrieveFile(remote_file, local_file, same ? offset : 0,
+                              handler);
+               });
+  });
+}
 
-  for (int i = 0; i < 3; ++i) {
-    IP += ".";
-    pos = pos_1 + 1;
-    pos_1 = receivedMsg.find(",", pos_1 + 1, 1);
-    IP += receivedMsg.substr(pos, pos_1 - pos);
-  }
+void FTPClient::retrieveFile(std::string const& remote_file,
+                             std::string const& local_file, uint64_t offset,
+                             result_handler handler) {
+  auto retrieve = [this, remote_file, local_file, handler](uint64_t offset) {
+    auto file = std::make_shared<std::ofstream>();
+    if (offset > 0) {
+      std::cout << "Resuming download at byte " << offset << std::endl;
+      file->open(local_file, std::ios_base::in | std::ios_base::out |
+                                 std::ios_base::binary);
+      file->seekp(static_cast<std::streamoff>(offset));
+    } else {
+      file->open(local_file, std::ios_base::binary);
+    }
+    if (!file->is_open()) {
+      std::cerr << "Cannot open local file " << std::endl;
+      closeDataSocket();
+      handler(false);
+      return;
+    }
+    sendCmd("RETR " + remote_file, [this, file, handler](
+                                       std::optional<FTPMsg> reply) {
+      if (!succeeded(reply)) {
+        closeDataSocket();
+        handler(false);
+        return;
+      }
+      /* Start file transfer. */
+      std::function<bool()> complete;
+      data_sink sink = decodeInto(
+          modeZ_,
+          [file](char const* data, size_t length) {
+            if (!file->write(data, length)) {
+              std::cerr << "Write local file error" << std::endl;
+              return false;
+            }
+            return true;
+          },
+          complete);
+      recvData(std::make_shared<std::vector<char>>(kDataChunkSize), kNoLimit,
+               std::move(sink), [this, file, complete, handler](bool ok) {
+                 if (ok && !complete()) {
+                   std::cerr << "Compressed data ended early" << std::endl;
+                   ok = false;
+                 }
+                 /* Don't keep the data connection. */
+                 file->close();
+                 endTransfer(ok, handler);
+               });
+    });
+  };
+  resetDataSocket([this, offset, retrieve, handler](bool ok) {
+    if (!ok) {
+      handler(false);
+      return;
+    }
+    if (offset == 0) {
+      retrieve(0);
+      return;
+    }
+    restartAt(offset, [offset, retrieve](bool accepted) {
+      retrieve(accepted ? offset : 0);
+    });
+  });
+}
 
-  // day là port
-  pos = pos_1 + 1;
-  pos_1 = receivedMsg.find(",", pos_1 + 1, 1);
-  uint8_t n1 = std::stoi(receivedMsg.substr(pos, pos_1 - pos));
-  pos = pos_1 + 1;
-  pos_1 = receivedMsg.find(")", pos_1 + 1, 1);
-  uint8_t n2 = std::stoi(receivedMsg.substr(pos, pos_1 - pos));
-  uint16_t port = (n1 << 8) | n2;
-  try {
-    closeDataSocket();
-    net::ip::tcp::endpoint svDataEndpoint(net::ip::make_address(IP), port);
-    dataSocket_.connect(svDataEndpoint);
-  } catch (std::system_error const& er) {
-    std::cerr << "Open data socket error: " << er.what() << std::endl;
-    dataSocket_.close();
-    return false;
-  }
-  return true;
+void FTPClient::fetchRange(
+    std::string const& remote_file, uint64_t offset, uint64_t length,
+    std::function<bool(char const*, size_t, uint64_t)> const& write,
+    std::atomic<uint64_t>& received, result_handler handler) {
+  auto retrieve = [this, remote_file, offset, length, write, &received,
+                   handler]() {
+    sendCmd("RETR " + remote_file, [this, offset, length, write, &received,
+                                    handler](std::optional<FTPMsg> reply) {
+      if (!succeeded(reply)) {
+        closeDataSocket();
+        handler(false);
+        return;
+      }
+      data_sink sink = [write, &received, position = offset](
+                           char const* data, size_t size) mutable {
+        if (!write(data, size, position)) {
+          return false;
+        }
+        position += size;
+        received += size;
+        return true;
+      };
+      recvData(std::make_shared<std::vector<char>>(kDataChunkSize), length,
+               std::move(sink), [this, handler](bool ok) {
+                 // The server is still sending the rest of the file;
+                 // cutting the data connection ends that and it replies
+                 // 426 rather than 226.
+                 closeDataSocket();
+                 recvFTPMsg([ok, handler](std::optional<FTPMsg>) {
+                   handler(ok);
+                 });
+               });
+    });
+  };
+  resetDataSocket([this, offset, retrieve, handler](bool ok) {
+    if (!ok) {
+      handler(false);
+      return;
+    }
+    if (offset == 0) {
+      retrieve();
+      return;
+    }
+    restartAt(offset, [retrieve, handler](bool accepted) {
+      if (accepted) {
+        retrieve();
+      } else {
+        handler(false);
+      }
+    });
+  });
 }
 
-std::string FTPClient::recvListDir() {
-  std::string reply;
+void FTPClient::downloadRanges(std::string const& remote_file,
+                               std::string const& local_file,
+                               uint64_t fileSize, size_t nbConnections,
+                               result_handler handler) {
+  // Segments below 1 MiB are not worth a connection
+  uint64_t maxSegments = std::max<uint64_t>(fileSize >> 20, 1);
+  size_t nbSegments = static_cast<size_t>(
+      std::clamp<uint64_t>(nbConnections, 1, maxSegments));
+  auto state = std::make_shared<RangeDownload>(context_);
+  state->fileSize = fileSize;
+
+#if defined(__unix__)
+  int fd = ::open(local_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                  0644);
+  if (fd < 0 || ::ftruncate(fd, static_cast<off_t>(fileSize)) != 0) {
+    std::cerr << "Cannot open local file " << std::endl;
+    if (fd >= 0) {
+      ::close(fd);
+    }
+    handler(false);
+    return;
+  }
+#if defined(__linux__)
+  // Reserve the blocks up front, segments are written out of order
+  ::posix_fallocate(fd, 0, static_cast<off_t>(fileSize));
+#endif
+  state->fd = fd;
+#else
+  {
+    std::ofstream create(local_file, std::ios_base::binary);
+    if (!create.is_open()) {
+      std::cerr << "Cannot open local file " << std::endl;
+      handler(false);
+      return;
+    }
+  }
   std::error_code ec;
-  net::read(dataSocket_, net::dynamic_buffer(reply), ec);
+  std::filesystem::resize_file(local_file, fileSize, ec);
+  if (ec) {
+    std::cerr << "Cannot allocate local file " << std::endl;
+    handler(false);
+    return;
+  }
+#endif
+
+  // Runs on the parent's strand once every range connection is through
+  auto finish = [this, state, handler, nbSegments]() {
+    state->timer.cancel();
+#if defined(__unix__)
+    ::close(state->fd);
+#else
+    state->outputs.clear();
+#endif
+    uint64_t received = state->received;
+    double seconds = std::chrono::duration<double>(
+                         std::chrono::steady_clock::now() - state->start)
+                         .count();
+    std::cout << std::fixed << std::setprecision(1) << "Received "
+              << received / double(1 << 20) << " MiB in " << seconds
+              << " s over " << nbSegments << " connections ("
+              << received / std::max(seconds, 1e-6) / (1 << 20)
+              << " MiB/s)" << std::endl;
+    handler(!state->failed && received == state->fileSize);
+  };
 
-  if (ec == net::error::eof) {
-    /* Ignore eof. */
-  } else if (ec) {
-    std::cerr << "Receive directories error: " << ec.message() << std::endl;
-    throw ec;
+  state->nbPending = nbSegments;
+  state->start = state->lastReport = std::chrono::steady_clock::now();
+  uint64_t segmentSize = fileSize / nbSegments;
+  for (size_t segment = 0; segment < nbSegments; ++segment) {
+    uint64_t offset = segment * segmentSize;
+    uint64_t length =
+        segment + 1 == nbSegments ? fileSize - offset : segmentSize;
+#if defined(__unix__)
+    auto write = [fd](char const* data, size_t size, uint64_t at) {
+      return writeAt(fd, data, size, at);
+    };
+#else
+    state->outputs.push_back(std::make_unique<std::fstream>(
+        local_file,
+        std::ios_base::in | std::ios_base::out | std::ios_base::binary));
+    std::fstream* out = state->outputs.back().get();
+    auto write = [out](char const* data, size_t size, uint64_t at) {
+      out->seekp(static_cast<std::streamoff>(at));
+      out->write(data, size);
+      return out->good();
+    };
+#endif
+    state->workers.push_back(std::make_unique<FTPClient>(context_));
+    FTPClient* worker = state->workers.back().get();
+    // Counted on the worker's strand, after the worker's last handler has
+    // returned, so the workers may go as soon as the count reaches zero
+    auto report = [this, worker, state, finish](bool ok) {
+      net::post(worker->strand_, [this, state, finish, ok]() {
+        if (!ok) {
+          state->failed = true;
+        }
+        if (--state->nbPending == 0) {
+          net::post(strand_, finish);
+        }
+      });
+    };
+    worker->async_connect(remoteIp_, remotePort_, [=](bool ok) {
+      if (!ok) {
+        report(false);
+        return;
+      }
+      worker->async_login(uname_, pass_, [=](bool ok) {
+        if (!ok) {
+          report(false);
+          return;
+        }
+        worker->enqueue([=](std::function<void()> done) {
+          worker->fetchRange(remote_file, offset, length, write,
+                             state->received,
+                             completing(report, std::move(done)));
+        });
+      });
+    });
   }
-  return reply;
+  reportProgress(state, strand_);
 }
 
-size_t FTPClient::recvData(charbuf_ptr const& bufPtr) {
-  std::error_code ec;
-  size_t size = dataSocket_.read_some(net::buffer(*bufPtr, bufPtr->size()), ec);
+void FTPClient::listDir(std::string const& remoteDir,
+                        listing_handler handler) {
+  auto receive = [this, handler](std::optional<FTPMsg> const& reply,
+                                 bool machineFormat) {
+    if (!succeeded(reply)) {
+      closeDataSocket();
+      handler(false, std::nullopt);
+      return;
+    }
+    auto body = std::make_shared<std::string>();
+    std::function<bool()> complete;
+    data_sink sink = decodeInto(
+        modeZ_,
+        [body](char const* data, size_t length) {
+          body->append(data, length);
+          return true;
+        },
+        complete);
+    recvData(std::make_shared<std::vector<char>>(kListingChunkSize),
+             kNoLimit, std::move(sink),
+             [this, body, complete, machineFormat, handler](bool ok) {
+               if (ok && !complete()) {
+                 std::cerr << "Corrupt compressed listing" << std::endl;
+                 ok = false;
+               }
+               endTransfer(ok, [body, machineFormat, handler](bool ok) {
+                 handler(ok, dir_listing(std::move(*body), machineFormat));
+               });
+             });
+  };
+  resetDataSocket([this, remoteDir, receive, handler](bool ok) {
+    if (!ok) {
+      handler(false, std::nullopt);
+      return;
+    }
+    // Prefer the machine readable listing, fall back to LIST on servers
+    // that do not know MLSD. The data connection is still pending then.
+    sendCmd("MLSD " + remoteDir,
+            [this, remoteDir, receive](std::optional<FTPMsg> reply) {
+              if (reply && (reply->first == 500 || reply->first == 502)) {
+                sendCmd("LIST " + remoteDir,
+                        [receive](std::optional<FTPMsg> reply) {
+                          receive(reply, false);
+                        });
+                return;
+              }
+              receive(reply, true);
+            });
+  });
+}
 
-  if (ec == net::error::eof) {
-    /* Ignore eof. */
-  } else if (ec) {
-    std::cerr << "Receive file data err: " << ec.message() << std::endl;
-  }
-  return size;
+void FTPClient::simpleCommand(std::string const& cmd,
+                              result_handler handler) {
+  sendCmd(cmd, [handler](std::optional<FTPMsg> reply) {
+    handler(succeeded(reply));
+  });
 }
 
-void FTPClient::sendData(charbuf_ptr const& data) {
-  std::error_code ec;
-  net::write(dataSocket_, net::buffer(*data), ec);
-  if (ec) {
-    std::cerr << "Send data aborted: " << ec.message() << std::endl;
-    throw ec;
+void FTPClient::changeMode(bool enabled, int level, result_handler handler) {
+#if !defined(FTP_HAVE_ZLIB)
+  if (enabled) {
+    std::cerr << "Built without zlib, MODE Z is not available" << std::endl;
+    handler(false);
+    return;
   }
+#endif
+  sendCmd(enabled ? "MODE Z" : "MODE S", [this, enabled, level, handler](
+                                             std::optional<FTPMsg> reply) {
+    if (!succeeded(reply)) {
+      handler(false);
+      return;
+    }
+    modeZ_ = enabled;
+    if (!enabled || level < 0 || level > 9) {
+      handler(true);
+      return;
+    }
+    sendCmd("OPTS MODE Z LEVEL " + std::to_string(level),
+            [this, level, handler](std::optional<FTPMsg> reply) {
+              // A refused level leaves the one the server still uses
+              if (!reply || reply->first != 200) {
+                handler(false);
+                return;
+              }
+              modeZLevel_ = level;
+              handler(true);
+            });
+  });
 }
 
-void FTPClient::closeDataSocket() {
-  if (dataSocket_.is_open()) {
-    dataSocket_.shutdown(net::ip::tcp::socket::shutdown_both);
-    dataSocket_.close();
+void FTPClient::sendCmd(std::string const& cmd, reply_handler handler) {
+  std::cout << "CLI >> " << cmd << std::endl;
+  auto line = std::make_shared<std::string>(cmd + "\r\n");
+  net::async_write(
+      msgSocket_, net::buffer(*line),
+      net::bind_executor(strand_, [this, line, handler](
+                                      std::error_code const& ec, size_t) {
+        if (ec) {
+          std::cerr << "Send command error: " << ec.message() << std::endl;
+          handler(std::nullopt);
+          return;
+        }
+        recvFTPMsg(handler);
+      }));
+}
+
+void FTPClient::recvFTPMsg(reply_handler handler, std::optional<FTPMsg> first) {
+  // read_until may read past the line, keep the rest for the next reply
+  net::async_read_until(
+      msgSocket_, net::dynamic_buffer(msgInputStr_), "\r\n",
+      net::bind_executor(strand_, [this, handler, first](
+                                      std::error_code const& ec,
+                                      size_t len) mutable {
+        if (ec) {
+          if (ec != net::error::eof) {
+            std::cerr << "Receive message error: " << ec.message()
+                      << std::endl;
+          }
+          handler(std::nullopt);
+          return;
+        }
+        std::string line = msgInputStr_.substr(0, len - 2);
+        msgInputStr_.erase(0, len);
+        int code = replyCode(line);
+        if (first) {
+          // Body of a multi-line reply, it ends with "<code> <text>"
+          if (code == first->first && line.size() > 3 && line[3] == ' ') {
+            handler(std::move(first));
+          } else {
+            first->second += '\n' + line;
+            recvFTPMsg(std::move(handler), std::move(first));
+          }
+          return;
+        }
+        if (code < 0) {
+          std::cerr << "Malformed reply: " << line << std::endl;
+          handler(std::nullopt);
+          return;
+        }
+        std::string msg = line.size() > 4 ? line.substr(4) : std::string();
+        std::cout << "CLI << " << code << ' ' << msg << std::endl;
+        if (line.size() > 3 && line[3] == '-') {
+          recvFTPMsg(std::move(handler), FTPMsg(code, std::move(msg)));
+          return;
+        }
+        handler(FTPMsg(code, std::move(msg)));
+      }));
+}
+
+void FTPClient::remoteFileSize(
+    std::string const& remote_file,
+    std::function<void(std::optional<uint64_t>)> handler) {
+  sendCmd("SIZE " + remote_file, [handler](std::optional<FTPMsg> reply) {
+    if (!reply || reply->first != 213) {
+      handler(std::nullopt);
+      return;
+    }
+    try {
+      handler(std::stoull(reply->second));
+    } catch (std::logic_error const&) {
+      handler(std::nullopt);
+    }
+  });
+}
+
+void FTPClient::restartAt(uint64_t offset, result_handler handler) {
+  sendCmd("REST " + std::to_string(offset),
+          [handler](std::optional<FTPMsg> reply) {
+            handler(reply && reply->first == 350);
+          });
+}
+
+void FTPClient::samePrefix(std::string const& remote_file,
+                           std::string const& local_file, uint64_t length,
+                           result_handler handler) {
+#if defined(FTP_HAVE_ZLIB)
+  std::ifstream file(local_file, std::ios_base::binary);
+  std::vector<char> buffer(kDataChunkSize);
+  uLong localCrc = crc32(0, Z_NULL, 0);
+  for (uint64_t left = length; left > 0 && file;) {
+    file.read(buffer.data(),
+              static_cast<std::streamsize>(std::min<uint64_t>(
+                  left, buffer.size())));
+    auto nbRead = static_cast<size_t>(file.gcount());
+    localCrc = crc32(localCrc, reinterpret_cast<Bytef const*>(buffer.data()),
+                     static_cast<uInt>(nbRead));
+    left -= nbRead;
   }
+  if (!file) {
+    handler(false);
+    return;
+  }
+  sendCmd("XCRC \"" + remote_file + "\" 0 " + std::to_string(length - 1),
+          [localCrc, handler](std::optional<FTPMsg> reply) {
+            if (!reply || reply->first != 250) {
+              handler(false);
+              return;
+            }
+            try {
+              handler(std::stoul(reply->second, nullptr, 16) == localCrc);
+            } catch (std::logic_error const&) {
+              handler(false);
+            }
+          });
+#else
+  // Not checked without zlib's CRC-32, the whole file is transferred
+  handler(false);
+#endif
 }
 
-bool FTPClient::rmdir(std::string const& directory_name) {
-  try {
-    sendCmd("RMD " + directory_name);
-    FTPMsg reply = recvFTPMsg();
+void FTPClient::resetDataSocket(result_handler handler) {
+  // gui pasv goi port
+  sendCmd("PASV", [this, handler](std::optional<FTPMsg> reply) {
+    net::ip::tcp::endpoint svDataEndpoint;
+    if (!succeeded(reply) ||
+        !parsePassiveReply(reply->second, svDataEndpoint)) {
+      std::cerr << "Reset data socket error" << std::endl;
+      handler(false);
+      return;
+    }
+    closeDataSocket();
+    dataSocket_.async_connect(
+        svDataEndpoint,
+        net::bind_executor(strand_, [this, handler](std::error_code const& ec) {
+          if (ec) {
+            std::cerr << "Open data socket error: " << ec.message()
+                      << std::endl;
+            closeDataSocket();
+            handler(false);
+            return;
+          }
+          handler(true);
+        }));
+  });
+}
 
-    return !isNegative(reply);
-  } catch (...) {
-    // TODOcatch
-    return false;
+void FTPClient::recvData(charbuf_ptr const& bufPtr, uint64_t limit,
+                         data_sink sink, result_handler handler) {
+  bufPtr->resize(std::min<uint64_t>(limit, bufPtr->capacity()));
+  dataSocket_.async_read_some(
+      net::buffer(*bufPtr),
+      net::bind_executor(strand_, [this, bufPtr, limit, sink, handler](
+                                      std::error_code const& ec,
+                                      size_t size) mutable {
+        if (ec) {
+          if (ec != net::error::eof) {
+            std::cerr << "Receive file data err: " << ec.message()
+                      << std::endl;
+          }
+          // Running out early only matters when a length was asked for
+          handler(ec == net::error::eof && limit == kNoLimit);
+          return;
+        }
+        if (!sink(bufPtr->data(), size)) {
+          handler(false);
+          return;
+        }
+        if (limit != kNoLimit && (limit -= size) == 0) {
+          handler(true);
+          return;
+        }
+        recvData(bufPtr, limit, std::move(sink), std::move(handler));
+      }));
+}
+
+void FTPClient::sendData(std::shared_ptr<std::istream> const& file,
+                         charbuf_ptr const& bufPtr, chunk_filter filter,
+                         result_handler handler) {
+  bufPtr->resize(bufPtr->capacity());
+  file->read(bufPtr->data(), bufPtr->size());
+  bufPtr->resize(file->gcount());
+  if (file->fail() && !file->eof()) {
+    std::cerr << "Read local file error" << std::endl;
+    handler(false);
+    return;
   }
+  bool last = file->eof();
+  charbuf_ptr chunk = filter ? filter(bufPtr, last) : bufPtr;
+  net::async_write(
+      dataSocket_, net::buffer(*chunk),
+      net::bind_executor(strand_, [this, file, bufPtr, chunk, last, filter,
+                                   handler](std::error_code const& ec,
+                                            size_t) mutable {
+        if (ec) {
+          std::cerr << "Send data aborted: " << ec.message() << std::endl;
+          handler(false);
+          return;
+        }
+        if (last) {
+          handler(true);
+          return;
+        }
+        sendData(file, bufPtr, std::move(filter), std::move(handler));
+      }));
 }
 
-bool FTPClient::rm(std::string const& remote_file) {
-  try {
-    sendCmd("RMD " + remote_file);
-    FTPMsg reply = recvFTPMsg();
+void FTPClient::endTransfer(bool ok, result_handler handler) {
+  closeDataSocket();
+  recvFTPMsg([ok, handler](std::optional<FTPMsg> reply) {
+    handler(ok && succeeded(reply));
+  });
+}
 
-    return !isNegative(reply);
-  } catch (...) {
-    // TODOcatch
-    return false;
+void FTPClient::closeDataSocket() {
+  if (dataSocket_.is_open()) {
+    // The server may have closed or reset its end already
+    std::error_code ec;
+    dataSocket_.shutdown(net::ip::tcp::socket::shutdown_both, ec);
+    dataSocket_.close(ec);
   }
-}
\ No newline at end of file
+}
@@ -1,26 +1,65 @@
 #include <experimental/io_context>
 #include <experimental/internet>
+#include <experimental/executor>
 
+#include <atomic>
+#include <deque>
 #include <fstream>
+#include <functional>
 #include <list>
+#include <memory>
 #include <optional>
 #include <string>
+#include <string_view>
 #include <sstream>
 #include <utility>
+#include <vector>
 
 namespace net = std::experimental::net;
 using FTPMsg = std::pair<int, std::string>;
 
+// Fields are views into the listing body owned by dir_listing. MLSD
+// listings have no owner/group and give the UTC time as YYYYMMDDHHMMSS.
 struct dir_entry {
   bool dir;
-  std::string ower, group, size, stringtime, filename;
+  std::string_view ower, group, size, stringtime, filename, unique;
 };
 
+class dir_listing {
+ public:
+  using const_iterator = std::vector<dir_entry>::const_iterator;
+
+  // Parses an MLSD body if machineFormat is set, a LIST body otherwise
+  dir_listing(std::string body, bool machineFormat);
+
+  const_iterator begin() const { return entries_.begin(); }
+  const_iterator end() const { return entries_.end(); }
+  size_t size() const { return entries_.size(); }
+
+ private:
+  std::shared_ptr<std::string const> body_;
+  std::vector<dir_entry> entries_;
+};
+
+// Every operation has a blocking form and an async_ form. The async forms
+// queue the operation and return at once; operations of one client run one
+// after the other, those of different clients sharing an io_context run
+// side by side on whatever threads run it. Handlers are called on the
+// client's strand. The client must outlive its pending operations.
 class FTPClient {
   using charbuf_ptr = std::shared_ptr<std::vector<char>>;
 
  public:
+  using result_handler = std::function<void(bool)>;
+  using pwd_handler = std::function<void(bool, std::string)>;
+  using listing_handler =
+      std::function<void(bool, std::optional<dir_listing>)>;
+
+  // Runs the blocking calls on an io_context of its own
   FTPClient();
+  // Runs on context, which someone else runs. The blocking calls then wait
+  // for those threads and must not be made from one of them.
+  explicit FTPClient(net::io_context& context);
   virtual ~FTPClient();
   bool connect(std::string const& ip, uint16_t port);
   void close();
@@ -29,27 +68,124 @@ class FTPClient {
   bool login(std::string const& uname, std::string const& pass);
   bool upload(std::string const& local_file, std::string const& remote_file);
   bool download(std::string const& remote_file, std::string const& local_file);
+  // Downloads nbConnections byte ranges of the file at once, each over its
+  // own control and data connection, straight into a preallocated file.
+  bool download_parallel(std::string const& remote_file,
+                         std::string const& local_file, size_t nbConnections);
   bool mkdir(std::string const& dirName);
   std::pair<bool, std::string> pwd();
-  std::pair<bool, std::optional<std::list<dir_entry>>> ls(
-      std::string const& remoteDir);
+  std::pair<bool, std::optional<dir_listing>> ls(std::string const& remoteDir);
   bool cd(std::string const& remoteDir);
   bool rmdir(std::string const& directory_name);
   bool rm(std::string const& remote_file);
+  // MODE Z: deflate every transfer. level 0-9 sets the compression level of
+  // both sides, -1 keeps the defaults. Fails when built without zlib.
+  bool setCompression(bool enabled, int level = -1);
+
+  void async_connect(std::string const& ip, uint16_t port,
+                     result_handler handler);
+  // Sends QUIT, then closes the connections. The client may connect again.
+  void async_close(result_handler handler);
+  void async_signup(std::string const& uname, std::string const& pass,
+                    result_handler handler);
+  void async_login(std::string const& uname, std::string const& pass,
+                   result_handler handler);
+  void async_upload(std::string const& local_file,
+                    std::string const& remote_file, result_handler handler);
+  void async_download(std::string const& remote_file,
+                      std::string const& local_file, result_handler handler);
+  // The range connections share this client's io_context
+  void async_download_parallel(std::string const& remote_file,
+                               std::string const& local_file,
+                               size_t nbConnections, result_handler handler);
+  void async_mkdir(std::string const& dirName, result_handler handler);
+  void async_pwd(pwd_handler handler);
+  void async_ls(std::string const& remoteDir, listing_handler handler);
+  void async_cd(std::string const& remoteDir, result_handler handler);
+  void async_rmdir(std::string const& directory_name, result_handler handler);
+  void async_rm(std::string const& remote_file, result_handler handler);
+  void async_setCompression(bool enabled, int level, result_handler handler);
 
  private:
-  FTPMsg recvFTPMsg();
-  void sendCmd(std::string const& cmd);
-  std::string recvListDir();
-  void sendData(charbuf_ptr const& data);
-  size_t recvData(charbuf_ptr const& bufPtr);
+  using reply_handler = std::function<void(std::optional<FTPMsg>)>;
+  using data_sink = std::function<bool(char const*, size_t)>;
+  // Turns a chunk read from a local file into what goes on the wire
+  using chunk_filter = std::function<charbuf_ptr(charbuf_ptr const&, bool)>;
+  using operation = std::function<void(std::function<void()> done)>;
+
+  // Queues op; it runs once the operations queued before it called done
+  void enqueue(operation op);
+  void startNextOp();
+  // Runs start on the io_context until it hands over a result
+  template <typename Result>
+  Result runBlocking(std::function<void(std::function<void(Result)>)> start,
+                     size_t nbThreads = 1);
+
+  void connectTo(std::string const& ip, uint16_t port, result_handler handler);
+  void logIn(std::string const& userCmd, std::string const& uname,
+             std::string const& pass, result_handler handler);
+  // These two look for an interrupted transfer to resume first
+  void uploadFile(std::string const& local_file, std::string const& remote_file,
+                  result_handler handler);
+  void downloadFile(std::string const& remote_file,
+                    std::string const& local_file, result_handler handler);
+  void storeFile(std::shared_ptr<std::ifstream> const& file,
+                 std::string const& local_file, std::string const& remote_file,
+                 uint64_t offset, result_handler handler);
+  void retrieveFile(std::string const& remote_file,
+                    std::string const& local_file, uint64_t offset,
+                    result_handler handler);
+  void downloadRanges(std::string const& remote_file,
+                      std::string const& local_file, uint64_t fileSize,
+                      size_t nbConnections, result_handler handler);
+  void listDir(std::string const& remoteDir, listing_handler handler);
+  void simpleCommand(std::string const& cmd, result_handler handler);
+  void changeMode(bool enabled, int level, result_handler handler);
+
+  void sendCmd(std::string const& cmd, reply_handler handler);
+  // first holds the start of a multi-line reply while its body is read
+  void recvFTPMsg(reply_handler handler, std::optional<FTPMsg> first = {});
+  void remoteFileSize(std::string const& remote_file,
+                      std::function<void(std::optional<uint64_t>)> handler);
+  void restartAt(uint64_t offset, result_handler handler);
+  // Whether the first length bytes of both files match, as told by XCRC.
+  // False when that cannot be checked.
+  void samePrefix(std::string const& remote_file,
+                  std::string const& local_file, uint64_t length,
+                  result_handler handler);
+  // Receives length bytes of remote_file from offset on, passing them to
+  // write along with their file offset.
+  void fetchRange(
+      std::string const& remote_file, uint64_t offset, uint64_t length,
+      std::function<bool(char const*, size_t, uint64_t)> const& write,
+      std::atomic<uint64_t>& received, result_handler handler);
+  // Feeds the data connection to sink until it ends or limit bytes came
+  void recvData(charbuf_ptr const& bufPtr, uint64_t limit, data_sink sink,
+                result_handler handler);
+  // Sends file through filter (none in stream mode) until its end
+  void sendData(std::shared_ptr<std::istream> const& file,
+                charbuf_ptr const& bufPtr, chunk_filter filter,
+                result_handler handler);
+  // Closes the data connection and reads the transfer's final reply
+  void endTransfer(bool ok, result_handler handler);
 
   void closeDataSocket();
-  bool resetDataSocket();
+  void resetDataSocket(result_handler handler);
 
   std::string currentDir_;
+  // Needed to open more connections for parallel downloads
+  std::string remoteIp_;
+  uint16_t remotePort_;
+  std::string uname_, pass_;
+  std::string msgInputStr_;
+  bool modeZ_;
+  int modeZLevel_;
 
-  net::io_context ioContext_;
+  std::unique_ptr<net::io_context> ownContext_;
+  net::io_context& context_;
+  net::strand<net::io_context::executor_type> strand_;
+  std::deque<operation> pendingOps_;
+  bool opRunning_;
   net::ip::tcp::socket msgSocket_;
   net::ip::tcp::socket dataSocket_;
-};
\ No newline at end of file
+};
@@ -54,6 +54,31 @@ static void cmdup(FTPClient& client, std::string const& fl,
   }
 }
 
+static void cmdpdown(FTPClient& client, std::string const& fr,
+                     std::string const& fl, std::string const& nb) {
+  size_t nbConnections = 4;
+  if (!nb.empty()) {
+    try {
+      nbConnections = std::stoul(nb);
+    } catch (std::logic_error const&) {
+      std::cout << "Invalid number of connections" << std::endl;
+      return;
+    }
+  }
+  if (!client.download_parallel(fr, fl, nbConnections)) {
+    std::cout << "Download file failed" << std::endl;
+  }
+}
+
+// "mode z" compresses the following transfers, "mode s" switches back
+static void cmdmode(FTPClient& client, std::string const& para) {
+  if (para == "z" || para == "Z") {
+    client.setCompression(true);
+  } else if (para == "s" || para == "S") {
+    client.setCompression(false);
+  }
+}
+
 static const std::map<std::string, std::function<void(FTPClient&, std::string)>>
     cmdMap{
         {"ls", [&](FTPClient& client,
@@ -66,12 +91,14 @@ static const std::map<std::string, std::function<void(FTPClient&, std::string)>>
                    std::string const& para) { cmdrm(client, para); }},
         {"rmdir", [&](FTPClient& client,
                       std::string const& para) { cmdrmdir(client, para); }},
+        {"mode", [&](FTPClient& client,
+                     std::string const& para) { cmdmode(client, para); }},
     };
 
 bool processCmd(FTPClient& client, std::string const& cmdLine) {
   std::stringstream ss(cmdLine);
-  std::string cmd, para, para2;
-  ss >> cmd >> para >> para2;
+  std::string cmd, para, para2, para3;
+  ss >> cmd >> para >> para2 >> para3;
   auto commandIt = cmdMap.find(cmd);
   if (commandIt != cmdMap.end()) {
     commandIt->second(client, para);
@@ -82,6 +109,9 @@ bool processCmd(FTPClient& client, std::string const& cmdLine) {
   if (cmd == "down") {
     cmddown(client, para, para2);
   }
+  if (cmd == "pdown") {
+    cmdpdown(client, para, para2, para3);
+  }
   if (cmd == "exit") {
     return false;
   }
@@ -0,0 +1,502 @@
+#include <experimental/io_context>
+
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#if defined(__unix__)
+#include <sys/resource.h>
+#endif
+
+#include "FTPClient.hpp"
+
+namespace fs = std::filesystem;
+namespace net = std::experimental::net;
+using steady_clock = std::chrono::steady_clock;
+
+namespace {
+// Client calls that are timed
+enum class Op { CONNECT = 0, LOGIN, QUIT, LIST, STOR, DELE, RETR };
+constexpr size_t kNbOps = 7;
+constexpr char const* kOpNames[kNbOps] = {"CONNECT", "LOGIN", "QUIT", "LIST",
+                                          "STOR",    "DELE",  "RETR"};
+
+// What a session does over and over until the run ends:
+//   login  connect, log in, quit
+//   list   list a directory
+//   stor   upload a small file, then delete it
+//   retr   download a large file
+enum class Scenario { LOGIN = 0, LIST, STOR, RETR };
+constexpr size_t kNbScenarios = 4;
+constexpr char const* kScenarioNames[kNbScenarios] = {"login", "list", "stor",
+                                                      "retr"};
+
+#if defined(_WIN32)
+constexpr char const* kNullDevice = "NUL";
+#else
+constexpr char const* kNullDevice = "/dev/null";
+#endif
+constexpr char const* kLargeRemoteFile = "loadgen-large.bin";
+
+struct Options {
+  std::string host = "127.0.0.1";
+  uint16_t port = 2121;
+  std::string user = "test";
+  std::string pass = "123";
+  size_t nbSessions = 1000;
+  size_t nbThreads = std::max(1u, std::thread::hardware_concurrency());
+  std::chrono::seconds duration{10};
+  std::array<unsigned, kNbScenarios> weights{1, 1, 1, 1};
+  uint64_t smallFileSize = 4 << 10;
+  uint64_t largeFileSize = 64 << 20;
+  std::string listDir = "/";
+};
+
+struct OpStats {
+  std::vector<uint32_t> latenciesUs;
+  size_t failures = 0;
+};
+
+// Only touched from the strand of its client while the load runs
+struct Session {
+  size_t id;
+  Scenario scenario;
+  std::unique_ptr<FTPClient> client;
+  bool loggedIn = false;
+  uint64_t iteration = 0;
+  uint64_t bytes = 0;
+  std::array<OpStats, kNbOps> stats;
+};
+
+class LoadGenerator {
+ public:
+  LoadGenerator(Options const& options, fs::path const& smallFile)
+      : options_(options), smallFile_(smallFile.string()) {}
+
+  void run() {
+    unsigned totalWeight = 0;
+    for (unsigned weight : options_.weights) {
+      totalWeight += weight;
+    }
+    for (size_t id = 0; id < options_.nbSessions; ++id) {
+      auto session = std::make_unique<Session>();
+      session->id = id;
+      session->scenario = pickScenario(id % totalWeight);
+      session->client = std::make_unique<FTPClient>(context_);
+      sessions_.push_back(std::move(session));
+    }
+    start_ = steady_clock::now();
+    deadline_ = start_ + options_.duration;
+    for (auto const& session : sessions_) {
+      step(*session);
+    }
+    // run() returns once every session saw the deadline and quit
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < options_.nbThreads; ++i) {
+      threads.emplace_back([this]() { context_.run(); });
+    }
+    for (std::thread& thread : threads) {
+      thread.join();
+    }
+    end_ = steady_clock::now();
+  }
+
+  void report(std::ostream& out) const {
+    double seconds = std::chrono::duration<double>(end_ - start_).count();
+    std::array<size_t, kNbScenarios> nbSessions{};
+    std::array<OpStats, kNbOps> merged;
+    uint64_t bytes = 0;
+    for (auto const& session : sessions_) {
+      ++nbSessions[static_cast<size_t>(session->scenario)];
+      bytes += session->bytes;
+      for (size_t op = 0; op < kNbOps; ++op) {
+        OpStats const& stats = session->stats[op];
+        merged[op].latenciesUs.insert(merged[op].latenciesUs.end(),
+                                      stats.latenciesUs.begin(),
+                                      stats.latenciesUs.end());
+        merged[op].failures += stats.failures;
+      }
+    }
+
+    out << "Sessions:";
+    for (size_t scenario = 0; scenario < kNbScenarios; ++scenario) {
+      out << ' ' << kScenarioNames[scenario] << '=' << nbSessions[scenario];
+    }
+    out << "\nElapsed: " << std::fixed << std::setprecision(2) << seconds
+        << " s, " << options_.nbThreads << " threads\n\n";
+    out << std::left << std::setw(8) << "command" << std::right
+        << std::setw(10) << "ok" << std::setw(8) << "failed" << std::setw(12)
+        << "per sec" << std::setw(11) << "p50 ms" << std::setw(11) << "p99 ms"
+        << std::setw(11) << "p999 ms" << '\n';
+    size_t nbCommands = 0;
+    for (size_t op = 0; op < kNbOps; ++op) {
+      std::vector<uint32_t>& latencies = merged[op].latenciesUs;
+      if (latencies.empty() && merged[op].failures == 0) {
+        continue;
+      }
+      std::sort(latencies.begin(), latencies.end());
+      nbCommands += latencies.size();
+      out << std::left << std::setw(8) << kOpNames[op] << std::right
+          << std::setw(10) << latencies.size() << std::setw(8)
+          << merged[op].failures << std::setw(12) << std::setprecision(1)
+          << latencies.size() / seconds << std::setprecision(3);
+      for (double quantile : {0.5, 0.99, 0.999}) {
+        out << std::setw(11) << percentileMs(latencies, quantile);
+      }
+      out << '\n';
+    }
+    out << "\nCommands: " << std::setprecision(1) << nbCommands / seconds
+        << "/s\nData: " << std::setprecision(2)
+        << bytes / seconds / (1 << 20) << " MiB/s" << std::endl;
+  }
+
+ private:
+  Scenario pickScenario(unsigned slot) const {
+    for (size_t scenario = 0; scenario < kNbScenarios; ++scenario) {
+      if (slot < options_.weights[scenario]) {
+        return static_cast<Scenario>(scenario);
+      }
+      slot -= options_.weights[scenario];
+    }
+    return Scenario::LOGIN;
+  }
+
+  static double percentileMs(std::vector<uint32_t> const& sorted,
+                             double quantile) {
+    if (sorted.empty()) {
+      return 0.0;
+    }
+    size_t index = std::min(sorted.size() - 1,
+                            static_cast<size_t>(quantile * sorted.size()));
+    return sorted[index] / 1000.0;
+  }
+
+  // Calls start with a handler that records how op went, then goes on
+  template <typename Start>
+  void timed(Session& session, Op op, Start start,
+             std::function<void(bool)> next) {
+    steady_clock::time_point begin = steady_clock::now();
+    start([&session, op, begin, next = std::move(next)](bool ok) {
+      OpStats& stats = session.stats[static_cast<size_t>(op)];
+      if (ok) {
+        auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+            steady_clock::now() - begin);
+        stats.latenciesUs.push_back(static_cast<uint32_t>(elapsed.count()));
+      } else {
+        ++stats.failures;
+      }
+      next(ok);
+    });
+  }
+
+  // Drops the connection after a failure, the next step reconnects
+  void restart(Session& session) {
+    session.loggedIn = false;
+    session.client->async_close([this, &session](bool) { step(session); });
+  }
+
+  void logIn(Session& session, std::function<void(bool)> next) {
+    FTPClient& client = *session.client;
+    timed(
+        session, Op::CONNECT,
+        [&](FTPClient::result_handler handler) {
+          client.async_connect(options_.host, options_.port, handler);
+        },
+        [this, &session, &client, next](bool ok) {
+          if (!ok) {
+            next(false);
+            return;
+          }
+          timed(
+              session, Op::LOGIN,
+              [&](FTPClient::result_handler handler) {
+                client.async_login(options_.user, options_.pass, handler);
+              },
+              next);
+        });
+  }
+
+  void step(Session& session) {
+    FTPClient& client = *session.client;
+    if (steady_clock::now() >= deadline_) {
+      session.client->async_close([](bool) {});
+      return;
+    }
+    ++session.iteration;
+    if (session.scenario == Scenario::LOGIN) {
+      logIn(session, [this, &session, &client](bool ok) {
+        if (!ok) {
+          restart(session);
+          return;
+        }
+        timed(session, Op::QUIT,
+              [&](FTPClient::result_handler handler) {
+                client.async_close(handler);
+              },
+              [this, &session](bool) { step(session); });
+      });
+      return;
+    }
+    if (!session.loggedIn) {
+      logIn(session, [this, &session](bool ok) {
+        if (!ok) {
+          restart(session);
+          return;
+        }
+        session.loggedIn = true;
+        step(session);
+      });
+      return;
+    }
+    auto next = [this, &session](bool ok) {
+      if (!ok) {
+        restart(session);
+        return;
+      }
+      step(session);
+    };
+    switch (session.scenario) {
+      case Scenario::LIST:
+        timed(
+            session, Op::LIST,
+            [&](FTPClient::result_handler handler) {
+              client.async_ls(options_.listDir,
+                              [handler](bool ok, std::optional<dir_listing>) {
+                                handler(ok);
+                              });
+            },
+            next);
+        break;
+      case Scenario::STOR: {
+        // A new name every time, an existing one would resume the upload
+        std::string remoteFile = "loadgen-" + std::to_string(session.id) +
+                                 "-" + std::to_string(session.iteration);
+        timed(
+            session, Op::STOR,
+            [&](FTPClient::result_handler handler) {
+              client.async_upload(smallFile_, remoteFile, handler);
+            },
+            [this, &session, &client, remoteFile, next](bool ok) {
+              if (!ok) {
+                next(false);
+                return;
+              }
+              session.bytes += options_.smallFileSize;
+              timed(
+                  session, Op::DELE,
+                  [&](FTPClient::result_handler handler) {
+                    client.async_rm(remoteFile, handler);
+                  },
+                  next);
+            });
+        break;
+      }
+      case Scenario::RETR:
+        timed(
+            session, Op::RETR,
+            [&](FTPClient::result_handler handler) {
+              client.async_download(kLargeRemoteFile, kNullDevice, handler);
+            },
+            [this, &session, next](bool ok) {
+              if (ok) {
+                session.bytes += options_.largeFileSize;
+              }
+              next(ok);
+            });
+        break;
+      case Scenario::LOGIN:
+        break;
+    }
+  }
+
+  Options const& options_;
+  std::string const smallFile_;
+  net::io_context context_;
+  std::vector<std::unique_ptr<Session>> sessions_;
+  steady_clock::time_point start_;
+  steady_clock::time_point deadline_;
+  steady_clock::time_point end_;
+};
+
+bool writeRandomFile(fs::path const& path, uint64_t size) {
+  std::ofstream file(path, std::ios_base::binary);
+  std::mt19937_64 random(size);
+  std::vector<uint64_t> chunk(1 << 14);
+  for (uint64_t left = size; left > 0 && file;) {
+    std::generate(chunk.begin(), chunk.end(), std::ref(random));
+    uint64_t length =
+        std::min<uint64_t>(left, chunk.size() * sizeof(uint64_t));
+    file.write(reinterpret_cast<char const*>(chunk.data()),
+               static_cast<std::streamsize>(length));
+    left -= length;
+  }
+  return file.good();
+}
+
+template <typename Number>
+bool parseNumber(std::string_view text, Number& number) {
+  auto [end, errc] =
+      std::from_chars(text.data(), text.data() + text.size(), number);
+  return !text.empty() && errc == std::errc() &&
+         end == text.data() + text.size();
+}
+
+// "login=1,list=4,stor=2,retr=1", scenarios left out get no sessions
+bool parseMix(std::string_view mix,
+              std::array<unsigned, kNbScenarios>& weights) {
+  weights.fill(0);
+  unsigned total = 0;
+  while (!mix.empty()) {
+    std::string_view item = mix.substr(0, mix.find(','));
+    mix.remove_prefix(std::min(mix.size(), item.size() + 1));
+    size_t equal = item.find('=');
+    auto name = std::find(std::begin(kScenarioNames), std::end(kScenarioNames),
+                          item.substr(0, equal));
+    unsigned weight = 0;
+    if (equal == std::string_view::npos ||
+        name == std::end(kScenarioNames) ||
+        !parseNumber(item.substr(equal + 1), weight)) {
+      return false;
+    }
+    weights[name - std::begin(kScenarioNames)] = weight;
+    total += weight;
+  }
+  return total > 0;
+}
+
+bool parseOptions(int argc, char* argv[], Options& options) {
+  for (int i = 1; i + 1 < argc; i += 2) {
+    std::string_view name = argv[i];
+    std::string_view value = argv[i + 1];
+    unsigned seconds = 0;
+    bool ok = true;
+    if (name == "--host") {
+      options.host = value;
+    } else if (name == "--port") {
+      ok = parseNumber(value, options.port);
+    } else if (name == "--user") {
+      options.user = value;
+    } else if (name == "--pass") {
+      options.pass = value;
+    } else if (name == "--sessions") {
+      ok = parseNumber(value, options.nbSessions) && options.nbSessions > 0;
+    } else if (name == "--threads") {
+      ok = parseNumber(value, options.nbThreads) && options.nbThreads > 0;
+    } else if (name == "--duration") {
+      ok = parseNumber(value, seconds);
+      options.duration = std::chrono::seconds(seconds);
+    } else if (name == "--mix") {
+      ok = parseMix(value, options.weights);
+    } else if (name == "--small-size") {
+      ok = parseNumber(value, options.smallFileSize);
+    } else if (name == "--large-size") {
+      ok = parseNumber(value, options.largeFileSize);
+    } else if (name == "--list-dir") {
+      options.listDir = value;
+    } else {
+      ok = false;
+    }
+    if (!ok) {
+      return false;
+    }
+  }
+  return argc % 2 == 1;
+}
+
+void printUsage(char const* program) {
+  std::cerr
+      << "Usage: " << program << " [options]\n"
+      << "  --host <ip>           server address (127.0.0.1)\n"
+      << "  --port <port>         server port (2121)\n"
+      << "  --user <name>         user every session logs in as (test)\n"
+      << "  --pass <password>     its password (123)\n"
+      << "  --sessions <n>        concurrent sessions (1000)\n"
+      << "  --threads <n>         threads running the sessions (all cores)\n"
+      << "  --duration <s>        length of the run in seconds (10)\n"
+      << "  --mix <weights>       share of sessions per scenario\n"
+      << "                        (login=1,list=1,stor=1,retr=1)\n"
+      << "  --small-size <bytes>  size of the stor files (4096)\n"
+      << "  --large-size <bytes>  size of the retr file (67108864)\n"
+      << "  --list-dir <path>     directory the list sessions list (/)\n";
+}
+
+#if defined(__unix__)
+// Each session needs a control and a data socket
+void raiseFileLimit(size_t nbSessions) {
+  rlimit limit;
+  if (::getrlimit(RLIMIT_NOFILE, &limit) == 0 &&
+      limit.rlim_cur < 2 * nbSessions + 64) {
+    limit.rlim_cur = std::min<rlim_t>(limit.rlim_max, 2 * nbSessions + 64);
+    ::setrlimit(RLIMIT_NOFILE, &limit);
+  }
+}
+#endif
+bool runLoad(Options const& options, fs::path const& smallFile,
+             fs::path const& largeFile, std::ostream& results) {
+  bool retr = options.weights[static_cast<size_t>(Scenario::RETR)] > 0;
+  FTPClient setup;
+  if (!setup.connect(options.host, options.port) ||
+      !setup.login(options.user, options.pass)) {
+    std::cerr << "Cannot log in to " << options.host << ':' << options.port
+              << std::endl;
+    return false;
+  }
+  if (retr) {
+    // A leftover from an earlier run would be taken for a partial upload
+    setup.rm(kLargeRemoteFile);
+    if (!writeRandomFile(largeFile, options.largeFileSize) ||
+        !setup.upload(largeFile.string(), kLargeRemoteFile)) {
+      std::cerr << "Cannot upload the retr file" << std::endl;
+      return false;
+    }
+  }
+  LoadGenerator generator(options, smallFile);
+  generator.run();
+  generator.report(results);
+  if (retr) {
+    setup.rm(kLargeRemoteFile);
+  }
+  return true;
+}
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  Options options;
+  if (!parseOptions(argc, argv, options)) {
+    printUsage(argv[0]);
+    return 1;
+  }
+#if defined(__unix__)
+  raiseFileLimit(options.nbSessions);
+#endif
+  std::error_code ec;
+  fs::path scratchDir = fs::temp_directory_path(ec) / "ftp-loadgen";
+  fs::create_directories(scratchDir, ec);
+  fs::path smallFile = scratchDir / "small.bin";
+  fs::path largeFile = scratchDir / "large.bin";
+  if (!writeRandomFile(smallFile, options.smallFileSize)) {
+    std::cerr << "Cannot write " << smallFile << std::endl;
+    return 1;
+  }
+
+  // The clients report every step on std::cout; only the results go there
+  std::ostringstream results;
+  std::streambuf* console = std::cout.rdbuf(nullptr);
+  bool ok = runLoad(options, smallFile, largeFile, results);
+  std::cout.rdbuf(console);
+  fs::remove_all(scratchDir, ec);
+  std::cout << results.str() << std::flush;
+  return ok ? 0 : 1;
+}
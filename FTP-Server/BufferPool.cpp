@@ -0,0 +1,130 @@
+#include "BufferPool.hpp"
+
+struct BufferPool::ThreadCache {
+  ~ThreadCache() {
+    for (std::size_t idx = 0; idx < kNbClasses; ++idx) {
+      for (std::size_t i = 0; i < depth[idx]; ++i) {
+        BufferPool::instance().pooledBytes_ -= classSize(idx);
+        delete buffers[idx][i];
+      }
+    }
+  }
+  std::array<std::array<std::vector<char>*, kThreadCacheDepth>, kNbClasses>
+      buffers{};
+  std::array<std::size_t, kNbClasses> depth{};
+};
+
+BufferPool& BufferPool::instance() {
+  static BufferPool pool(256 << 20);
+  return pool;
+}
+
+BufferPool::BufferPool(std::size_t maxPooledBytes)
+    : maxPooledBytes_(maxPooledBytes),
+      hits_(0),
+      misses_(0),
+      inUseBytes_(0),
+      highWaterBytes_(0),
+      pooledBytes_(0) {}
+
+BufferPool::~BufferPool() {
+  for (auto& freeList : freeLists_) {
+    for (auto* buf : freeList) {
+      delete buf;
+    }
+  }
+}
+
+BufferPool::buffer_ptr BufferPool::acquire(std::size_t size) {
+  if (size > kMaxClassSize) {
+    // Too big to be worth keeping around, but counted while in use
+    ++misses_;
+    trackInUse(size);
+    return buffer_ptr(new std::vector<char>(size),
+                      [this, size](std::vector<char>* b) {
+                        inUseBytes_ -= size;
+                        delete b;
+                      });
+  }
+  std::size_t idx = classIndex(size);
+  std::vector<char>* buf = nullptr;
+
+  ThreadCache& cache = threadCache();
+  if (cache.depth[idx] > 0) {
+    buf = cache.buffers[idx][--cache.depth[idx]];
+  } else {
+    std::lock_guard<decltype(mutex_)> lock(mutex_);
+    if (!freeLists_[idx].empty()) {
+      buf = freeLists_[idx].back();
+      freeLists_[idx].pop_back();
+    }
+  }
+
+  if (buf) {
+    ++hits_;
+    pooledBytes_ -= classSize(idx);
+  } else {
+    ++misses_;
+    buf = new std::vector<char>();
+    buf->reserve(classSize(idx));
+  }
+  buf->resize(size);
+  trackInUse(classSize(idx));
+  return buffer_ptr(buf,
+                    [this, idx](std::vector<char>* b) { release(b, idx); });
+}
+
+BufferPool::Stats BufferPool::stats() const {
+  return Stats{hits_, misses_, inUseBytes_, highWaterBytes_, pooledBytes_};
+}
+
+std::size_t BufferPool::classIndex(std::size_t size) {
+  std::size_t idx = 0;
+  while (classSize(idx) < size) {
+    ++idx;
+  }
+  return idx;
+}
+
+std::size_t BufferPool::classSize(std::size_t index) {
+  return kMinClassSize << index;
+}
+
+BufferPool::ThreadCache& BufferPool::threadCache() {
+  thread_local ThreadCache cache;
+  return cache;
+}
+
+void BufferPool::release(std::vector<char>* buf, std::size_t idx) {
+  std::size_t bytes = classSize(idx);
+  inUseBytes_ -= bytes;
+
+  // A user may have grown the buffer past its class, don't keep it then
+  if (buf->capacity() != bytes) {
+    delete buf;
+    return;
+  }
+  // Room is taken before the check, so releases racing each other cannot
+  // keep more than the cap between them
+  if (pooledBytes_.fetch_add(bytes) + bytes > maxPooledBytes_) {
+    pooledBytes_ -= bytes;
+    delete buf;
+    return;
+  }
+
+  ThreadCache& cache = threadCache();
+  if (cache.depth[idx] < kThreadCacheDepth) {
+    cache.buffers[idx][cache.depth[idx]++] = buf;
+    return;
+  }
+  std::lock_guard<decltype(mutex_)> lock(mutex_);
+  freeLists_[idx].push_back(buf);
+}
+
+void BufferPool::trackInUse(std::size_t bytes) {
+  std::size_t inUse = inUseBytes_ += bytes;
+  std::size_t highWater = highWaterBytes_;
+  while (inUse > highWater &&
+         !highWaterBytes_.compare_exchange_weak(highWater, inUse)) {
+  }
+}
@@ -0,0 +1,65 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Server-wide pool of transfer buffers. Buffers are grouped in power of two
+// size classes; each io thread keeps a small cache in front of the shared
+// free lists so the common acquire/release pair takes no lock.
+// Only the free buffers the pool keeps are capped. Buffers in use, those
+// over kMaxClassSize included, are counted in the stats but never refused:
+// each transfer holds a bounded number of them, and admission control
+// bounds the transfers.
+class BufferPool {
+ public:
+  using buffer_ptr = std::shared_ptr<std::vector<char>>;
+
+  struct Stats {
+    std::size_t hits;
+    std::size_t misses;
+    std::size_t inUseBytes;
+    std::size_t highWaterBytes;
+    std::size_t pooledBytes;
+  };
+
+  static constexpr std::size_t kMinClassSize = 1 << 12;
+  static constexpr std::size_t kMaxClassSize = 1 << 20;
+  static constexpr std::size_t kNbClasses = 9;  // 4 KiB .. 1 MiB
+  static constexpr std::size_t kThreadCacheDepth = 4;
+
+  static BufferPool& instance();
+
+  virtual ~BufferPool();
+  BufferPool(BufferPool const&) = delete;
+  BufferPool& operator=(BufferPool const&) = delete;
+
+  // The returned buffer has exactly `size` elements and goes back to the pool
+  // once the last reference is dropped.
+  buffer_ptr acquire(std::size_t size);
+  Stats stats() const;
+
+ private:
+  struct ThreadCache;
+
+  explicit BufferPool(std::size_t maxPooledBytes);
+
+  static std::size_t classIndex(std::size_t size);
+  static std::size_t classSize(std::size_t index);
+  static ThreadCache& threadCache();
+
+  void release(std::vector<char>* buf, std::size_t idx);
+  void trackInUse(std::size_t bytes);
+
+  std::size_t const maxPooledBytes_;
+  std::mutex mutex_;
+  std::array<std::vector<std::vector<char>*>, kNbClasses> freeLists_;
+
+  std::atomic<std::size_t> hits_;
+  std::atomic<std::size_t> misses_;
+  std::atomic<std::size_t> inUseBytes_;
+  std::atomic<std::size_t> highWaterBytes_;
+  std::atomic<std::size_t> pooledBytes_;
+};
@@ -0,0 +1,114 @@
+#if defined(__unix__)
+#include <sys/stat.h>
+#endif
+
+#include "DigestCache.hpp"
+
+DigestCache& DigestCache::instance() {
+  static DigestCache cache(1 << 16);
+  return cache;
+}
+
+#if defined(__unix__)
+static std::optional<DigestCache::FileStamp> stampOf(struct stat const& st) {
+  if (!S_ISREG(st.st_mode)) {
+    return std::nullopt;
+  }
+  int64_t mtime = static_cast<int64_t>(st.st_mtime) * 1000000000;
+#if defined(__linux__)
+  mtime += st.st_mtim.tv_nsec;
+#endif
+  return DigestCache::FileStamp{static_cast<uint64_t>(st.st_dev),
+                                static_cast<uint64_t>(st.st_ino),
+                                static_cast<uint64_t>(st.st_size), mtime};
+}
+#endif
+
+DigestCache::DigestCache(std::size_t maxEntries)
+    : maxEntries_(maxEntries), hits_(0), misses_(0) {}
+
+std::optional<DigestCache::FileStamp> DigestCache::stamp(
+    fs::path const& path) {
+#if defined(__unix__)
+  struct stat st;
+  if (::stat(path.c_str(), &st) != 0) {
+    return std::nullopt;
+  }
+  return stampOf(st);
+#else
+  std::error_code ec;
+  if (!fs::is_regular_file(path, ec)) {
+    return std::nullopt;
+  }
+  uint64_t size = fs::file_size(path, ec);
+  fs::file_time_type mtime = fs::last_write_time(path, ec);
+  if (ec) {
+    return std::nullopt;
+  }
+  // No inode numbers here; the path is the cache key already
+  return FileStamp{0, 0, size,
+                   static_cast<int64_t>(mtime.time_since_epoch().count())};
+#endif
+}
+
+#if defined(__unix__)
+std::optional<DigestCache::FileStamp> DigestCache::stamp(int fd) {
+  struct stat st;
+  if (::fstat(fd, &st) != 0) {
+    return std::nullopt;
+  }
+  return stampOf(st);
+}
+#endif
+
+std::optional<std::string> DigestCache::find(fs::path const& path,
+                                             FileStamp const& stamp,
+                                             HashAlgorithm algorithm) {
+  std::lock_guard<decltype(mutex_)> lock(mutex_);
+  auto entryIt = entries_.find(path.string());
+  if (entryIt != entries_.end() && entryIt->second.stamp == stamp) {
+    std::string const& digest =
+        entryIt->second.digests[static_cast<std::size_t>(algorithm)];
+    if (!digest.empty()) {
+      ++hits_;
+      return digest;
+    }
+  }
+  ++misses_;
+  return std::nullopt;
+}
+
+void DigestCache::store(fs::path const& path, FileStamp const& stamp,
+                        HashAlgorithm algorithm, std::string digest) {
+  std::lock_guard<decltype(mutex_)> lock(mutex_);
+  std::string key = path.string();
+  auto entryIt = entries_.find(key);
+  if (entryIt == entries_.end()) {
+    if (entries_.size() >= maxEntries_) {
+      entries_.erase(entries_.begin());
+    }
+    entryIt = entries_.try_emplace(std::move(key), Entry{stamp, {}}).first;
+  } else if (entryIt->second.stamp != stamp) {
+    // The file changed, digests of its old content are of no use
+    entryIt->second = Entry{stamp, {}};
+  }
+  entryIt->second.digests[static_cast<std::size_t>(algorithm)] =
+      std::move(digest);
+}
+
+DigestCache::Stats DigestCache::stats() const {
+  return Stats{hits_, misses_};
+}
+
+#if defined(__linux__)
+void UploadDigest::commit(int fd) {
+  if (std::optional<DigestCache::FileStamp> stamp = DigestCache::stamp(fd)) {
+#else
+void UploadDigest::commit() {
+  if (std::optional<DigestCache::FileStamp> stamp =
+          DigestCache::stamp(path_)) {
+#endif
+    DigestCache::instance().store(path_, *stamp, algorithm_,
+                                  hasher_->finish());
+  }
+}
@@ -0,0 +1,98 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+
+#include "FileDigest.hpp"
+
+namespace fs = std::filesystem;
+
+// Server-wide cache of whole-file digests, filled while files are uploaded
+// and whenever HASH had to read a file. An entry is only used while the
+// file still has the identity, size and modification time it had when the
+// digest was taken.
+class DigestCache {
+ public:
+  struct FileStamp {
+    uint64_t device;
+    uint64_t inode;
+    uint64_t size;
+    int64_t mtime;  // nanoseconds where the platform has them
+
+    bool operator==(FileStamp const& other) const {
+      return device == other.device && inode == other.inode &&
+             size == other.size && mtime == other.mtime;
+    }
+    bool operator!=(FileStamp const& other) const { return !(*this == other); }
+  };
+
+  struct Stats {
+    std::size_t hits;
+    std::size_t misses;
+  };
+
+  static DigestCache& instance();
+  // Nothing if path is not a readable regular file
+  static std::optional<FileStamp> stamp(fs::path const& path);
+#if defined(__unix__)
+  // Of the file fd is open on
+  static std::optional<FileStamp> stamp(int fd);
+#endif
+
+  virtual ~DigestCache() = default;
+  DigestCache(DigestCache const&) = delete;
+  DigestCache& operator=(DigestCache const&) = delete;
+
+  std::optional<std::string> find(fs::path const& path,
+                                  FileStamp const& stamp,
+                                  HashAlgorithm algorithm);
+  void store(fs::path const& path, FileStamp const& stamp,
+             HashAlgorithm algorithm, std::string digest);
+  Stats stats() const;
+
+ private:
+  struct Entry {
+    FileStamp stamp;
+    std::string digests[kNbHashAlgorithms];
+  };
+
+  explicit DigestCache(std::size_t maxEntries);
+
+  std::size_t const maxEntries_;
+  std::mutex mutex_;
+  std::unordered_map<std::string, Entry> entries_;
+
+  std::atomic<std::size_t> hits_;
+  std::atomic<std::size_t> misses_;
+};
+
+// Digest of a file being uploaded from its first byte, fed with the data as
+// it is written. commit() puts it in the DigestCache once the file is
+// complete and closed.
+class UploadDigest {
+ public:
+  UploadDigest(fs::path const& path, HashAlgorithm algorithm)
+      : path_(path),
+        algorithm_(algorithm),
+        hasher_(Hasher::create(algorithm)) {}
+
+  void update(void const* data, std::size_t length) {
+    hasher_->update(data, length);
+  }
+#if defined(__linux__)
+  // fd is the file that was written, whatever its path names by now
+  void commit(int fd);
+#else
+  void commit();
+#endif
+
+ private:
+  fs::path const path_;
+  HashAlgorithm const algorithm_;
+  std::unique_ptr<Hasher> hasher_;
+};
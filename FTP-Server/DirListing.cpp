@@ -0,0 +1,453 @@
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <mutex>
+#include <string>
+#include <utility>
+
+#if defined(__unix__)
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#endif
+
+#include "DirListing.hpp"
+#include "BufferPool.hpp"
+
+namespace {
+
+// Fills fixed size chunks and passes them on when full
+class ChunkWriter {
+ public:
+  explicit ChunkWriter(listing_sink sink) : sink_(std::move(sink)) {
+    newChunk();
+  }
+
+  void append(char const* data, std::size_t length) {
+    if (!chunk_->empty() && chunk_->size() + length > kListingChunkSize) {
+      flush();
+    }
+    chunk_->insert(chunk_->end(), data, data + length);
+  }
+
+  void flush() {
+    if (!chunk_->empty()) {
+      sink_(chunk_);
+      newChunk();
+    }
+  }
+
+ private:
+  void newChunk() {
+    // Lines are short, so the chunk never grows out of its pool size class
+    chunk_ = BufferPool::instance().acquire(kListingChunkSize);
+    chunk_->clear();
+  }
+
+  listing_sink const sink_;
+  listing_chunk chunk_;
+};
+
+}  // namespace
+
+static void toLocalTime(std::time_t time, std::tm& timeinfo) {
+#if defined(__unix__)
+  localtime_r(&time, &timeinfo);
+#elif defined(_MSC_VER)
+  localtime_s(&timeinfo, &time);
+#else
+  static std::mutex mtx;
+  std::lock_guard<std::mutex> lock(mtx);
+  timeinfo = *std::localtime(&time);
+#endif
+}
+
+static void toUTCTime(std::time_t time, std::tm& timeinfo) {
+#if defined(__unix__)
+  gmtime_r(&time, &timeinfo);
+#elif defined(_MSC_VER)
+  gmtime_s(&timeinfo, &time);
+#else
+  static std::mutex mtx;
+  std::lock_guard<std::mutex> lock(mtx);
+  timeinfo = *std::gmtime(&time);
+#endif
+}
+
+#if defined(__unix__)
+static void fillEntry(struct stat const& st, ListingEntry& info) {
+  info.dir = S_ISDIR(st.st_mode);
+  info.link = S_ISLNK(st.st_mode);
+  info.perms = static_cast<unsigned int>(st.st_mode & 0777);
+  info.size = static_cast<uint64_t>(st.st_size);
+  info.mtime = st.st_mtime;
+  info.device = static_cast<uint64_t>(st.st_dev);
+  info.inode = static_cast<uint64_t>(st.st_ino);
+}
+
+// One stat of name, relative to dirFd. Symlinks are listed as the link:
+// what they point to may well be outside the user's root.
+static bool statEntry(int dirFd, char const* name, ListingEntry& info) {
+  struct stat st;
+  if (::fstatat(dirFd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+    return false;
+  }
+  fillEntry(st, info);
+  return true;
+}
+#else
+// directory_entry keeps the attributes the directory scan returned, so
+// these do not go back to the file system on every platform.
+static bool statEntry(fs::directory_entry const& entry, ListingEntry& info) {
+  std::error_code ec;
+  fs::file_status status = entry.symlink_status(ec);
+  if (ec) {
+    return false;
+  }
+  info.dir = fs::is_directory(status);
+  info.link = fs::is_symlink(status);
+  info.perms =
+      static_cast<unsigned int>(status.permissions() & fs::perms::mask);
+  info.size = fs::is_regular_file(status) ? entry.file_size(ec) : 0;
+  fs::file_time_type ftime = entry.last_write_time(ec);
+  using namespace std::chrono;
+  auto sctp = time_point_cast<system_clock::duration>(
+      ftime - decltype(ftime)::clock::now() + system_clock::now());
+  info.mtime = system_clock::to_time_t(sctp);
+  // No inode numbers here, the path identifies the entry well enough
+  info.device = 0;
+  info.inode = std::hash<std::string>()(entry.path().string());
+  return true;
+}
+#endif
+
+namespace {
+
+// The entries of a directory, one at a time and in directory order.
+// Entries that cannot be read are skipped rather than failing the listing.
+class DirScanner {
+ public:
+  DirScanner(ListingSource const& dir, bool withStat);
+  ~DirScanner();
+  DirScanner(DirScanner const&) = delete;
+  DirScanner& operator=(DirScanner const&) = delete;
+
+  // False once every entry has been read
+  bool next(ListingEntry& info);
+
+ private:
+#if defined(__unix__)
+  DIR* dirStream_;
+#else
+  fs::directory_iterator it_;
+  std::error_code ec_;
+#endif
+  bool const withStat_;
+};
+
+DirScanner::DirScanner(ListingSource const& dir, bool withStat)
+    : withStat_(withStat) {
+#if defined(__linux__)
+  // An open file of its own: reading moves the offset, which the
+  // descriptor handed in shares with every copy of it
+  int fd = ::openat(dir.fd(), ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  dirStream_ = fd >= 0 ? ::fdopendir(fd) : nullptr;
+  if (!dirStream_ && fd >= 0) {
+    ::close(fd);
+  }
+#elif defined(__unix__)
+  dirStream_ = ::opendir(dir.path().c_str());
+#else
+  it_ = fs::directory_iterator(dir.path(), ec_);
+#endif
+}
+
+DirScanner::~DirScanner() {
+#if defined(__unix__)
+  if (dirStream_) {
+    ::closedir(dirStream_);
+  }
+#endif
+}
+
+bool DirScanner::next(ListingEntry& info) {
+#if defined(__unix__)
+  if (!dirStream_) {
+    return false;
+  }
+  while (dirent* dirEntry = ::readdir(dirStream_)) {
+    char const* name = dirEntry->d_name;
+    if (std::strcmp(name, ".") == 0 || std::strcmp(name, "..") == 0) {
+      continue;
+    }
+    info = ListingEntry{name, false, 0, 0, 0, 0, 0, false};
+    if (!withStat_ || statEntry(::dirfd(dirStream_), name, info)) {
+      return true;
+    }
+  }
+  return false;
+#else
+  for (; !ec_ && it_ != fs::directory_iterator(); it_.increment(ec_)) {
+    info = ListingEntry{
+        it_->path().filename().string(), false, 0, 0, 0, 0, 0, false};
+    if (!withStat_ || statEntry(*it_, info)) {
+      it_.increment(ec_);
+      return true;
+    }
+  }
+  return false;
+#endif
+}
+
+// Formats every entry with append as it is read, so the first chunk
+// leaves while the rest of the directory is still to be scanned.
+template <typename Append>
+class DirReader : public ListingReader {
+ public:
+  DirReader(listing_source const& dir, bool withStat, Append append)
+      : dir_(dir),
+        scanner_(*dir, withStat),
+        append_(std::move(append)),
+        writer_([this](listing_chunk const& chunk) { ready_ = chunk; }),
+        done_(false) {}
+
+  listing_chunk next() override {
+    ListingEntry entry;
+    while (!ready_ && !done_) {
+      if (scanner_.next(entry)) {
+        append_(writer_, entry);
+      } else {
+        done_ = true;
+        writer_.flush();
+      }
+    }
+    return std::exchange(ready_, nullptr);
+  }
+
+ private:
+  listing_source const dir_;
+  DirScanner scanner_;
+  Append const append_;
+  listing_chunk ready_;
+  ChunkWriter writer_;
+  bool done_;
+};
+
+template <typename Append>
+listing_reader makeDirReader(listing_source const& dir, bool withStat,
+                             Append append) {
+  return std::make_shared<DirReader<Append>>(dir, withStat,
+                                             std::move(append));
+}
+
+}  // namespace
+
+// Writes value right aligned in a field of width characters
+static char* formatNumber(char* out, uint64_t value, int width) {
+  char digits[20];
+  int nbDigits = 0;
+  do {
+    digits[nbDigits++] = static_cast<char>('0' + value % 10);
+    value /= 10;
+  } while (value != 0);
+  for (int i = nbDigits; i < width; ++i) {
+    *out++ = ' ';
+  }
+  while (nbDigits > 0) {
+    *out++ = digits[--nbDigits];
+  }
+  return out;
+}
+
+static char* formatTwoDigits(char* out, int value, char pad) {
+  *out++ = value >= 10 ? static_cast<char>('0' + value / 10) : pad;
+  *out++ = static_cast<char>('0' + value % 10);
+  return out;
+}
+
+// "%b %e %H:%M" for this year's files, "%b %e  %Y" for older ones
+static char* formatTime(char* out, std::time_t time, int currentYear) {
+  static char const months[12][4] = {"Jan", "Feb", "Mar", "Apr",
+                                     "May", "Jun", "Jul", "Aug",
+                                     "Sep", "Oct", "Nov", "Dec"};
+  std::tm timeinfo;
+  toLocalTime(time, timeinfo);
+  std::memcpy(out, months[timeinfo.tm_mon], 3);
+  out += 3;
+  *out++ = ' ';
+  out = formatTwoDigits(out, timeinfo.tm_mday, ' ');
+  *out++ = ' ';
+  if (timeinfo.tm_year == currentYear) {
+    out = formatTwoDigits(out, timeinfo.tm_hour, '0');
+    *out++ = ':';
+    out = formatTwoDigits(out, timeinfo.tm_min, '0');
+  } else {
+    *out++ = ' ';
+    out = formatNumber(out, timeinfo.tm_year + 1900, 4);
+  }
+  return out;
+}
+
+// RFC 3659 facts: "type=...;size=...;modify=YYYYMMDDHHMMSS;unique=...; "
+static char* formatFacts(char* out, ListingEntry const& entry) {
+  static char const hexDigits[] = "0123456789abcdef";
+  auto append = [&out](char const* text) {
+    std::size_t length = std::strlen(text);
+    std::memcpy(out, text, length);
+    out += length;
+  };
+  auto appendHex = [&out](uint64_t value) {
+    char digits[16];
+    int nbDigits = 0;
+    do {
+      digits[nbDigits++] = hexDigits[value & 0xf];
+      value >>= 4;
+    } while (value != 0);
+    while (nbDigits > 0) {
+      *out++ = digits[--nbDigits];
+    }
+  };
+
+  if (entry.link) {
+    append("type=OS.unix=symlink;");
+  } else {
+    append(entry.dir ? "type=dir;" : "type=file;size=");
+  }
+  if (!entry.dir && !entry.link) {
+    out = formatNumber(out, entry.size, 0);
+    *out++ = ';';
+  }
+  std::tm timeinfo;
+  toUTCTime(entry.mtime, timeinfo);
+  append("modify=");
+  out = formatNumber(out, timeinfo.tm_year + 1900, 4);
+  out = formatTwoDigits(out, timeinfo.tm_mon + 1, '0');
+  out = formatTwoDigits(out, timeinfo.tm_mday, '0');
+  out = formatTwoDigits(out, timeinfo.tm_hour, '0');
+  out = formatTwoDigits(out, timeinfo.tm_min, '0');
+  out = formatTwoDigits(out, timeinfo.tm_sec, '0');
+  append(";unique=");
+  appendHex(entry.device);
+  *out++ = 'U';
+  appendHex(entry.inode);
+  append("; ");
+  return out;
+}
+
+static char* formatPerms(char* out, unsigned int perms) {
+  static char const flags[] = "rwxrwxrwx";
+  for (int bit = 0; bit < 9; ++bit) {
+    *out++ = (perms & (0400u >> bit)) ? flags[bit] : '-';
+  }
+  return out;
+}
+
+// <type><perms>   1 <owner> <group> <size> <timestring> <filename>
+static void appendListLine(ChunkWriter& writer, ListingEntry const& entry,
+                           int currentYear) {
+  static char const ownerGroup[] = "   1      hcmus      hcmus ";
+  char line[128];
+  char* out = line;
+  *out++ = entry.link ? 'l' : entry.dir ? 'd' : '-';
+  out = formatPerms(out, entry.perms);
+  std::memcpy(out, ownerGroup, sizeof(ownerGroup) - 1);
+  out += sizeof(ownerGroup) - 1;
+  out = formatNumber(out, entry.size, 10);
+  *out++ = ' ';
+  out = formatTime(out, entry.mtime, currentYear);
+  *out++ = ' ';
+  writer.append(line, out - line);
+  writer.append(entry.name.data(), entry.name.size());
+  writer.append("\r\n", 2);
+}
+
+static void appendName(ChunkWriter& writer, ListingEntry const& entry) {
+  writer.append(entry.name.data(), entry.name.size());
+  writer.append("\r\n", 2);
+}
+
+static void appendFactsLine(ChunkWriter& writer, ListingEntry const& entry) {
+  char facts[128];
+  writer.append(facts, formatFacts(facts, entry) - facts);
+  writer.append(entry.name.data(), entry.name.size());
+  writer.append("\r\n", 2);
+}
+
+static int currentYear() {
+  std::tm now;
+  toLocalTime(std::time(nullptr), now);
+  return now.tm_year;
+}
+
+void formatDirListing(std::vector<ListingEntry> const& entries,
+                      listing_sink const& sink) {
+  int year = currentYear();
+  ChunkWriter writer(sink);
+  for (ListingEntry const& entry : entries) {
+    appendListLine(writer, entry, year);
+  }
+  writer.flush();
+}
+
+void formatNameList(std::vector<ListingEntry> const& entries,
+                    listing_sink const& sink) {
+  ChunkWriter writer(sink);
+  for (ListingEntry const& entry : entries) {
+    appendName(writer, entry);
+  }
+  writer.flush();
+}
+
+void formatMachineListing(std::vector<ListingEntry> const& entries,
+                          listing_sink const& sink) {
+  ChunkWriter writer(sink);
+  for (ListingEntry const& entry : entries) {
+    appendFactsLine(writer, entry);
+  }
+  writer.flush();
+}
+
+// Entries come in directory order; clients sort the listing themselves.
+listing_reader readDirListing(listing_source const& dir) {
+  int year = currentYear();
+  return makeDirReader(
+      dir, true, [year](ChunkWriter& writer, ListingEntry const& entry) {
+        appendListLine(writer, entry, year);
+      });
+}
+
+listing_reader readNameList(listing_source const& dir) {
+  return makeDirReader(dir, false,
+                       [](ChunkWriter& writer, ListingEntry const& entry) {
+                         appendName(writer, entry);
+                       });
+}
+
+listing_reader readMachineListing(listing_source const& dir) {
+  return makeDirReader(dir, true,
+                       [](ChunkWriter& writer, ListingEntry const& entry) {
+                         appendFactsLine(writer, entry);
+                       });
+}
+
+std::string renderMachineEntry(ListingSource const& file) {
+  ListingEntry info{"", false, 0, 0, 0, 0, 0, false};
+#if defined(__linux__)
+  struct stat st;
+  if (::fstat(file.fd(), &st) != 0) {
+    return std::string();
+  }
+  fillEntry(st, info);
+#elif defined(__unix__)
+  if (!statEntry(AT_FDCWD, file.path().c_str(), info)) {
+    return std::string();
+  }
+#else
+  if (!statEntry(fs::directory_entry(file.path()), info)) {
+    return std::string();
+  }
+#endif
+  char facts[128];
+  return std::string(facts, formatFacts(facts, info) - facts);
+}
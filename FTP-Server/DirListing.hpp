@@ -0,0 +1,93 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#if defined(__linux__)
+#include <unistd.h>
+#endif
+
+namespace fs = std::filesystem;
+
+// Listings are produced in chunks of about kListingChunkSize bytes, each one
+// handed on as soon as it is full so it can be sent right away.
+constexpr std::size_t kListingChunkSize = 1 << 16;
+using listing_chunk = std::shared_ptr<std::vector<char>>;
+using listing_sink = std::function<void(listing_chunk const&)>;
+
+// What the listings show of a directory entry
+struct ListingEntry {
+  std::string name;
+  bool dir;
+  unsigned int perms;  // rwxrwxrwx bits
+  uint64_t size;
+  std::time_t mtime;
+  uint64_t device;  // device and inode make up the MLSD unique fact
+  uint64_t inode;
+  bool link;  // listed as the symlink, never followed
+};
+
+// The directory or file a listing is made of. On Linux it is held open as
+// RootDir found it beneath the user's root and only read through the
+// descriptor, so the path is never looked up again.
+class ListingSource {
+ public:
+#if defined(__linux__)
+  // Takes over fd
+  explicit ListingSource(int fd) : fd_(fd) {}
+  virtual ~ListingSource() {
+    if (fd_ >= 0) {
+      ::close(fd_);
+    }
+  }
+  int fd() const { return fd_; }
+#else
+  explicit ListingSource(fs::path const& path) : path_(path) {}
+  virtual ~ListingSource() = default;
+  fs::path const& path() const { return path_; }
+#endif
+  ListingSource(ListingSource const&) = delete;
+  ListingSource& operator=(ListingSource const&) = delete;
+
+ private:
+#if defined(__linux__)
+  int const fd_;
+#else
+  fs::path const path_;
+#endif
+};
+using listing_source = std::shared_ptr<ListingSource const>;
+
+// The reply bodies below for entries that were already read
+void formatDirListing(std::vector<ListingEntry> const& entries,
+                      listing_sink const& sink);
+void formatNameList(std::vector<ListingEntry> const& entries,
+                    listing_sink const& sink);
+void formatMachineListing(std::vector<ListingEntry> const& entries,
+                          listing_sink const& sink);
+
+// Hands out a reply body a chunk at a time. A chunk is only made when it is
+// asked for, so a listing is read no faster than it is sent.
+class ListingReader {
+ public:
+  virtual ~ListingReader() = default;
+  // The next chunk of the body, nullptr once it is complete
+  virtual listing_chunk next() = 0;
+};
+using listing_reader = std::shared_ptr<ListingReader>;
+
+// The reply bodies of dir, read with at most one stat per entry and in
+// directory order as the chunks are asked for.
+// LIST reply body: one "ls -l" like line per directory entry
+listing_reader readDirListing(listing_source const& dir);
+// NLST reply body: one file name per line
+listing_reader readNameList(listing_source const& dir);
+// MLSD reply body: RFC 3659 facts and name, one entry per line
+listing_reader readMachineListing(listing_source const& dir);
+// MLST facts of a single file, without the name. Empty if it cannot be read.
+std::string renderMachineEntry(ListingSource const& file);
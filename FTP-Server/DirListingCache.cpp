@@ -0,0 +1,294 @@
+#include <algorithm>
+#include <string>
+
+#if defined(__linux__)
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "DirListingCache.hpp"
+#include "Logger.hpp"
+
+#if defined(__linux__)
+static constexpr uint32_t kWatchMask =
+    IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_MODIFY |
+    IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR;
+
+// Bytes of chunk memory a listing holds
+static std::size_t sizeOf(std::vector<listing_chunk> const& chunks) {
+  std::size_t bytes = 0;
+  for (listing_chunk const& chunk : chunks) {
+    bytes += chunk->capacity();
+  }
+  return bytes;
+}
+#endif
+
+DirListingCache& DirListingCache::instance() {
+  static DirListingCache cache(4096, 64 << 20, 4 << 20);
+  return cache;
+}
+
+DirListingCache::DirListingCache(std::size_t maxEntries, std::size_t maxBytes,
+                                 std::size_t maxListingBytes)
+    : maxEntries_(maxEntries),
+      maxBytes_(maxBytes),
+      maxListingBytes_(maxListingBytes),
+      bytes_(0),
+      hits_(0),
+      misses_(0),
+      invalidations_(0) {
+#if defined(__linux__)
+  inotifyFd_ = ::inotify_init1(IN_CLOEXEC);
+  stopFd_ = ::eventfd(0, EFD_CLOEXEC);
+  if (inotifyFd_ < 0 || stopFd_ < 0) {
+    FTP_LOG_WARN("Directory listing cache disabled: inotify unavailable");
+    return;
+  }
+  watcher_ = std::thread([this]() { watchLoop(); });
+#endif
+}
+
+DirListingCache::~DirListingCache() {
+#if defined(__linux__)
+  if (watcher_.joinable()) {
+    uint64_t one = 1;
+    if (::write(stopFd_, &one, sizeof(one)) == sizeof(one)) {
+      watcher_.join();
+    } else {
+      watcher_.detach();
+    }
+  }
+  if (inotifyFd_ >= 0) {
+    ::close(inotifyFd_);
+  }
+  if (stopFd_ >= 0) {
+    ::close(stopFd_);
+  }
+#endif
+}
+
+#if defined(__linux__)
+namespace {
+
+// Hands out a cached listing
+class CachedReader : public ListingReader {
+ public:
+  explicit CachedReader(
+      std::shared_ptr<std::vector<listing_chunk> const> chunks)
+      : chunks_(std::move(chunks)), next_(0) {}
+
+  listing_chunk next() override {
+    return next_ < chunks_->size() ? (*chunks_)[next_++] : nullptr;
+  }
+
+ private:
+  std::shared_ptr<std::vector<listing_chunk> const> const chunks_;
+  std::size_t next_;
+};
+
+// Keeps the chunks of a listing as they are read. Once the listing is
+// complete, keep gets them all, unless there were more than maxBytes.
+class KeepingReader : public ListingReader {
+ public:
+  using keeper = std::function<void(
+      std::shared_ptr<std::vector<listing_chunk>>, std::size_t)>;
+
+  KeepingReader(listing_reader reader, std::size_t maxBytes, keeper keep)
+      : reader_(std::move(reader)),
+        maxBytes_(maxBytes),
+        keep_(std::move(keep)),
+        chunks_(std::make_shared<std::vector<listing_chunk>>()),
+        bytes_(0) {}
+
+  listing_chunk next() override {
+    listing_chunk chunk = reader_->next();
+    if (!chunks_) {
+      return chunk;
+    }
+    if (!chunk) {
+      keep_(std::move(chunks_), bytes_);
+      chunks_ = nullptr;
+      return nullptr;
+    }
+    bytes_ += chunk->capacity();
+    if (bytes_ <= maxBytes_) {
+      chunks_->push_back(chunk);
+    } else {
+      chunks_ = nullptr;
+    }
+    return chunk;
+  }
+
+ private:
+  listing_reader const reader_;
+  std::size_t const maxBytes_;
+  keeper const keep_;
+  std::shared_ptr<std::vector<listing_chunk>> chunks_;
+  std::size_t bytes_;
+};
+
+}  // namespace
+#endif
+
+listing_reader DirListingCache::open(listing_source const& source,
+                                     Format format, renderer const& render) {
+  auto idx = static_cast<std::size_t>(format);
+#if defined(__linux__)
+  struct stat st;
+  if (!watcher_.joinable() || ::fstat(source->fd(), &st) != 0) {
+    ++misses_;
+    return render(source);
+  }
+  key_type key(st.st_dev, st.st_ino);
+  {
+    std::lock_guard<decltype(mutex_)> lock(mutex_);
+    if (auto entryIt = entries_.find(key);
+        entryIt != entries_.end() && entryIt->second.formats[idx]) {
+      ++hits_;
+      return std::make_shared<CachedReader>(entryIt->second.formats[idx]);
+    }
+  }
+  ++misses_;
+
+  // Watch before rendering, so a change made while we render is not missed.
+  // The directory is watched through its descriptor, not looked up again.
+  int wd = ::inotify_add_watch(
+      inotifyFd_, ("/proc/self/fd/" + std::to_string(source->fd())).c_str(),
+      kWatchMask);
+  if (wd < 0) {
+    return render(source);
+  }
+  uint64_t generation;
+  {
+    std::lock_guard<decltype(mutex_)> lock(mutex_);
+    auto entryIt = entries_.find(key);
+    if (entryIt != entries_.end() && entryIt->second.wd != wd) {
+      // An old directory of the same inode, whose watch is going
+      erase(entryIt);
+      entryIt = entries_.end();
+    }
+    if (entryIt == entries_.end()) {
+      evict(0, 1, key);
+      entryIt = entries_.emplace(key, Entry{wd, 0, {}}).first;
+      watches_[wd] = key;
+    }
+    generation = entryIt->second.generation;
+  }
+
+  return std::make_shared<KeepingReader>(
+      render(source), maxListingBytes_,
+      [this, key, idx, generation](
+          std::shared_ptr<std::vector<listing_chunk>> chunks,
+          std::size_t bytes) {
+        std::lock_guard<decltype(mutex_)> lock(mutex_);
+        if (auto entryIt = entries_.find(key);
+            entryIt != entries_.end() &&
+            entryIt->second.generation == generation &&
+            !entryIt->second.formats[idx]) {
+          evict(bytes, 0, key);
+          entryIt->second.formats[idx] = std::move(chunks);
+          bytes_ += bytes;
+        }
+      });
+#else
+  (void)idx;
+  ++misses_;
+  return render(source);
+#endif
+}
+
+DirListingCache::Stats DirListingCache::stats() const {
+  return Stats{hits_, misses_, invalidations_, bytes_};
+}
+
+#if defined(__linux__)
+void DirListingCache::watchLoop() {
+  alignas(inotify_event) char events[4096];
+  pollfd fds[2] = {{inotifyFd_, POLLIN, 0}, {stopFd_, POLLIN, 0}};
+  for (;;) {
+    if (::poll(fds, 2, -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      FTP_LOG_ERROR("Directory watcher stopped");
+      return;
+    }
+    if (fds[1].revents & POLLIN) {
+      return;
+    }
+    ssize_t length = ::read(inotifyFd_, events, sizeof(events));
+    for (char* ptr = events; length > 0 && ptr < events + length;) {
+      auto const* event = reinterpret_cast<inotify_event const*>(ptr);
+      if (event->mask & IN_Q_OVERFLOW) {
+        // Events were lost, nothing cached can be trusted anymore
+        std::lock_guard<decltype(mutex_)> lock(mutex_);
+        for (auto& [key, entry] : entries_) {
+          ++entry.generation;
+          clear(entry);
+        }
+        ++invalidations_;
+      } else {
+        invalidate(event->wd, (event->mask & IN_IGNORED) != 0);
+      }
+      ptr += sizeof(inotify_event) + event->len;
+    }
+  }
+}
+
+void DirListingCache::invalidate(int wd, bool watchGone) {
+  std::lock_guard<decltype(mutex_)> lock(mutex_);
+  auto watchIt = watches_.find(wd);
+  if (watchIt == watches_.end()) {
+    return;
+  }
+  if (auto entryIt = entries_.find(watchIt->second);
+      entryIt != entries_.end() && entryIt->second.wd == wd) {
+    ++entryIt->second.generation;
+    clear(entryIt->second);
+    if (watchGone) {
+      erase(entryIt);
+    }
+  }
+  ++invalidations_;
+  if (watchGone) {
+    watches_.erase(wd);
+  }
+}
+
+void DirListingCache::clear(Entry& entry) {
+  for (listing_ptr& listing : entry.formats) {
+    if (listing) {
+      bytes_ -= sizeOf(*listing);
+      listing = nullptr;
+    }
+  }
+}
+
+void DirListingCache::erase(std::map<key_type, Entry>::iterator entryIt) {
+  clear(entryIt->second);
+  if (auto watchIt = watches_.find(entryIt->second.wd);
+      watchIt != watches_.end() && watchIt->second == entryIt->first) {
+    ::inotify_rm_watch(inotifyFd_, entryIt->second.wd);
+    watches_.erase(watchIt);
+  }
+  entries_.erase(entryIt);
+}
+
+void DirListingCache::evict(std::size_t bytes, std::size_t entries,
+                            key_type const& keep) {
+  auto entryIt = entries_.begin();
+  while (entryIt != entries_.end() &&
+         (bytes_ + bytes > maxBytes_ ||
+          entries_.size() + entries > maxEntries_)) {
+    if (entryIt->first == keep) {
+      ++entryIt;
+      continue;
+    }
+    erase(entryIt++);
+  }
+}
+#endif
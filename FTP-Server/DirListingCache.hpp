@@ -0,0 +1,89 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "DirListing.hpp"
+
+namespace fs = std::filesystem;
+
+// Server-wide cache of rendered LIST/NLST/MLSD bodies, keyed by the device
+// and inode of the directory, whichever path led to it. On Linux every
+// cached directory is watched with inotify and its entry is dropped as soon
+// as the directory content changes; other platforms render every listing.
+// The cache holds at most maxBytes of listings and never keeps a single
+// listing larger than maxListingBytes, which is sent but not kept.
+class DirListingCache {
+ public:
+  using renderer = std::function<listing_reader(listing_source const&)>;
+
+  enum class Format { LIST = 0, NLST = 1, MLSD = 2 };
+  static constexpr std::size_t kNbFormats = 3;
+
+  struct Stats {
+    std::size_t hits;
+    std::size_t misses;
+    std::size_t invalidations;
+    std::size_t bytes;
+  };
+
+  static DirListingCache& instance();
+
+  virtual ~DirListingCache();
+  DirListingCache(DirListingCache const&) = delete;
+  DirListingCache& operator=(DirListingCache const&) = delete;
+
+  // Reader of the body of the directory source, from the cache or, on a
+  // miss, from render while keeping the chunks read for the next request.
+  listing_reader open(listing_source const& source, Format format,
+                      renderer const& render);
+  Stats stats() const;
+
+ private:
+  using listing_ptr = std::shared_ptr<std::vector<listing_chunk> const>;
+  // Device and inode of the directory
+  using key_type = std::pair<uint64_t, uint64_t>;
+
+  struct Entry {
+    int wd;
+    uint64_t generation;
+    listing_ptr formats[kNbFormats];
+  };
+
+  DirListingCache(std::size_t maxEntries, std::size_t maxBytes,
+                  std::size_t maxListingBytes);
+#if defined(__linux__)
+  void watchLoop();
+  void invalidate(int wd, bool watchGone);
+  // The callers below hold mutex_
+  void clear(Entry& entry);
+  void erase(std::map<key_type, Entry>::iterator entryIt);
+  // Makes room for bytes and entries more, never evicting keep
+  void evict(std::size_t bytes, std::size_t entries, key_type const& keep);
+
+  int inotifyFd_;
+  int stopFd_;
+  std::thread watcher_;
+#endif
+
+  std::size_t const maxEntries_;
+  std::size_t const maxBytes_;
+  std::size_t const maxListingBytes_;
+  std::mutex mutex_;
+  std::map<key_type, Entry> entries_;
+  std::unordered_map<int, key_type> watches_;
+  std::atomic<std::size_t> bytes_;
+
+  std::atomic<std::size_t> hits_;
+  std::atomic<std::size_t> misses_;
+  std::atomic<std::size_t> invalidations_;
+};
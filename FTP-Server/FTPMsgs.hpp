@@ -47,21 +47,32 @@ enum class FTPReplyCode : int {
   ACTION_NOT_TAKEN_INSUFFICIENT_STORAGE_SPACE = 452,
   FILE_ACTION_ABORTED = 552,
   ACTION_NOT_TAKEN_FILENAME_NOT_ALLOWED = 553,
+  // RFC 3659
+  ACTION_NOT_TAKEN_INVALID_REST = 554,
 
   USER_NOTIFICATION = 711,
 };
 
 class FTPMsgs {
  public:
-  FTPMsgs(FTPReplyCode code, const std::string& msg) : code_(code), msg_(msg) {}
+  FTPMsgs(FTPReplyCode code, const std::string& msg) : msg_(msg), code_(code) {}
+  // Multi-line reply; every line of body must start with a space and end
+  // with CRLF.
+  FTPMsgs(FTPReplyCode code, const std::string& msg, const std::string& body)
+      : msg_(msg), code_(code), body_(body) {}
 
   inline FTPReplyCode replyCode() const { return code_; }
   inline std::string msg() const { return msg_; }
   inline std::string str() const {
-    return std::to_string(static_cast<int>(code_)) + " " + msg_ + "\r\n";
+    std::string code = std::to_string(static_cast<int>(code_));
+    if (body_.empty()) {
+      return code + " " + msg_ + "\r\n";
+    }
+    return code + "-" + msg_ + "\r\n" + body_ + code + " End\r\n";
   }
 
  private:
   std::string msg_;
   FTPReplyCode code_;
+  std::string body_;
 };
\ No newline at end of file
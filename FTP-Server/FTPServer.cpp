@@ -1,62 +1,281 @@
-#include <iostream>
+#include <string_view>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <signal.h>
+#endif
+#if defined(__unix__)
+#include <unistd.h>
+#endif
 
 #include "FTPServer.hpp"
 #include "FTPSession.hpp"
+#include "Logger.hpp"
+#include "Metrics.hpp"
+
+#if defined(__linux__)
+using reuse_port =
+    net::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
+#endif
+
+static constexpr auto kProbeInterval = std::chrono::milliseconds(50);
+static constexpr auto kAcceptPause = std::chrono::milliseconds(50);
+
+static std::string_view const kServerFullReply =
+    "421 Too many connections, try again later\r\n";
+static std::string_view const kAddressFullReply =
+    "421 Too many connections from your address\r\n";
+
+// Answers a connection without making a session for it. The send buffer
+// of a new connection is empty, so the reply goes out without waiting.
+static void refuseConnection(net::ip::tcp::socket& peer,
+                             std::string_view reply) {
+  std::error_code ec;
+  peer.non_blocking(true, ec);
+  peer.write_some(net::buffer(reply.data(), reply.size()), ec);
+  peer.close(ec);
+}
 
 FTPServer::FTPServer()
-    : acceptor_(ioContext_), dummy_(net::make_work_guard(ioContext_)) {}
+    : acceptDelayLimit_(0), reusePort_(false), nextReactor_(0) {
+#if defined(__linux__)
+  // sendfile() cannot be told MSG_NOSIGNAL: a client dropping the data
+  // connection mid-transfer must give EPIPE, not kill the server.
+  ::signal(SIGPIPE, SIG_IGN);
+#endif
+}
 
 void FTPServer::start(unsigned int nbThreads, uint16_t port) {
-  try {
-    net::ip::tcp::endpoint endpoint(net::ip::tcp::v4(), port);
-    acceptor_.open(endpoint.protocol());
-    acceptor_.set_option(net::ip::tcp::acceptor::reuse_address(true));
-    acceptor_.bind(endpoint);
-    acceptor_.listen();
-  } catch (std::system_error const& er) {
-    std::cerr << er.what() << std::endl;
+  reactors_.push_back(std::make_unique<Reactor>());
+  Reactor& reactor = *reactors_.front();
+  if (!listen(reactor, port)) {
     // TODO1 retry;
   }
-  std::cout << "FTP Server created. Listening on port "
-            << acceptor_.local_endpoint().port() << std::endl;
-  acceptor_.async_accept(
-      [=](std::error_code const& error, net::ip::tcp::socket peer) {
-        acceptSession(error, peer);
-      });
+  FTP_LOG_INFO("FTP Server created. Listening on port "
+               << reactor.acceptor_.local_endpoint().port());
+  if (acceptDelayLimit_.count() > 0) {
+    probeDelay(reactor);
+  }
+  // The pool threads and this one all run transfer turns
+  TransferScheduler::of(reactor.ioContext_).setConcurrency(nbThreads + 1);
+  waitForConnection(reactor);
+  listenMetrics(reactor.ioContext_);
   for (unsigned int i = 0; i < nbThreads; ++i) {
-    threadPool_.emplace_back([&]() { ioContext_.run(); });
+    threadPool_.emplace_back(
+        [reactor = &reactor]() { reactor->ioContext_.run(); });
   }
-  ioContext_.run();  // TODO with qt
+  reactor.ioContext_.run();  // TODO with qt
+}
+
+bool FTPServer::startMultiReactor(unsigned int nbReactors, uint16_t port,
+                                  bool pinThreads) {
+#if defined(__linux__)
+  // Every reactor gets its own listening socket and the kernel spreads the
+  // incoming connections between them.
+  reusePort_ = true;
+#endif
+  for (unsigned int i = 0; i < std::max(nbReactors, 1u); ++i) {
+    reactors_.push_back(std::make_unique<Reactor>());
+  }
+  // Without SO_REUSEPORT only the first reactor listens, for all of them
+  size_t nbListeners = 0;
+  for (auto& reactor : reactors_) {
+    if ((reusePort_ || reactor == reactors_.front()) &&
+        listen(*reactor, port)) {
+      ++nbListeners;
+    }
+  }
+  if (nbListeners == 0) {
+    FTP_LOG_ERROR("FTP Server cannot listen on port " << port);
+    return false;
+  }
+  for (auto& reactor : reactors_) {
+    if (acceptDelayLimit_.count() > 0) {
+      probeDelay(*reactor);
+    }
+    if (reactor->acceptor_.is_open()) {
+      waitForConnection(*reactor);
+    }
+  }
+  listenMetrics(reactors_.front()->ioContext_);
+  FTP_LOG_INFO("FTP Server created with "
+               << reactors_.size() << " reactors, " << nbListeners
+               << " of them listening on port " << port);
+
+  for (size_t i = 1; i < reactors_.size(); ++i) {
+    threadPool_.emplace_back(
+        [reactor = reactors_[i].get()]() { reactor->ioContext_.run(); });
+  }
+#if defined(__linux__)
+  if (pinThreads) {
+    unsigned int nbCpus = std::max(std::thread::hardware_concurrency(), 1u);
+    auto pin = [nbCpus](pthread_t thread, size_t idx) {
+      cpu_set_t cpuSet;
+      CPU_ZERO(&cpuSet);
+      CPU_SET(idx % nbCpus, &cpuSet);
+      if (pthread_setaffinity_np(thread, sizeof(cpuSet), &cpuSet) != 0) {
+        FTP_LOG_WARN("Unable to pin reactor " << idx);
+      }
+    };
+    pin(pthread_self(), 0);
+    for (size_t i = 0; i < threadPool_.size(); ++i) {
+      pin(threadPool_[i].native_handle(), i + 1);
+    }
+  }
+#else
+  (void)pinThreads;
+#endif
+  reactors_.front()->ioContext_.run();
+  return true;
 }
 
 FTPServer::~FTPServer() { stop(); }
 
 void FTPServer::stop() {
   // TODO2 remove dummy work
-  dummy_.reset();
-  ioContext_.stop();
+  for (auto& reactor : reactors_) {
+    reactor->dummy_.reset();
+    reactor->ioContext_.stop();
+  }
   for (std::thread& thread : threadPool_) {
     thread.join();
   }
   threadPool_.clear();
+#if defined(__unix__)
+  if (metricsAcceptor_) {
+    metricsAcceptor_ = nullptr;
+    ::unlink(metricsPath_.c_str());
+  }
+#endif
+}
+
+void FTPServer::setSessionLimits(size_t maxSessions,
+                                 size_t maxSessionsPerAddress) {
+  sessionLimiter_.setLimits(maxSessions, maxSessionsPerAddress);
+}
+
+void FTPServer::setAcceptDelayLimit(std::chrono::milliseconds maxDelay) {
+  acceptDelayLimit_ = maxDelay;
+}
+
+void FTPServer::setBandwidthLimit(uint64_t bytesPerSecond) {
+  FTPSession::setGlobalBandwidth(bytesPerSecond);
 }
 
 void FTPServer::addUser(std::string const& uname, std::string const& pass) {
   userDb_.addUser(uname, pass);
 }
 
-void FTPServer::acceptSession(std::error_code const& error,
+bool FTPServer::setUserBandwidth(std::string const& uname, uint64_t userRate,
+                                 uint64_t sessionRate) {
+  return userDb_.setBandwidth(uname, userRate, sessionRate);
+}
+
+bool FTPServer::setUserTransferWeight(std::string const& uname,
+                                      unsigned weight) {
+  return userDb_.setTransferWeight(uname, weight);
+}
+
+bool FTPServer::listen(Reactor& reactor, uint16_t port) {
+  try {
+    net::ip::tcp::endpoint endpoint(net::ip::tcp::v4(), port);
+    reactor.acceptor_.open(endpoint.protocol());
+    reactor.acceptor_.set_option(net::ip::tcp::acceptor::reuse_address(true));
+#if defined(__linux__)
+    if (reusePort_) {
+      reactor.acceptor_.set_option(reuse_port(true));
+    }
+#endif
+    reactor.acceptor_.bind(endpoint);
+    reactor.acceptor_.listen();
+    return true;
+  } catch (std::system_error const& er) {
+    FTP_LOG_ERROR(er.what());
+    // Closed, so a failed listener is not taken for a working one
+    std::error_code ec;
+    reactor.acceptor_.close(ec);
+    return false;
+  }
+}
+
+void FTPServer::waitForConnection(Reactor& listener) {
+  // A listener of its own means the connection stays on this reactor,
+  // otherwise the single listener hands connections out in turn.
+  Reactor& target =
+      reusePort_ ? listener : *reactors_[nextReactor_++ % reactors_.size()];
+  if (acceptDelayLimit_.count() > 0) {
+    net::steady_timer::duration delay(
+        target.delay_.load(std::memory_order_relaxed));
+    if (delay > acceptDelayLimit_) {
+      if (!listener.acceptPaused_) {
+        listener.acceptPaused_ = true;
+        FTP_LOG_WARN(
+            "Accepting paused, handlers run "
+            << std::chrono::duration_cast<std::chrono::milliseconds>(delay)
+                   .count()
+            << " ms late");
+      }
+      pauseAccepting(listener);
+      return;
+    }
+    if (listener.acceptPaused_) {
+      listener.acceptPaused_ = false;
+      FTP_LOG_INFO("Accepting resumed");
+    }
+  }
+  listener.acceptor_.async_accept(
+      target.ioContext_, [this, &listener](std::error_code const& error,
+                                           net::ip::tcp::socket peer) {
+        acceptSession(listener, error, peer);
+      });
+}
+
+void FTPServer::pauseAccepting(Reactor& listener) {
+  listener.acceptPause_.expires_after(kAcceptPause);
+  listener.acceptPause_.async_wait(
+      [this, &listener](std::error_code const& error) {
+        if (!error) {
+          waitForConnection(listener);
+        }
+      });
+}
+
+void FTPServer::acceptSession(Reactor& listener, std::error_code const& error,
                               net::ip::tcp::socket& peer) {
   if (error) {
-    std::cerr << "Error accepting session" << error.message() << std::endl;
+    FTP_LOG_ERROR("Error accepting session: " << error.message());
+    // Out of descriptors for instance: closing sessions may free some
+    if (error != net::error::operation_aborted) {
+      pauseAccepting(listener);
+    }
+    return;
+  }
+  Metrics::instance().connectionAccepted();
+  std::error_code ec;
+  net::ip::tcp::endpoint remote = peer.remote_endpoint(ec);
+  if (ec) {
+    // Already gone
+    waitForConnection(listener);
     return;
   }
-  std::cout << "FTP Client connected: "
-            << peer.remote_endpoint().address().to_string() << ":"
-            << peer.remote_endpoint().port() << std::endl;
+  SessionLimiter::ticket_ptr ticket;
+  SessionLimiter::Verdict verdict =
+      sessionLimiter_.admit(remote.address(), ticket);
+  if (verdict != SessionLimiter::Verdict::ADMITTED) {
+    Metrics::instance().connectionRefused();
+    FTP_LOG_DEBUG("FTP Client refused: " << remote.address().to_string());
+    refuseConnection(peer, verdict == SessionLimiter::Verdict::SERVER_FULL
+                               ? kServerFullReply
+                               : kAddressFullReply);
+    waitForConnection(listener);
+    return;
+  }
+  FTP_LOG_INFO("FTP Client connected: " << remote.address().to_string() << ":"
+                                        << remote.port());
+  // The handler lives as long as the session, and so does its ticket
   auto newSession = std::make_shared<FTPSession>(
-      ioContext_, peer, userDb_,
-      [this](session_ptr const& userPtr, bool login) {
+      peer.get_executor().context(), peer, userDb_,
+      [this, ticket](session_ptr const& userPtr, bool login) {
         if (login) {
           loggedUsers_.join(userPtr);
         } else {
@@ -64,8 +283,72 @@ void FTPServer::acceptSession(std::error_code const& error,
         }
       });
   newSession->start();
-  acceptor_.async_accept(
-      [=](std::error_code const& error, net::ip::tcp::socket peer_) {
-        acceptSession(error, peer_);
-      });
+  waitForConnection(listener);
+}
+
+void FTPServer::probeDelay(Reactor& reactor) {
+  reactor.probe_.expires_after(kProbeInterval);
+  reactor.probe_.async_wait([this, &reactor](std::error_code const& error) {
+    if (error) {
+      return;
+    }
+    reactor.delay_.store(
+        (net::steady_timer::clock_type::now() - reactor.probe_.expiry())
+            .count(),
+        std::memory_order_relaxed);
+    probeDelay(reactor);
+  });
+}
+
+#if defined(__unix__)
+void FTPServer::serveMetrics(std::string const& socketPath) {
+  metricsPath_ = socketPath;
+}
+#endif
+
+void FTPServer::listenMetrics(net::io_context& context) {
+#if defined(__unix__)
+  if (metricsPath_.empty()) {
+    return;
+  }
+  try {
+    // A socket file left by a previous run would make bind() fail
+    ::unlink(metricsPath_.c_str());
+    metricsAcceptor_ = std::make_unique<LocalStream::acceptor>(
+        context, LocalStream::endpoint(metricsPath_));
+  } catch (std::system_error const& er) {
+    FTP_LOG_ERROR("Metrics socket unavailable: " << er.what());
+    metricsAcceptor_ = nullptr;
+    return;
+  }
+  FTP_LOG_INFO("Metrics served on " << metricsPath_);
+  waitForMetricsReader();
+#else
+  (void)context;
+#endif
+}
+
+#if defined(__unix__)
+void FTPServer::waitForMetricsReader() {
+  metricsAcceptor_->async_accept([this](std::error_code const& error,
+                                        LocalStream::socket peer) {
+    if (error) {
+      if (error != net::error::operation_aborted) {
+        FTP_LOG_ERROR("Error accepting metrics reader: " << error.message());
+      }
+      return;
+    }
+    auto reader = std::make_shared<LocalStream::socket>(std::move(peer));
+    auto text =
+        std::make_shared<std::string>(Metrics::instance().openMetrics());
+    net::async_write(*reader, net::buffer(*text),
+                     [reader, text](std::error_code const& /*ec*/,
+                                    std::size_t /*bytes_transferred*/) {
+                       std::error_code ec;
+                       reader->shutdown(LocalStream::socket::shutdown_both, ec);
+                       reader->close(ec);
+                     });
+    waitForMetricsReader();
+  });
 }
+#endif
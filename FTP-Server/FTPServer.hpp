@@ -2,11 +2,18 @@
 #include <experimental/executor>
 #include <experimental/internet>
 #include <experimental/io_context>
+#include <experimental/timer>
 
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
 #include <thread>
 
 #include "FTPSession.hpp"
 #include "FTPLoggedUsers.hpp"
+#include "LocalStream.hpp"
+#include "SessionLimiter.hpp"
 #include "UserDatabase.hpp"
 
 namespace net = std::experimental::net;
@@ -15,18 +22,81 @@ class FTPServer {
  public:
   FTPServer();
   virtual ~FTPServer();
+  // One io_context shared by nbThreads threads
   void start(unsigned int nbThreads, uint16_t port);
+  // One io_context per thread, each with its own listener. Sessions and
+  // their data acceptors stay on the io_context that accepted them. Returns
+  // false at once when no listener could be opened.
+  bool startMultiReactor(unsigned int nbReactors, uint16_t port,
+                         bool pinThreads = false);
   void stop();
+#if defined(__unix__)
+  // Every connection to the Unix socket at socketPath gets the metrics in
+  // the OpenMetrics text format, then is closed. Call before starting.
+  void serveMetrics(std::string const& socketPath);
+#endif
+  // Connections over a cap get a 421 and are closed before any session is
+  // made for them. Zero means no cap. Call before starting.
+  void setSessionLimits(size_t maxSessions, size_t maxSessionsPerAddress);
+  // Stops accepting while the handlers of a reactor run more than maxDelay
+  // late, which leaves new connections waiting in the listen backlog. Zero
+  // means accepting never stops. Call before starting.
+  void setAcceptDelayLimit(std::chrono::milliseconds maxDelay);
+  // Bytes per second for all the transfers together, zero for no limit
+  void setBandwidthLimit(uint64_t bytesPerSecond);
   // TODO1 remove when done
   void addUser(std::string const& uname, std::string const& pass);
+  // See UserDatabase::setBandwidth
+  bool setUserBandwidth(std::string const& uname, uint64_t userRate,
+                        uint64_t sessionRate);
+  // See UserDatabase::setTransferWeight
+  bool setUserTransferWeight(std::string const& uname, unsigned weight);
 
  private:
-  void acceptSession(std::error_code const& error, net::ip::tcp::socket& peer);
+  struct Reactor {
+    Reactor()
+        : acceptor_(ioContext_),
+          dummy_(net::make_work_guard(ioContext_)),
+          probe_(ioContext_),
+          delay_(0),
+          acceptPause_(ioContext_),
+          acceptPaused_(false) {}
+    net::io_context ioContext_;
+    net::ip::tcp::acceptor acceptor_;
+    net::executor_work_guard<net::io_context::executor_type> dummy_;
+    // How late the probe timer last ran, that is how long handlers queue
+    // before an io thread picks them up
+    net::steady_timer probe_;
+    std::atomic<net::steady_timer::duration::rep> delay_;
+    // Only used by the accept loop of this reactor's listener
+    net::steady_timer acceptPause_;
+    bool acceptPaused_;
+  };
+
+  bool listen(Reactor& reactor, uint16_t port);
+  void waitForConnection(Reactor& listener);
+  // Tries again to accept once the pause is over
+  void pauseAccepting(Reactor& listener);
+  void acceptSession(Reactor& listener, std::error_code const& error,
+                     net::ip::tcp::socket& peer);
+  void probeDelay(Reactor& reactor);
+  // Opens the metrics socket if one was asked for
+  void listenMetrics(net::io_context& context);
+#if defined(__unix__)
+  void waitForMetricsReader();
+#endif
 
   UserDatabase userDb_;
   FTPLoggedUser loggedUsers_;
+  // Before the reactors: sessions destroyed with them give back tickets
+  SessionLimiter sessionLimiter_;
+  std::chrono::milliseconds acceptDelayLimit_;
   std::vector<std::thread> threadPool_;
-  net::io_context ioContext_;
-  net::ip::tcp::acceptor acceptor_;
-  net::executor_work_guard<net::io_context::executor_type> dummy_;
+  std::vector<std::unique_ptr<Reactor>> reactors_;
+  bool reusePort_;
+  std::atomic<size_t> nextReactor_;
+#if defined(__unix__)
+  std::string metricsPath_;
+  std::unique_ptr<LocalStream::acceptor> metricsAcceptor_;
+#endif
 };
@@ -1,94 +1,89 @@
+#include <algorithm>
+#include <cctype>
+#include <charconv>
 #include <chrono>
-#include <iostream>
+#include <cstring>
 #include <sstream>
+#include <utility>
 
-#include "FTPSession.hpp"
-
-static std::set<fs::path> dirContent(fs::path const& path) {
-  assert(fs::is_directory(path));
-  std::set<fs::path> content;
-  for (auto const& entry : fs::directory_iterator(path)) {
-    content.insert(entry.path());
-  }
-  return content;
-}
-
-static std::string permString(fs::perms const& p) {
-  std::string perm;
-  perm += ((p & fs::perms::owner_read) != fs::perms::none ? "r" : "-");
-  perm += ((p & fs::perms::owner_write) != fs::perms::none ? "w" : "-");
-  perm += ((p & fs::perms::owner_exec) != fs::perms::none ? "x" : "-");
-  perm += ((p & fs::perms::group_read) != fs::perms::none ? "r" : "-");
-  perm += ((p & fs::perms::group_write) != fs::perms::none ? "w" : "-");
-  perm += ((p & fs::perms::group_exec) != fs::perms::none ? "x" : "-");
-  perm += ((p & fs::perms::others_read) != fs::perms::none ? "r" : "-");
-  perm += ((p & fs::perms::others_write) != fs::perms::none ? "w" : "-");
-  perm += ((p & fs::perms::others_exec) != fs::perms::none ? "x" : "-");
-  return perm;
-}
-
-static std::string timeString(fs::path const& path) {
-  using namespace std::chrono;
-
-  fs::file_time_type ftime = fs::last_write_time(path);
-  auto sctp = time_point_cast<system_clock::duration>(
-      ftime - decltype(ftime)::clock::now() + system_clock::now());
-  std::time_t file_time_t = system_clock::to_time_t(sctp);
-
-  auto now = system_clock::now();
-  std::time_t now_time_t = std::chrono::system_clock::to_time_t(now);
-
-  std::tm now_timeinfo, file_timeinfo;
-#if defined(__unix__)
-  localtime_r(&now_time_t, &now_timeinfo);
-  localtime_r(&file_time_t, &file_timeinfo);
-#elif defined(_MSC_VER)
-  localtime_s(&now_timeinfo, &now_time_t);
-  localtime_s(&file_timeinfo, &file_time_t);
-#else
-  static std::mutex mtx;
-  std::unique_lock<std::mutex> lock(mtx);
-  now_timeinfo = *std::localtime(&now_time_t);
-  file_timeinfo = *std::localtime(&file_time_t);
-  lock.unlock();
+#if defined(__linux__)
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
 #endif
 
-  int current_year = now_timeinfo.tm_year, file_year = file_timeinfo.tm_year;
-
-  std::stringstream ss;
-  ss << (file_year == current_year ? std::put_time(&file_timeinfo, "%b %e %R")
-                                   : std::put_time(&now_timeinfo, "%b %e  %Y"));
-  // TODO 1 check time
-  return ss.str();
-}
+#include "FTPSession.hpp"
+#include "Logger.hpp"
 
 FTPSession::FTPSession(
     net::io_context& context, net::ip::tcp::socket& cmdSocket,
     UserDatabase& userDb,
     std::function<void(session_ptr, bool)> const& contactHandler)
-    : userDb_(userDb),
+    : contactHandler_(contactHandler),
+      userDb_(userDb),
+      lastCmd_(0),
       context_(context),
       cmdSocket_(std::move(cmdSocket)),
       notiSocket_(context_),
-      thisClientUploading_(false),
-      dataTypeBinary_(true),
       msgWriteStrand_(context_.get_executor()),
-      fileRWStrand_(context_.get_executor()),
-      dataBufStrand_(context_.get_executor()),
+      msgsInFlight_(0),
+      handlingCmds_(false),
+      replyDeferred_(false),
+      pasvGeneration_(0),
+      closing_(false),
+      dataTypeBinary_(true),
+      restOffset_(0),
+      modeZ_(false),
+      modeZLevel_(6),
+      hashAlgorithm_(HashAlgorithm::SHA256),
+      rangeFirst_(0),
+      rangeLast_(kToEndOfFile),
       dataAcceptor_(context_),
-      contactHandler_(contactHandler) {}
+      dataBufferOffset_(0),
+      fileRWStrand_(context_.get_executor()),
+      dataBufStrand_(context_.get_executor()) {
+  Metrics::instance().sessionStarted();
+}
 
 FTPSession::~FTPSession() {
-  std::cout << "FTP Session shutting down" << std::endl;
+  FTP_LOG_INFO("FTP Session shutting down");
   // TODO1 ua co ham stop() khong vay
   sessionUser_ = nullptr;
-  if (thisClientUploading_) {
-    isUploading_ = false;
+  for (auto const& timeout : {idleTimeout_, pasvTimeout_}) {
+    if (timeout) {
+      timeout->cancel();
+    }
   }
-  contactHandler_(shared_from_this(), false);
+  Metrics::instance().sessionEnded();
 }
 
-std::atomic<bool> FTPSession::isUploading_(false);
+FTPWriteLocks FTPSession::writeLocks_;
+
+std::atomic<size_t> FTPSession::maxRepliesPerWrite_(64);
+std::atomic<size_t> FTPSession::replyWrites_(0);
+std::atomic<size_t> FTPSession::repliesWritten_(0);
+
+FTPSession::Timeouts FTPSession::timeouts_{std::chrono::minutes(5),
+                                           std::chrono::seconds(30),
+                                           std::chrono::minutes(1)};
+
+void FTPSession::setMaxRepliesPerWrite(size_t maxReplies) {
+  maxRepliesPerWrite_ = std::max<size_t>(maxReplies, 1);
+}
+
+FTPSession::ReplyWriteStats FTPSession::replyWriteStats() {
+  return ReplyWriteStats{replyWrites_, repliesWritten_};
+}
+
+void FTPSession::setTimeouts(Timeouts const& timeouts) {
+  timeouts_ = timeouts;
+}
+
+TokenBucket FTPSession::globalBandwidth_;
+
+void FTPSession::setGlobalBandwidth(uint64_t bytesPerSecond) {
+  globalBandwidth_.setRate(bytesPerSecond);
+}
 
 std::string FTPSession::getUserName() const { return username_; }
 
@@ -96,242 +91,269 @@ void FTPSession::start() {
   try {
     cmdSocket_.set_option(net::ip::tcp::no_delay(true));
   } catch (std::system_error const& er) {
-    std::cerr << "Unable to set socket option tcp::no_delay: " << er.what()
-              << std::endl;
+    FTP_LOG_WARN("Unable to set socket option tcp::no_delay: " << er.what());
   }
   sendFTPMsg(FTPMsgs(FTPReplyCode::SERVICE_READY_FOR_NEW_USER,
                      "Welcome to fineFTP Server"));
+  // Weak, an idle session must not be kept alive by its own timeout
+  std::weak_ptr<FTPSession> weak = shared_from_this();
+  idleTimeout_ =
+      TimingWheel::instance().start(timeouts_.controlIdle, [weak]() {
+        if (session_ptr me = weak.lock()) {
+          net::post(me->msgWriteStrand_, [me]() { me->closeIdleSession(); });
+        }
+      });
   readFTPCmd();
 }
 
+void FTPSession::closeIdleSession() {
+  FTP_LOG_INFO("Closing idle session");
+  closing_ = true;
+  queueFTPMsg(FTPMsgs(FTPReplyCode::SERVICE_NOT_AVAILABLE,
+                      "Idle timeout, closing control connection"));
+}
+
 void FTPSession::deliver(std::string const& msg) {
   if (notiSocket_.is_open()) {
     net::async_write(
         notiSocket_, net::buffer(msg),
         [](std::error_code const& ec, std::size_t /*bytes_to_transfer*/) {
           if (ec) {
-            std::cerr << "Notification error: " << ec.message() << std::endl;
+            FTP_LOG_ERROR("Notification error: " << ec.message());
           }
         });
   }
 }
 
-void FTPSession::sendFTPMsg(FTPMsgs const& msg) {
+FTPMsgs FTPSession::deferReply() {
+  replyDeferred_ = true;
+  // Never sent
+  return FTPMsgs(FTPReplyCode::COMMAND_OK, "");
+}
+
+void FTPSession::sendDeferredReply(FTPMsgs const& msg) {
   net::post(msgWriteStrand_, [me = shared_from_this(), msg]() {
-    bool writeInProgress = !me->msgOutputQueue_.empty();
-    me->msgOutputQueue_.push_back(msg.str());
-    if (!writeInProgress) {
-      me->startSendingMsgs();
-    }
+    me->replyDeferred_ = false;
+    me->queueFTPMsg(msg);
+    // Handles what was pipelined meanwhile, then reads on
+    me->handleFTPCmds();
   });
 }
 
+void FTPSession::sendFTPMsg(FTPMsgs const& msg) {
+  net::post(msgWriteStrand_,
+            [me = shared_from_this(), msg]() { me->queueFTPMsg(msg); });
+}
+
+void FTPSession::queueFTPMsg(FTPMsgs const& msg) {
+  msgOutputQueue_.push_back(msg.str());
+  if (msgsInFlight_ == 0 && !handlingCmds_) {
+    startSendingMsgs();
+  }
+}
+
 void FTPSession::readFTPCmd() {
-  cmdInputStr_.clear();
   net::async_read_until(
       cmdSocket_, net::dynamic_buffer(cmdInputStr_), "\r\n",
       net::bind_executor(
           msgWriteStrand_,
-          [me = shared_from_this()](std::error_code const& ec, size_t length) {
+          [me = shared_from_this()](std::error_code const& ec,
+                                    size_t /*length*/) {
             if (!ec) {
-              std::string packetStr(me->cmdInputStr_, 0,
-                                    length - 2);  // Remove \r\n
-              me->cmdInputStr_.clear();
-              std::cout << "FTP << " << packetStr << std::endl;
-              me->handleFTPCmd(packetStr);
+              me->handleFTPCmds();
               return;
             }
-            if (ec != net::error::eof) {
-              std::cerr << ec.message() << std::endl;
+            if (me->closing_) {
+              FTP_LOG_INFO("Control connection closed by server");
+            } else if (ec != net::error::eof) {
+              FTP_LOG_ERROR("Control connection error: " << ec.message());
             } else {
-              std::cout << "Control connection closed by client" << std::endl;
+              FTP_LOG_INFO("Control connection closed by client");
             }
+            // Nothing may keep the session alive once the client is gone: a
+            // pending data accept would, and so would the logged users list
+            std::error_code closeEc;
+            me->dataAcceptor_.close(closeEc);
+            me->contactHandler_(me, false);
           }));
 }
 
 void FTPSession::startSendingMsgs() {
-  std::cout << "FTP >> " << msgOutputQueue_.front() << std::endl;
+  // Everything queued so far goes out in a single gathered write
+  size_t nbMsgs = std::min(msgOutputQueue_.size(), maxRepliesPerWrite_.load());
+  std::vector<net::const_buffer> buffers;
+  buffers.reserve(nbMsgs);
+  for (size_t i = 0; i < nbMsgs; ++i) {
+    FTP_LOG_DEBUG("FTP >> " << msgOutputQueue_[i]);
+    buffers.push_back(net::buffer(msgOutputQueue_[i]));
+  }
+  msgsInFlight_ = nbMsgs;
+  ++replyWrites_;
+  repliesWritten_ += nbMsgs;
   net::async_write(
-      cmdSocket_, net::buffer(msgOutputQueue_.front()),
+      cmdSocket_, buffers,
       net::bind_executor(
           msgWriteStrand_,
           [me = shared_from_this()](std::error_code const& ec,
                                     std::size_t /*bytes_to_transfer*/) {
             if (!ec) {
-              me->msgOutputQueue_.pop_front();
+              me->msgOutputQueue_.erase(
+                  me->msgOutputQueue_.begin(),
+                  me->msgOutputQueue_.begin() + me->msgsInFlight_);
+              me->msgsInFlight_ = 0;
               if (!me->msgOutputQueue_.empty()) {
                 me->startSendingMsgs();
+              } else if (me->closing_) {
+                // Ends the pending read, which releases the session
+                std::error_code closeEc;
+                me->cmdSocket_.shutdown(net::socket_base::shutdown_both,
+                                        closeEc);
+                me->cmdSocket_.close(closeEc);
               }
             } else {
-              std::cerr << "Message write error: " << ec.message() << std::endl;
+              FTP_LOG_ERROR("Message write error: " << ec.message());
             }
           }));
 }
 
-void FTPSession::handleFTPCmd(std::string const& cmd) {
-  const std::map<std::string, std::function<FTPMsgs(std::string)>> cmdMap{
-      // TODO1 make it static?
-      {"UADD",
-       [&](std::string const& para) -> FTPMsgs {
-         return handleFTPCmdUADD(para);
-       }},
-      {"USER",
-       [&](std::string const& para) -> FTPMsgs {
-         return handleFTPCmdUSER(para);
-       }},
-      {"NOTI",
-       [&](std::string const& para) -> FTPMsgs {
-         return handleFTPCmdNOTI(para);
-       }},
-      {"PASS",
-       [&](std::string const& para) -> FTPMsgs {
-         return handleFTPCmdPASS(para);
-       }},
-      {"ACCT",
-       [&](std::string const& para) -> FTPMsgs {
-         return handleFTPCmdACCT(para);
-       }},
-      {"CWD",
-       [&](std::string const& para) -> FTPMsgs {
-         return handleFTPCmdCWD(para);
-       }},
-      {"CDUP",
-       [&](std::string const& para) -> FTPMsgs {
-         return handleFTPCmdCDUP(para);
-       }},
-      {"REIN",
-       [&](std::string const& para) -> FTPMsgs {
-         return handleFTPCmdREIN(para);
-       }},
-      {"QUIT",
-       [&](std::string const& para) -> FTPMsgs {
-         return handleFTPCmdQUIT(para);
-       }},
-      // Transfer parameter commands
-      {"PORT",
-       [&](std::string const& para) -> FTPMsgs {
-         return handleFTPCmdPORT(para);
-       }},
-      {"PASV",
-       [&](std::string const& para) -> FTPMsgs {
-         return handleFTPCmdPASV(para);
-       }},
-      {"TYPE",
-       [&](std::string const& para) -> FTPMsgs {
-         return handleFTPCmdTYPE(para);
-       }},
-      {"STRU",
-       [&](std::string const& para) -> FTPMsgs {
-         return handleFTPCmdSTRU(para);
-       }},
-      {"MODE",
-       [&](std::string const& para) -> FTPMsgs {
-         return handleFTPCmdMODE(para);
-       }},
-      // Ftp service commands
-      {"RETR",
-       [&](std::string const& para) -> FTPMsgs {
-         return handleFTPCmdRETR(para);
-       }},
-      {"STOR",
-       [&](std::string const& para) -> FTPMsgs {
-         return handleFTPCmdSTOR(para);
-       }},
-      {"SIZE",
-       [&](std::string const& para) -> FTPMsgs {
-         return handleFTPCmdSIZE(para);
-       }},
-      {"STOU",
-       [&](std::string const& para) -> FTPMsgs {
-         return handleFTPCmdSTOU(para);
-       }},
-      {"APPE",
-       [&](std::string const& para) -> FTPMsgs {
-         return handleFTPCmdAPPE(para);
-       }},
-      {"ALLO",
-       [&](std::string const& para) -> FTPMsgs {
-         return handleFTPCmdALLO(para);
-       }},
-      {"REST",
-       [&](std::string const& para) -> FTPMsgs {
-         return handleFTPCmdREST(para);
-       }},
-      {"RNFR",
-       [&](std::string const& para) -> FTPMsgs {
-         return handleFTPCmdRNFR(para);
-       }},
-      {"RNTO",
-       [&](std::string const& para) -> FTPMsgs {
-         return handleFTPCmdRNTO(para);
-       }},
-      {"ABOR",
-       [&](std::string const& para) -> FTPMsgs {
-         return handleFTPCmdABOR(para);
-       }},
-      {"DELE",
-       [&](std::string const& para) -> FTPMsgs {
-         return handleFTPCmdDELE(para);
-       }},
-      {"RMD",
-       [&](std::string const& para) -> FTPMsgs {
-         return handleFTPCmdRMD(para);
-       }},
-      {"MKD",
-       [&](std::string const& para) -> FTPMsgs {
-         return handleFTPCmdMKD(para);
-       }},
-      {"PWD",
-       [&](std::string const& para) -> FTPMsgs {
-         return handleFTPCmdPWD(para);
-       }},
-      {"LIST",
-       [&](std::string const& para) -> FTPMsgs {
-         return handleFTPCmdLIST(para);
-       }},
-      {"NLST",
-       [&](std::string const& para) -> FTPMsgs {
-         return handleFTPCmdNLST(para);
-       }},
-      {"SITE",
-       [&](std::string const& para) -> FTPMsgs {
-         return handleFTPCmdSITE(para);
-       }},
-      {"SYST",
-       [&](std::string const& para) -> FTPMsgs {
-         return handleFTPCmdSYST(para);
-       }},
-      {"STAT",
-       [&](std::string const& para) -> FTPMsgs {
-         return handleFTPCmdSTAT(para);
-       }},
-      {"HELP",
-       [&](std::string const& para) -> FTPMsgs {
-         return handleFTPCmdHELP(para);
-       }},
-      {"NOOP",
-       [&](std::string const& para) -> FTPMsgs {
-         return handleFTPCmdNOOP(para);
-       }},
-  };
+// Commands are at most 8 characters, so they pack into a 64 bit key that can
+// be switched on. Lower case letters are folded to upper case.
+static constexpr uint64_t cmdKey(std::string_view cmd) {
+  uint64_t key = 0;
+  for (char c : cmd) {
+    key = (key << 8) |
+          static_cast<uint8_t>(c >= 'a' && c <= 'z' ? c - ('a' - 'A') : c);
+  }
+  return key;
+}
 
-  size_t spaceIdx = cmd.find_first_of(' ');
-  std::string ftpCmd = cmd.substr(0, spaceIdx);
-  std::transform(ftpCmd.begin(), ftpCmd.end(), ftpCmd.begin(), ::toupper);
-
-  auto commandIt = cmdMap.find(ftpCmd);
-  if (std::string para =
-          spaceIdx != std::string::npos ? cmd.substr(spaceIdx + 1) : "";
-      commandIt != cmdMap.end()) {
-    FTPMsgs reply = commandIt->second(para);
-    sendFTPMsg(reply);
-    contactHandler_(shared_from_this(), true);
-    lastCmd_ = ftpCmd;
+FTPSession::cmdHandler FTPSession::lookupFTPCmd(uint64_t key) {
+  switch (key) {
+    case cmdKey("UADD"): return &FTPSession::handleFTPCmdUADD;
+    case cmdKey("USER"): return &FTPSession::handleFTPCmdUSER;
+    case cmdKey("NOTI"): return &FTPSession::handleFTPCmdNOTI;
+    case cmdKey("PASS"): return &FTPSession::handleFTPCmdPASS;
+    case cmdKey("ACCT"): return &FTPSession::handleFTPCmdACCT;
+    case cmdKey("CWD"): return &FTPSession::handleFTPCmdCWD;
+    case cmdKey("CDUP"): return &FTPSession::handleFTPCmdCDUP;
+    case cmdKey("REIN"): return &FTPSession::handleFTPCmdREIN;
+    case cmdKey("QUIT"): return &FTPSession::handleFTPCmdQUIT;
+    // Transfer parameter commands
+    case cmdKey("PORT"): return &FTPSession::handleFTPCmdPORT;
+    case cmdKey("PASV"): return &FTPSession::handleFTPCmdPASV;
+    case cmdKey("TYPE"): return &FTPSession::handleFTPCmdTYPE;
+    case cmdKey("STRU"): return &FTPSession::handleFTPCmdSTRU;
+    case cmdKey("MODE"): return &FTPSession::handleFTPCmdMODE;
+    // Ftp service commands
+    case cmdKey("RETR"): return &FTPSession::handleFTPCmdRETR;
+    case cmdKey("STOR"): return &FTPSession::handleFTPCmdSTOR;
+    case cmdKey("SIZE"): return &FTPSession::handleFTPCmdSIZE;
+    case cmdKey("STOU"): return &FTPSession::handleFTPCmdSTOU;
+    case cmdKey("APPE"): return &FTPSession::handleFTPCmdAPPE;
+    case cmdKey("ALLO"): return &FTPSession::handleFTPCmdALLO;
+    case cmdKey("REST"): return &FTPSession::handleFTPCmdREST;
+    case cmdKey("RNFR"): return &FTPSession::handleFTPCmdRNFR;
+    case cmdKey("RNTO"): return &FTPSession::handleFTPCmdRNTO;
+    case cmdKey("ABOR"): return &FTPSession::handleFTPCmdABOR;
+    case cmdKey("DELE"): return &FTPSession::handleFTPCmdDELE;
+    case cmdKey("RMD"): return &FTPSession::handleFTPCmdRMD;
+    case cmdKey("MKD"): return &FTPSession::handleFTPCmdMKD;
+    case cmdKey("PWD"): return &FTPSession::handleFTPCmdPWD;
+    case cmdKey("LIST"): return &FTPSession::handleFTPCmdLIST;
+    case cmdKey("NLST"): return &FTPSession::handleFTPCmdNLST;
+    case cmdKey("SITE"): return &FTPSession::handleFTPCmdSITE;
+    case cmdKey("SYST"): return &FTPSession::handleFTPCmdSYST;
+    case cmdKey("STAT"): return &FTPSession::handleFTPCmdSTAT;
+    case cmdKey("HELP"): return &FTPSession::handleFTPCmdHELP;
+    case cmdKey("NOOP"): return &FTPSession::handleFTPCmdNOOP;
+    case cmdKey("FEAT"): return &FTPSession::handleFTPCmdFEAT;
+    case cmdKey("OPTS"): return &FTPSession::handleFTPCmdOPTS;
+    case cmdKey("MLST"): return &FTPSession::handleFTPCmdMLST;
+    case cmdKey("MLSD"): return &FTPSession::handleFTPCmdMLSD;
+    // File digest commands
+    case cmdKey("HASH"): return &FTPSession::handleFTPCmdHASH;
+    case cmdKey("RANG"): return &FTPSession::handleFTPCmdRANG;
+    case cmdKey("XCRC"): return &FTPSession::handleFTPCmdXCRC;
+    case cmdKey("XMD5"): return &FTPSession::handleFTPCmdXMD5;
+    case cmdKey("XSHA1"): return &FTPSession::handleFTPCmdXSHA1;
+    case cmdKey("XSHA256"): return &FTPSession::handleFTPCmdXSHA256;
+    default: return nullptr;
+  }
+}
+
+void FTPSession::handleFTPCmd(std::string_view cmd) {
+  if (std::optional<FTPMsgs> reply = executeFTPCmd(cmd); reply) {
+    // Queued directly, so the reply always precedes any message posted by
+    // the transfer the command may have started.
+    if (!replyDeferred_) {
+      queueFTPMsg(*reply);
+    }
+    if (lastCmd_ != cmdKey("QUIT")) {
+      contactHandler_(shared_from_this(), true);
+    }
   } else {
-    sendFTPMsg(FTPMsgs(FTPReplyCode::SYNTAX_ERROR_UNRECOGNIZED_COMMAND,
-                       "Unrecognized command"));
+    queueFTPMsg(FTPMsgs(FTPReplyCode::SYNTAX_ERROR_UNRECOGNIZED_COMMAND,
+                        "Unrecognized command"));
+  }
+}
+
+std::optional<FTPMsgs> FTPSession::executeFTPCmd(std::string_view cmd) {
+  size_t spaceIdx = cmd.find_first_of(' ');
+  std::string_view ftpCmd = cmd.substr(0, spaceIdx);
+  std::string_view para =
+      spaceIdx != std::string_view::npos ? cmd.substr(spaceIdx + 1) : "";
+
+  uint64_t key = ftpCmd.size() <= 8 ? cmdKey(ftpCmd) : 0;
+  cmdHandler handler = lookupFTPCmd(key);
+  if (!handler) {
+    Metrics::instance().unknownCommand();
+    return std::nullopt;
+  }
+  auto start = std::chrono::steady_clock::now();
+  FTPMsgs reply = (this->*handler)(para);
+  Metrics::instance().commandLatency(key).record(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::steady_clock::now() - start)
+          .count());
+  lastCmd_ = key;
+  if (key != cmdKey("REST")) {
+    restOffset_ = 0;
   }
-  if (lastCmd_ == "QUIT") {
+  if (key != cmdKey("RANG")) {
+    rangeFirst_ = 0;
+    rangeLast_ = kToEndOfFile;
+  }
+  return reply;
+}
+
+void FTPSession::handleFTPCmds() {
+  // Clients may pipeline commands: handle every complete line we have and
+  // answer them with one write.
+  handlingCmds_ = true;
+  if (idleTimeout_) {
+    idleTimeout_->restart();
+  }
+  size_t lineBegin = 0;
+  for (size_t lineEnd; lastCmd_ != cmdKey("QUIT") && !replyDeferred_ &&
+                       (lineEnd = cmdInputStr_.find("\r\n", lineBegin)) !=
+                           std::string::npos;
+       lineBegin = lineEnd + 2) {
+    std::string_view packetStr(cmdInputStr_.data() + lineBegin,
+                               lineEnd - lineBegin);
+    FTP_LOG_DEBUG("FTP << " << packetStr);
+    handleFTPCmd(packetStr);
+  }
+  cmdInputStr_.erase(0, lineBegin);
+  handlingCmds_ = false;
+  if (msgsInFlight_ == 0 && !msgOutputQueue_.empty()) {
+    startSendingMsgs();
+  }
+
+  if (replyDeferred_) {
+    // Carried on by sendDeferredReply
+    return;
+  }
+  if (lastCmd_ == cmdKey("QUIT")) {
     // TODO1 check atomic
     net::bind_executor(msgWriteStrand_,
                        [me = shared_from_this()]() { me->cmdSocket_.close(); });
@@ -343,20 +365,12 @@ void FTPSession::handleFTPCmd(std::string const& cmd) {
 
 fs::path FTPSession::FTP2LocalPath(fs::path const& ftpPath) const {
   assert(sessionUser_);
-  fs::path path = ftpPath.has_root_directory()
-                      ? sessionUser_->localRootPath_ / ftpPath.relative_path()
-                      : ftpWorkingDir_ / ftpPath;
-  path = fs::weakly_canonical(path);
-  return path < sessionUser_->localRootPath_ ? sessionUser_->localRootPath_
-                                             : path;
+  return sessionUser_->toLocalPath(ftpWorkingDir_, ftpPath);
 }
 
 std::string FTPSession::Local2FTPPath(fs::path const& ftp_Path) const {
   assert(sessionUser_);
-  if (ftp_Path == sessionUser_->localRootPath_) return "/";
-  std::string ftp_path = ftp_Path.generic_string(),
-              root_path = sessionUser_->localRootPath_.generic_string();
-  return ftp_path.substr(root_path.find(ftp_path) + root_path.length() + 1);
+  return sessionUser_->toFTPPath(ftp_Path);
 }
 
 FTPMsgs FTPSession::checkPathRenamable(fs::path const& ftpPath) const {
@@ -367,94 +381,220 @@ FTPMsgs FTPSession::checkPathRenamable(fs::path const& ftpPath) const {
   if (ftpPath.empty()) {
     return FTPMsgs(FTPReplyCode::SYNTAX_ERROR_PARAMETERS, "Empty path");
   }
-  fs::path localPath = FTP2LocalPath(ftpPath);
-  try {
-    if (fs::exists(localPath)) {
-      if (fs::is_directory(localPath)) {
-        auto fs = fs::directory_iterator(localPath);
-      }
-      // No read permission -> throw
-      return FTPMsgs(FTPReplyCode::COMMAND_OK, "");
-    } else {
-      return FTPMsgs(FTPReplyCode::ACTION_NOT_TAKEN, "File does not exist");
-    }
-  } catch (fs::filesystem_error const&) {
+  std::error_code ec;
+  sessionUser_->root_.status(FTP2LocalPath(ftpPath), ec);
+  if (!ec) {
+    return FTPMsgs(FTPReplyCode::COMMAND_OK, "");
+  } else if (ec == std::errc::permission_denied) {
     return FTPMsgs(FTPReplyCode::ACTION_NOT_TAKEN, "Permission denied");
+  } else {
+    return FTPMsgs(FTPReplyCode::ACTION_NOT_TAKEN, "File does not exist");
+  }
+}
+
+void FTPSession::setUpModeZ(ioFile_ptr const& file, fs::path const& path,
+                            bool upload) {
+#if defined(FTP_HAVE_ZLIB)
+  if (modeZ_) {
+    file->zstream_ =
+        upload ? std::make_unique<ZStream>(ZStream::Mode::INFLATE)
+               : std::make_unique<ZStream>(
+                     ZStream::Mode::DEFLATE,
+                     isCompressedFile(path) ? 0 : modeZLevel_);
+  }
+#endif
+}
+
+FTPSession::socket_ptr FTPSession::openDataSocket(
+    net::ip::tcp::socket&& peer) {
+  auto dataSocket = std::make_shared<DataSocket>(std::move(peer), sessionUser_);
+  std::weak_ptr<DataSocket> weak = dataSocket;
+  dataSocket->stallTimeout_ =
+      TimingWheel::instance().start(timeouts_.dataStall, [weak]() {
+        if (auto stalled = weak.lock()) {
+          FTP_LOG_INFO("Data connection stalled, aborting transfer");
+          stalled->stalled_ = true;
+          // shutdown() only touches the descriptor, so it is safe from this
+          // thread; the pending operations then fail or see the end
+          std::error_code ec;
+          stalled->shutdown(net::socket_base::shutdown_both, ec);
+        }
+      });
+  return dataSocket;
+}
+
+void FTPSession::dataMoved(DataSocket& dataSocket) {
+  dataSocket.stallTimeout_->restart();
+  if (idleTimeout_) {
+    idleTimeout_->restart();
+  }
+}
+
+void FTPSession::abortTransfer(DataSocket& dataSocket) {
+  if (!dataSocket.aborted_.exchange(true)) {
+    sendFTPMsg(
+        FTPMsgs(FTPReplyCode::TRANSFER_ABORTED, "Data transfer aborted"));
+  }
+}
+
+std::size_t FTPSession::turnSize(DataSocket const& dataSocket) const {
+  static constexpr std::size_t kMinSize = 8 << 10;
+  unsigned weight = dataSocket.user_ ? dataSocket.user_->transferWeight_.load()
+                                     : 1;
+  std::size_t size = TransferScheduler::kQuantum *
+                     std::clamp(weight, 1u, TransferScheduler::kMaxWeight);
+  uint64_t rate = 0;
+  for (uint64_t limit :
+       {globalBandwidth_.rate(), bandwidth_.rate(),
+        dataSocket.user_ ? dataSocket.user_->bandwidth_.rate() : 0}) {
+    if (limit > 0 && (rate == 0 || limit < rate)) {
+      rate = limit;
+    }
+  }
+  if (rate > 0) {
+    size = std::min(size, std::max<std::size_t>(rate / 10, kMinSize));
+  }
+  return size;
+}
+
+TokenBucket::clock::duration FTPSession::payBandwidth(DataSocket& dataSocket,
+                                                      std::size_t bytes) {
+  // Every level is paid, whichever one holds the transfer back
+  TokenBucket::clock::duration wait =
+      std::max(globalBandwidth_.pay(bytes), bandwidth_.pay(bytes));
+  if (dataSocket.user_) {
+    wait = std::max(wait, dataSocket.user_->bandwidth_.pay(bytes));
+  }
+  return wait;
+}
+
+void FTPSession::continueTransfer(socket_ptr const& dataSocketPtr,
+                                  TokenBucket::clock::duration wait,
+                                  std::function<void(void)> const& turn) {
+  // Waited out in short steps that restart the stall timeout: a transfer
+  // held back by the server is not stuck
+  static constexpr TokenBucket::clock::duration kMaxStep =
+      std::chrono::milliseconds(500);
+  if (wait <= TokenBucket::clock::duration::zero()) {
+    TransferScheduler::of(context_).schedule(turn);
+    return;
+  }
+  TokenBucket::clock::time_point until = TokenBucket::clock::now() + wait;
+  dataSocketPtr->throttle_.expires_after(std::min(wait, kMaxStep));
+  dataSocketPtr->throttle_.async_wait(
+      [me = shared_from_this(), dataSocketPtr, turn,
+       until](std::error_code const& ec) {
+        if (ec) {
+          return;
+        }
+        me->dataMoved(*dataSocketPtr);
+        me->continueTransfer(dataSocketPtr,
+                             until - TokenBucket::clock::now(), turn);
+      });
+}
+
+listing_source FTPSession::openListing(fs::path const& localPath,
+                                      bool directory,
+                                      std::error_code& ec) const {
+  RootDir const& root = sessionUser_->root_;
+#if defined(__linux__)
+  // A symlink is listed as itself, like it is in the directory listings
+  int fd = root.open(localPath,
+                     directory ? O_RDONLY | O_DIRECTORY : O_PATH | O_NOFOLLOW,
+                     0, ec);
+  return fd < 0 ? nullptr : std::make_shared<ListingSource>(fd);
+#else
+  if (directory) {
+    root.isListable(localPath, ec);
+  } else {
+    root.status(localPath, ec);
   }
+  return ec ? nullptr : std::make_shared<ListingSource>(localPath);
+#endif
 }
 
-void FTPSession::sendDirListing(std::set<fs::path> const& dirContent) {
+void FTPSession::sendListing(listing_source const& dir,
+                             DirListingCache::Format format,
+                             DirListingCache::renderer const& render) {
   dataAcceptor_.async_accept(
-      [me = shared_from_this(), dirContent](std::error_code const& ec,
-                                            net::ip::tcp::socket peer) {
+      [me = shared_from_this(), dir, format, render](
+          std::error_code const& ec, net::ip::tcp::socket peer) {
         if (ec) {
           me->sendFTPMsg(
               FTPMsgs(FTPReplyCode::TRANSFER_ABORTED, "Data transfer aborted"));
           return;
         }
-        socket_ptr socketPtr(
-            std::make_shared<net::ip::tcp::socket>(std::move(peer)));
-
-        std::stringstream stream;
-        std::string ownerStr = "hcmus", groupStr = "hcmus";
-        for (auto const& entry : dirContent) {
-          // hcmus hcmus <size> <timestring> <filename>
-          stream << (fs::is_directory(entry) ? 'd' : '-')
-                 << permString(fs::status(entry).permissions()) << "   1 ";
-
-          stream << std::setw(10) << ownerStr << " " << std::setw(10)
-                 << groupStr << " ";
-          stream << std::setw(10) << fs::file_size(entry) << " ";
-          stream << timeString(entry) << " ";
-          stream << entry.filename().string() << "\r\n";
+        socket_ptr dataSocketPtr(me->openDataSocket(std::move(peer)));
+        // Nothing is read yet, the chunks are read as the data connection
+        // takes them. Cached listings are shared between sessions.
+        listingTransfer_ptr listing(std::make_shared<ListingTransfer>(
+            DirListingCache::instance().open(dir, format, render)));
+#if defined(FTP_HAVE_ZLIB)
+        // The cache holds plain listings, MODE Z compresses every transfer
+        if (me->modeZ_) {
+          listing->zstream_ = std::make_unique<ZStream>(
+              ZStream::Mode::DEFLATE, me->modeZLevel_);
         }
-        // Copy the file list into a raw char vector
-        std::string dirListStr = stream.str();
-        charbuf_ptr rawDirListData(
-            std::make_shared<std::vector<char>>(dirListStr.size()));
-        std::copy(dirListStr.begin(), dirListStr.end(),
-                  std::back_inserter(*rawDirListData));
-        // Send the string out
-        me->addDataToBufferAndSend(socketPtr, rawDirListData);
-        me->addDataToBufferAndSend(
-            socketPtr, nullptr);  // Nullpointer indicates end of transmission
+#endif
+        // Keep a second chunk ready while the first one is written
+        me->readListingAndSend(dataSocketPtr, listing);
+        me->readListingAndSend(dataSocketPtr, listing);
       });
 }
 
-void FTPSession::sendNameList(std::set<fs::path> const& dirContent) {
-  dataAcceptor_.async_accept([me = shared_from_this(), dirContent](
-                                 std::error_code const& ec,
-                                 net::ip::tcp::socket peer) {
-    if (ec) {
-      me->sendFTPMsg(
-          FTPMsgs(FTPReplyCode::TRANSFER_ABORTED, "Data transfer aborted"));
-      return;
-    }
-    socket_ptr dataSocketPtr(
-        std::make_shared<net::ip::tcp::socket>(std::move(peer)));
-    // Create a file list
-    std::stringstream stream;
-    for (const auto& entry : dirContent) {
-      stream << entry.filename() << "\r\n";
-    }
-
-    // Copy the file list into a raw char vector
-    std::string dirListStr = stream.str();
-    charbuf_ptr rawDirListData(
-        std::make_shared<std::vector<char>>(dirListStr.size()));
-    std::copy(dirListStr.begin(), dirListStr.end(),
-              std::back_inserter(*rawDirListData));
-
-    // Send the string out
-    me->addDataToBufferAndSend(dataSocketPtr, rawDirListData);
-    me->addDataToBufferAndSend(
-        dataSocketPtr, nullptr);  // Nullpointer indicates end of transmission
+void FTPSession::readListingAndSend(socket_ptr const& dataSocketPtr,
+                                    listingTransfer_ptr const& listing) {
+  // Reading a large directory takes turns with the other transfers
+  TransferScheduler::of(context_).schedule([me = shared_from_this(),
+                                            dataSocketPtr, listing]() {
+    net::dispatch(me->fileRWStrand_, [me, dataSocketPtr, listing]() {
+      if (listing->finished_ || dataSocketPtr->aborted_) {
+        return;
+      }
+      charbuf_ptr chunk = listing->reader_->next();
+      listing->finished_ = !chunk;
+#if defined(FTP_HAVE_ZLIB)
+      if (listing->zstream_) {
+        charbuf_ptr packed(BufferPool::instance().acquire(kListingChunkSize));
+        packed->clear();
+        listing->zstream_->process(
+            chunk ? chunk->data() : nullptr, chunk ? chunk->size() : 0,
+            !chunk, [&packed](char const* data, std::size_t length) {
+              packed->insert(packed->end(), data, data + length);
+            });
+        if (packed->empty() && !listing->finished_) {
+          // Still held by the compressor, nothing to write yet
+          me->readListingAndSend(dataSocketPtr, listing);
+          return;
+        }
+        if (listing->finished_) {
+          // The compressed tail goes out before the end of transmission
+          Metrics::instance().bytesSent(Metrics::DataPath::LISTING,
+                                        packed->size());
+          me->addDataToBufferAndSend(dataSocketPtr, packed);
+        } else {
+          chunk = packed;
+        }
+      }
+#endif
+      if (listing->finished_) {
+        // Nullpointer indicates end of transmission
+        me->addDataToBufferAndSend(dataSocketPtr, nullptr);
+        return;
+      }
+      Metrics::instance().bytesSent(Metrics::DataPath::LISTING, chunk->size());
+      me->addDataToBufferAndSend(dataSocketPtr, chunk,
+                                 [me, dataSocketPtr, listing]() {
+                                   me->readListingAndSend(dataSocketPtr,
+                                                          listing);
+                                 });
+    });
   });
 }
 
 // FTP Commands
 // Access control commands
-FTPMsgs FTPSession::handleFTPCmdUADD(std::string const& param) {
+FTPMsgs FTPSession::handleFTPCmdUADD(std::string_view param) {
   sessionUser_ = nullptr;
   username_ = param;
   return param.empty()
@@ -463,7 +603,7 @@ FTPMsgs FTPSession::handleFTPCmdUADD(std::string const& param) {
              : FTPMsgs(FTPReplyCode::USER_NAME_OK, "Please enter new password");
 }
 
-FTPMsgs FTPSession::handleFTPCmdUSER(std::string const& param) {
+FTPMsgs FTPSession::handleFTPCmdUSER(std::string_view param) {
   sessionUser_ = nullptr;
   username_ = param;
   return param.empty()
@@ -472,41 +612,43 @@ FTPMsgs FTPSession::handleFTPCmdUSER(std::string const& param) {
              : FTPMsgs(FTPReplyCode::USER_NAME_OK, "Please enter password");
 }
 
-FTPMsgs FTPSession::handleFTPCmdNOTI(std::string const& para) {
+FTPMsgs FTPSession::handleFTPCmdNOTI(std::string_view para) {
   if (notiSocket_.is_open()) {
     notiSocket_.shutdown(net::ip::tcp::socket::shutdown_both);
     notiSocket_.close();
   }
-  uint16_t port = std::stoi(para);
+  uint16_t port = std::stoi(std::string(para));
   net::ip::tcp::endpoint notiEndpoint(cmdSocket_.local_endpoint().address(),
                                       port);
   notiSocket_.async_connect(notiEndpoint, [](std::error_code const& er) {
     if (er) {
-      std::cerr << "Connect to notification socket failed: " << er.message()
-                << std::endl;
+      FTP_LOG_ERROR("Connect to notification socket failed: " << er.message());
     } else {
-      std::cout << "Connected to notification socket" << std::endl;
+      FTP_LOG_INFO("Connected to notification socket");
     }
   });
   return FTPMsgs(FTPReplyCode::COMMAND_OK, "");
 }
 
-FTPMsgs FTPSession::handleFTPCmdPASS(std::string const& param) {
-  if (lastCmd_ == "USER") {
-    if (auto user = userDb_.getUser(username_, param); user) {
+FTPMsgs FTPSession::handleFTPCmdPASS(std::string_view param) {
+  if (lastCmd_ == cmdKey("USER")) {
+    if (auto user = userDb_.getUser(username_, std::string(param)); user) {
       sessionUser_ = user;
       ftpWorkingDir_ = user->localRootPath_;
+      bandwidth_.setRate(user->sessionBandwidth_);
       // TODO1 thong bao login chac la cho nay
       return FTPMsgs(FTPReplyCode::USER_LOGGED_IN, "Login successfully");
     } else {
       return FTPMsgs(FTPReplyCode::NOT_LOGGED_IN, "Failed to log in");
     }
-  } else if (lastCmd_ == "UADD") {
+  } else if (lastCmd_ == cmdKey("UADD")) {
     // TODO1 choose root dir
-    if (auto user = userDb_.addUser(username_, param, fs::current_path());
+    if (auto user = userDb_.addUser(username_, std::string(param),
+                                     fs::current_path());
         user) {
       sessionUser_ = user;
       ftpWorkingDir_ = user->localRootPath_;
+      bandwidth_.setRate(user->sessionBandwidth_);
       contactHandler_(shared_from_this(), true);
       return FTPMsgs(FTPReplyCode::USER_LOGGED_IN, "Sign up successfully");
     } else {
@@ -518,12 +660,12 @@ FTPMsgs FTPSession::handleFTPCmdPASS(std::string const& param) {
   }
 }
 
-FTPMsgs FTPSession::handleFTPCmdACCT(std::string const& /*param*/) {
+FTPMsgs FTPSession::handleFTPCmdACCT(std::string_view /*param*/) {
   return FTPMsgs(FTPReplyCode::SYNTAX_ERROR_UNRECOGNIZED_COMMAND,
                  "Unsupported command");
 }
 
-FTPMsgs FTPSession::handleFTPCmdCWD(std::string const& param) {
+FTPMsgs FTPSession::handleFTPCmdCWD(std::string_view param) {
   if (!sessionUser_) {
     return FTPMsgs(FTPReplyCode::NOT_LOGGED_IN, "Not logged in");
   }
@@ -533,34 +675,28 @@ FTPMsgs FTPSession::handleFTPCmdCWD(std::string const& param) {
 
   fs::path absNewWorkingDir = FTP2LocalPath(param);
   // TODO3 network drive
-  try {
-    auto status = fs::exists(absNewWorkingDir);
-  } catch (fs::filesystem_error const&) {
+  std::error_code ec;
+  if (!sessionUser_->root_.isListable(absNewWorkingDir, ec)) {
+    if (ec == std::errc::not_a_directory) {
+      return FTPMsgs(
+          FTPReplyCode::ACTION_NOT_TAKEN,
+          "Failed changing directory: The given resource is not a directory.");
+    } else if (ec == std::errc::permission_denied) {
+      return FTPMsgs(FTPReplyCode::ACTION_NOT_TAKEN,
+                     "Failed changing directory: Permission denied.");
+    }
     return FTPMsgs(FTPReplyCode::ACTION_NOT_TAKEN,
                    "Failed changing directory: The given resource does not "
                    "exist or permission denied.");
   }
 
-  if (!fs::is_directory(absNewWorkingDir)) {
-    return FTPMsgs(
-        FTPReplyCode::ACTION_NOT_TAKEN,
-        "Failed changing directory: The given resource is not a directory.");
-  }
-
-  try {
-    auto dirIt = fs::directory_iterator(absNewWorkingDir);
-  } catch (fs::filesystem_error const&) {
-    return FTPMsgs(FTPReplyCode::ACTION_NOT_TAKEN,
-                   "Failed changing directory: Permission denied.");
-  }
-
   ftpWorkingDir_ = absNewWorkingDir;
   return FTPMsgs(
       FTPReplyCode::FILE_ACTION_COMPLETED,
       "Working directory changed to " + fs::path(param).generic_string());
 }
 
-FTPMsgs FTPSession::handleFTPCmdCDUP(std::string const& /*param*/) {
+FTPMsgs FTPSession::handleFTPCmdCDUP(std::string_view /*param*/) {
   if (!sessionUser_) {
     return FTPMsgs(FTPReplyCode::NOT_LOGGED_IN, "Not logged in");
   }
@@ -577,26 +713,25 @@ FTPMsgs FTPSession::handleFTPCmdCDUP(std::string const& /*param*/) {
   }
 }
 
-FTPMsgs FTPSession::handleFTPCmdREIN(std::string const& /*param*/) {
+FTPMsgs FTPSession::handleFTPCmdREIN(std::string_view /*param*/) {
   return FTPMsgs(FTPReplyCode::COMMAND_NOT_IMPLEMENTED, "Unsupported command");
 }
 
-FTPMsgs FTPSession::handleFTPCmdQUIT(std::string const& /*param*/) {
+FTPMsgs FTPSession::handleFTPCmdQUIT(std::string_view /*param*/) {
   // TODO1 neu loggerUser khac null thi thong bao
   sessionUser_ = nullptr;
   contactHandler_(shared_from_this(), false);
-  if (thisClientUploading_) isUploading_ = false;
   return FTPMsgs(FTPReplyCode::SERVICE_CLOSING_CONTROL_CONNECTION,
                  "Connection shutting down");
 }
 
 // Transfer parameter commands
-FTPMsgs FTPSession::handleFTPCmdPORT(std::string const& /*param*/) {
+FTPMsgs FTPSession::handleFTPCmdPORT(std::string_view /*param*/) {
   return FTPMsgs(FTPReplyCode::SYNTAX_ERROR_UNRECOGNIZED_COMMAND,
                  "FTP active mode is not supported by this server");
 }
 
-FTPMsgs FTPSession::handleFTPCmdPASV(std::string const& /*param*/) {
+FTPMsgs FTPSession::handleFTPCmdPASV(std::string_view /*param*/) {
   if (!sessionUser_) {
     return FTPMsgs(FTPReplyCode::NOT_LOGGED_IN, "Not logged in");
   }
@@ -610,10 +745,27 @@ FTPMsgs FTPSession::handleFTPCmdPASV(std::string const& /*param*/) {
     dataAcceptor_.bind(endpoint);
     dataAcceptor_.listen(net::socket_base::max_listen_connections);
   } catch (std::system_error& er) {
-    std::cerr << er.what() << std::endl;
+    FTP_LOG_ERROR(er.what());
     return FTPMsgs(FTPReplyCode::SERVICE_NOT_AVAILABLE,
                    "Failed to enter passive mode.");
   }
+  // A client that never connects must not hold the data port forever
+  if (pasvTimeout_) {
+    pasvTimeout_->cancel();
+  }
+  uint64_t generation = ++pasvGeneration_;
+  std::weak_ptr<FTPSession> weak = shared_from_this();
+  pasvTimeout_ = TimingWheel::instance().start(
+      timeouts_.pasvAccept, [weak, generation]() {
+        if (session_ptr me = weak.lock()) {
+          net::post(me->msgWriteStrand_, [me, generation]() {
+            if (me->pasvGeneration_ == generation) {
+              std::error_code ec;
+              me->dataAcceptor_.close(ec);
+            }
+          });
+        }
+      });
   // Split address and port into bytes and get the port the OS chose for us
   auto ipBytes = cmdSocket_.local_endpoint().address().to_v4().to_bytes();
   auto port = dataAcceptor_.local_endpoint().port();
@@ -628,7 +780,7 @@ FTPMsgs FTPSession::handleFTPCmdPASV(std::string const& /*param*/) {
                  "Entering passive mode " + stream.str());
 }
 
-FTPMsgs FTPSession::handleFTPCmdTYPE(std::string const& param) {
+FTPMsgs FTPSession::handleFTPCmdTYPE(std::string_view param) {
   if (!sessionUser_) {
     return FTPMsgs(FTPReplyCode::NOT_LOGGED_IN, "Not logged in");
   }
@@ -647,18 +799,28 @@ FTPMsgs FTPSession::handleFTPCmdTYPE(std::string const& param) {
   }
 }
 
-FTPMsgs FTPSession::handleFTPCmdSTRU(std::string const& /*param*/) {
+FTPMsgs FTPSession::handleFTPCmdSTRU(std::string_view /*param*/) {
   return FTPMsgs(FTPReplyCode::SYNTAX_ERROR_UNRECOGNIZED_COMMAND,
                  "Unsupported command");
 }
 
-FTPMsgs FTPSession::handleFTPCmdMODE(std::string const& /*param*/) {
-  return FTPMsgs(FTPReplyCode::SYNTAX_ERROR_UNRECOGNIZED_COMMAND,
-                 "Unsupported command");
+FTPMsgs FTPSession::handleFTPCmdMODE(std::string_view param) {
+  if (param == "S" || param == "s") {
+    modeZ_ = false;
+    return FTPMsgs(FTPReplyCode::COMMAND_OK, "Mode set to S");
+  }
+#if defined(FTP_HAVE_ZLIB)
+  if (param == "Z" || param == "z") {
+    modeZ_ = true;
+    return FTPMsgs(FTPReplyCode::COMMAND_OK, "Mode set to Z");
+  }
+#endif
+  return FTPMsgs(FTPReplyCode::COMMAND_NOT_IMPLEMENTED_FOR_PARAMETER,
+                 "Unsupported transfer mode");
 }
 
 // Ftp service commands
-FTPMsgs FTPSession::handleFTPCmdRETR(std::string const& param) {
+FTPMsgs FTPSession::handleFTPCmdRETR(std::string_view param) {
   if (!sessionUser_) {
     return FTPMsgs(FTPReplyCode::NOT_LOGGED_IN, "Not logged in");
   }
@@ -669,19 +831,51 @@ FTPMsgs FTPSession::handleFTPCmdRETR(std::string const& param) {
   }
 
   fs::path localPath = FTP2LocalPath(param);
+  std::error_code ec;
+#if defined(__linux__)
+  // Binary transfers need no conversion, so let the kernel move the bytes.
+  if (dataTypeBinary_ && !modeZ_) {
+    rawFile_ptr file(std::make_shared<RawFile>(
+        sessionUser_->root_.open(localPath, O_RDONLY, 0, ec)));
+    struct stat st;
+    if (!file->good() || ::fstat(file->fd_, &st) != 0 ||
+        !S_ISREG(st.st_mode)) {
+      return FTPMsgs(FTPReplyCode::ACTION_ABORTED_LOCAL_ERROR,
+                     "Error opening file for transfer");
+    }
+    if (restOffset_ > static_cast<uintmax_t>(st.st_size)) {
+      return FTPMsgs(FTPReplyCode::ACTION_NOT_TAKEN_INVALID_REST,
+                     "Restart offset is past the end of the file");
+    }
+    file->offset_ = static_cast<off_t>(restOffset_);
+    sendFileZeroCopy(file);
+    return FTPMsgs(FTPReplyCode::FILE_STATUS_OK_OPENING_DATA_CONNECTION,
+                   "Sending file");
+  }
+#endif
+  RootDir::Status status = sessionUser_->root_.status(localPath, ec);
+  if (!ec && restOffset_ > status.size) {
+    return FTPMsgs(FTPReplyCode::ACTION_NOT_TAKEN_INVALID_REST,
+                   "Restart offset is past the end of the file");
+  }
   std::ios::openmode openMode =
       (dataTypeBinary_ ? (std::ios::in | std::ios::binary) : (std::ios::in));
-  ioFile_ptr file(std::make_shared<IoFile>(localPath, openMode));
+  ioFile_ptr file(
+      std::make_shared<IoFile>(sessionUser_->root_, localPath, openMode));
+  if (restOffset_ > 0) {
+    file->fileStream_.seekg(static_cast<std::streamoff>(restOffset_));
+  }
   if (!file->fileStream_.good()) {
     return FTPMsgs(FTPReplyCode::ACTION_ABORTED_LOCAL_ERROR,
                    "Error opening file for transfer");
   }
+  setUpModeZ(file, localPath, false);
   sendFile(file);
   return FTPMsgs(FTPReplyCode::FILE_STATUS_OK_OPENING_DATA_CONNECTION,
                  "Sending file");
 }
 
-FTPMsgs FTPSession::handleFTPCmdSTOR(std::string const& param) {
+FTPMsgs FTPSession::handleFTPCmdSTOR(std::string_view param) {
   if (!sessionUser_) {
     return FTPMsgs(FTPReplyCode::NOT_LOGGED_IN, "Not logged in");
   }
@@ -694,61 +888,112 @@ FTPMsgs FTPSession::handleFTPCmdSTOR(std::string const& param) {
                    "Error opening data connection");
   }
   fs::path localPath = FTP2LocalPath(param);
-  try {
-    if (fs::is_directory(localPath)) {
-      return FTPMsgs(
-          FTPReplyCode::ACTION_NOT_TAKEN_FILENAME_NOT_ALLOWED,
-          "Cannot create file. A directory with that name already exists.");
+  RootDir const& root = sessionUser_->root_;
+#if defined(__linux__)
+  // The lock goes with the file that was opened, whichever link led to it.
+  // Truncating waits until the lock is ours.
+  std::error_code ec;
+  rawFile_ptr file(std::make_shared<RawFile>(
+      root.open(localPath, O_RDWR | O_CREAT, 0644, ec)));
+  if (ec == std::errc::is_a_directory) {
+    return FTPMsgs(
+        FTPReplyCode::ACTION_NOT_TAKEN_FILENAME_NOT_ALLOWED,
+        "Cannot create file. A directory with that name already exists.");
+  }
+  struct stat st;
+  if (!file->good() || ::fstat(file->fd_, &st) != 0 ||
+      !S_ISREG(st.st_mode)) {
+    return FTPMsgs(FTPReplyCode::ACTION_ABORTED_LOCAL_ERROR,
+                   "Error opening file for transfer");
+  }
+  file->writeLock_ = writeLocks_.tryLock(st);
+  if (!file->writeLock_) {
+    return FTPMsgs(FTPReplyCode::FILE_ACTION_NOT_TAKEN,
+                   "Another client is uploading to this file.");
+  }
+  // Keep what was uploaded before the restart point, drop the rest. A
+  // point past the end would only pad the file with zeros.
+  if (restOffset_ > static_cast<uintmax_t>(st.st_size)) {
+    return FTPMsgs(FTPReplyCode::ACTION_NOT_TAKEN_INVALID_REST,
+                   "Restart offset is past the end of the file");
+  }
+  if (::ftruncate(file->fd_, static_cast<off_t>(restOffset_)) != 0) {
+    return FTPMsgs(FTPReplyCode::ACTION_ABORTED_LOCAL_ERROR,
+                   "Error opening file for transfer");
+  }
+  return receiveFileAt(localPath, file, restOffset_);
+#else
+  // Lock before opening, opening truncates the file
+  FTPWriteLocks::lock_ptr writeLock = writeLocks_.tryLock(localPath);
+  if (!writeLock) {
+    return FTPMsgs(FTPReplyCode::FILE_ACTION_NOT_TAKEN,
+                   "Another client is uploading to this file.");
+  }
+  if (restOffset_ > 0) {
+    // Keep what was uploaded before the restart point, drop the rest. A
+    // point past the end would only pad the file with zeros.
+    std::error_code ec;
+    RootDir::Status status = root.status(localPath, ec);
+    if (ec || status.type != fs::file_type::regular ||
+        restOffset_ > status.size) {
+      return FTPMsgs(FTPReplyCode::ACTION_NOT_TAKEN_INVALID_REST,
+                     "Restart offset is past the end of the file");
     }
-  } catch (fs::filesystem_error const&) {
-    return FTPMsgs(FTPReplyCode::ACTION_NOT_TAKEN_FILENAME_NOT_ALLOWED,
-                   "Cannot read file status.");
+    if (!root.resize(localPath, restOffset_, ec)) {
+      return FTPMsgs(FTPReplyCode::ACTION_NOT_TAKEN_INVALID_REST,
+                     "Cannot restart upload of this file");
+    }
+    return receiveFileAt(localPath, writeLock, restOffset_);
   }
 
   std::ios::openmode openMode =
       (dataTypeBinary_ ? (std::ios::out | std::ios::binary) : (std::ios::out));
-  ioFile_ptr file(std::make_shared<IoFile>(localPath, openMode));
+  ioFile_ptr file(std::make_shared<IoFile>(root, localPath, openMode));
   if (!file->fileStream_.good()) {
+    std::error_code ec;
+    if (root.status(localPath, ec).type == fs::file_type::directory) {
+      return FTPMsgs(
+          FTPReplyCode::ACTION_NOT_TAKEN_FILENAME_NOT_ALLOWED,
+          "Cannot create file. A directory with that name already exists.");
+    }
     return FTPMsgs(FTPReplyCode::ACTION_ABORTED_LOCAL_ERROR,
                    "Error opening file for transfer");
   }
-  if (isUploading_) {
-    return FTPMsgs(FTPReplyCode::ACTION_NOT_TAKEN_FILENAME_NOT_ALLOWED,
-                   "Another client is uploading.");
+  file->writeLock_ = writeLock;
+  // Text uploads may be converted on the way to the file
+  if (dataTypeBinary_) {
+    file->digest_ = std::make_unique<UploadDigest>(localPath, hashAlgorithm_);
   }
-  isUploading_ = true;
-  thisClientUploading_ = true;
+  setUpModeZ(file, localPath, true);
   receiveFile(file);
-  thisClientUploading_ = false;
-  isUploading_ = false;
 
   return FTPMsgs(FTPReplyCode::FILE_STATUS_OK_OPENING_DATA_CONNECTION,
                  "Receiving file");
+#endif
 }
 
-FTPMsgs FTPSession::handleFTPCmdSIZE(std::string const& para) {
+FTPMsgs FTPSession::handleFTPCmdSIZE(std::string_view para) {
   if (!sessionUser_) {
     return FTPMsgs(FTPReplyCode::NOT_LOGGED_IN, "Not logged in");
   }
-  if (!dataAcceptor_.is_open()) {
-    return FTPMsgs(FTPReplyCode::ERROR_OPENING_DATA_CONNECTION,
-                   "Error opening data connection");
-  }
 
-  fs::path localPath = FTP2LocalPath(para);
-  return fs::exists(localPath)
-             ? FTPMsgs(FTPReplyCode::FILE_STATUS,
-                       std::to_string(fs::file_size(localPath)))
+  std::error_code ec;
+  RootDir::Status status =
+      sessionUser_->root_.status(FTP2LocalPath(para), ec);
+  if (!ec && status.type != fs::file_type::regular) {
+    ec = std::make_error_code(std::errc::invalid_argument);
+  }
+  return !ec ? FTPMsgs(FTPReplyCode::FILE_STATUS, std::to_string(status.size))
              : FTPMsgs(FTPReplyCode::ACTION_NOT_TAKEN,
                        "Failed read file's size");
 }
 
-FTPMsgs FTPSession::handleFTPCmdSTOU(std::string const& /*param*/) {
+FTPMsgs FTPSession::handleFTPCmdSTOU(std::string_view /*param*/) {
   return FTPMsgs(FTPReplyCode::SYNTAX_ERROR_UNRECOGNIZED_COMMAND,
                  "Command not implemented");
 }
 
-FTPMsgs FTPSession::handleFTPCmdAPPE(std::string const& param) {
+FTPMsgs FTPSession::handleFTPCmdAPPE(std::string_view param) {
   if (!sessionUser_) {
     return FTPMsgs(FTPReplyCode::NOT_LOGGED_IN, "Not logged in");
   }
@@ -758,39 +1003,157 @@ FTPMsgs FTPSession::handleFTPCmdAPPE(std::string const& param) {
   }
 
   fs::path localPath = FTP2LocalPath(param);
-  try {
-    if (!fs::is_regular_file(localPath)) {
-      return FTPMsgs(FTPReplyCode::ACTION_NOT_TAKEN, "File does not exist.");
-    }
-  } catch (fs::filesystem_error const&) {
+  RootDir const& root = sessionUser_->root_;
+  std::error_code ec;
+#if defined(__linux__)
+  rawFile_ptr file(
+      std::make_shared<RawFile>(root.open(localPath, O_RDWR, 0, ec)));
+  struct stat st;
+  if (ec == std::errc::no_such_file_or_directory ||
+      ec == std::errc::is_a_directory) {
+    return FTPMsgs(FTPReplyCode::ACTION_NOT_TAKEN, "File does not exist.");
+  } else if (!file->good() || ::fstat(file->fd_, &st) != 0) {
+    return FTPMsgs(FTPReplyCode::ACTION_NOT_TAKEN, "Cannot read file status.");
+  } else if (!S_ISREG(st.st_mode)) {
+    return FTPMsgs(FTPReplyCode::ACTION_NOT_TAKEN, "File does not exist.");
+  }
+  file->writeLock_ = writeLocks_.tryLock(st);
+  if (!file->writeLock_) {
+    return FTPMsgs(FTPReplyCode::FILE_ACTION_NOT_TAKEN,
+                   "Another client is uploading to this file.");
+  }
+  // Sized again under the lock, an upload that held it until now may have
+  // grown the file since
+  if (::fstat(file->fd_, &st) != 0) {
+    return FTPMsgs(FTPReplyCode::ACTION_NOT_TAKEN, "Cannot read file status.");
+  } else if (restOffset_ > static_cast<uintmax_t>(st.st_size)) {
+    return FTPMsgs(FTPReplyCode::ACTION_NOT_TAKEN_INVALID_REST,
+                   "Restart offset is past the end of the file");
+  }
+  // With REST, APPE resumes like STOR does; without, it writes at the end
+  uint64_t offset = restOffset_ > 0 ? restOffset_ : st.st_size;
+  if (restOffset_ > 0 &&
+      ::ftruncate(file->fd_, static_cast<off_t>(offset)) != 0) {
+    return FTPMsgs(FTPReplyCode::ACTION_ABORTED_LOCAL_ERROR,
+                   "Error opening file for transfer");
+  }
+  return receiveFileAt(localPath, file, offset);
+#else
+  RootDir::Status status = root.status(localPath, ec);
+  if (ec && ec != std::errc::no_such_file_or_directory) {
+    return FTPMsgs(FTPReplyCode::ACTION_NOT_TAKEN, "Cannot read file status.");
+  } else if (status.type != fs::file_type::regular) {
+    return FTPMsgs(FTPReplyCode::ACTION_NOT_TAKEN, "File does not exist.");
+  }
+  FTPWriteLocks::lock_ptr writeLock = writeLocks_.tryLock(localPath);
+  if (!writeLock) {
+    return FTPMsgs(FTPReplyCode::FILE_ACTION_NOT_TAKEN,
+                   "Another client is uploading to this file.");
+  }
+  // Sized again under the lock, an upload that held it until now may have
+  // grown the file since
+  status = root.status(localPath, ec);
+  if (ec || status.type != fs::file_type::regular) {
     return FTPMsgs(FTPReplyCode::ACTION_NOT_TAKEN, "Cannot read file status.");
+  } else if (restOffset_ > status.size) {
+    return FTPMsgs(FTPReplyCode::ACTION_NOT_TAKEN_INVALID_REST,
+                   "Restart offset is past the end of the file");
   }
+  // With REST, APPE resumes like STOR does; without, it writes at the end
+  uint64_t offset = restOffset_ > 0 ? restOffset_ : status.size;
+  if (restOffset_ > 0 && !root.resize(localPath, offset, ec)) {
+    return FTPMsgs(FTPReplyCode::ACTION_ABORTED_LOCAL_ERROR,
+                   "Error opening file for transfer");
+  }
+  return receiveFileAt(localPath, writeLock, offset);
+#endif
+}
 
+#if defined(__linux__)
+FTPMsgs FTPSession::receiveFileAt(fs::path const& localPath,
+                                  rawFile_ptr const& file, uint64_t offset) {
+  if (dataTypeBinary_ && !modeZ_) {
+    // splice() refuses O_APPEND descriptors, so position the file instead
+    file->offset_ = static_cast<off_t>(offset);
+    if (::lseek(file->fd_, file->offset_, SEEK_SET) >= 0 &&
+        file->openPipe()) {
+      // Not digesting the upload only costs a read of the file later
+      if (offset == 0 && file->openTeePipe()) {
+        file->digest_ =
+            std::make_unique<UploadDigest>(localPath, hashAlgorithm_);
+      }
+      receiveFileZeroCopy(file);
+      return FTPMsgs(FTPReplyCode::FILE_STATUS_OK_OPENING_DATA_CONNECTION,
+                     "Receiving file");
+    }
+  }
   std::ios::openmode openMode =
-      (dataTypeBinary_ ? (std::ios::out | std::ios::app | std::ios::binary)
-                       : (std::ios::out | std::ios::app));
-  ioFile_ptr file(std::make_shared<IoFile>(localPath, openMode));
-
+      (dataTypeBinary_ ? (std::ios::in | std::ios::out | std::ios::binary)
+                       : (std::ios::in | std::ios::out));
+  ioFile_ptr ioFile(
+      std::make_shared<IoFile>(std::exchange(file->fd_, -1), openMode));
+  ioFile->fileStream_.seekp(static_cast<std::streamoff>(offset));
+  if (!ioFile->fileStream_.good()) {
+    return FTPMsgs(FTPReplyCode::ACTION_ABORTED_LOCAL_ERROR,
+                   "Error opening file for transfer");
+  }
+  ioFile->writeLock_ = file->writeLock_;
+  // Text uploads may be converted on the way to the file
+  if (offset == 0 && dataTypeBinary_) {
+    ioFile->digest_ = std::make_unique<UploadDigest>(localPath, hashAlgorithm_);
+  }
+  setUpModeZ(ioFile, localPath, true);
+  receiveFile(ioFile);
+  return FTPMsgs(FTPReplyCode::FILE_STATUS_OK_OPENING_DATA_CONNECTION,
+                 "Receiving file");
+}
+#else
+FTPMsgs FTPSession::receiveFileAt(fs::path const& localPath,
+                                  FTPWriteLocks::lock_ptr const& writeLock,
+                                  uint64_t offset) {
+  std::ios::openmode openMode =
+      (dataTypeBinary_ ? (std::ios::in | std::ios::out | std::ios::binary)
+                       : (std::ios::in | std::ios::out));
+  ioFile_ptr file(
+      std::make_shared<IoFile>(sessionUser_->root_, localPath, openMode));
+  file->fileStream_.seekp(static_cast<std::streamoff>(offset));
   if (!file->fileStream_.good()) {
     return FTPMsgs(FTPReplyCode::ACTION_ABORTED_LOCAL_ERROR,
                    "Error opening file for transfer");
   }
+  file->writeLock_ = writeLock;
+  setUpModeZ(file, localPath, true);
   receiveFile(file);
   return FTPMsgs(FTPReplyCode::FILE_STATUS_OK_OPENING_DATA_CONNECTION,
                  "Receiving file");
 }
+#endif
 
-FTPMsgs FTPSession::handleFTPCmdALLO(std::string const& /*param*/) {
+FTPMsgs FTPSession::handleFTPCmdALLO(std::string_view /*param*/) {
   return FTPMsgs(FTPReplyCode::SYNTAX_ERROR_UNRECOGNIZED_COMMAND,
                  "Command not implemented");
 }
 
-FTPMsgs FTPSession::handleFTPCmdREST(std::string const& /*param*/) {
-  return FTPMsgs(FTPReplyCode::COMMAND_NOT_IMPLEMENTED,
-                 "Command not implemented");
+FTPMsgs FTPSession::handleFTPCmdREST(std::string_view param) {
+  if (!sessionUser_) {
+    return FTPMsgs(FTPReplyCode::NOT_LOGGED_IN, "Not logged in");
+  }
+  // Only STREAM mode is supported, where the marker is a byte offset
+  uint64_t offset = 0;
+  auto [end, errc] =
+      std::from_chars(param.data(), param.data() + param.size(), offset);
+  if (param.empty() || errc != std::errc() ||
+      end != param.data() + param.size()) {
+    return FTPMsgs(FTPReplyCode::SYNTAX_ERROR_PARAMETERS,
+                   "Invalid restart offset");
+  }
+  restOffset_ = offset;
+  return FTPMsgs(FTPReplyCode::FILE_ACTION_NEEDS_FURTHER_INFO,
+                 "Restarting at " + std::to_string(offset) +
+                     ". Send STOR or RETR to resume transfer");
 }
 
-FTPMsgs FTPSession::handleFTPCmdRNFR(std::string const& param) {
+FTPMsgs FTPSession::handleFTPCmdRNFR(std::string_view param) {
   if (FTPMsgs isRenamableErr = checkPathRenamable(param);
       isRenamableErr.replyCode() == FTPReplyCode::COMMAND_OK) {
     renameSrcPath_ = param;
@@ -801,11 +1164,11 @@ FTPMsgs FTPSession::handleFTPCmdRNFR(std::string const& param) {
   }
 }
 
-FTPMsgs FTPSession::handleFTPCmdRNTO(std::string const& param) {
+FTPMsgs FTPSession::handleFTPCmdRNTO(std::string_view param) {
   if (!sessionUser_) {
     return FTPMsgs(FTPReplyCode::NOT_LOGGED_IN, "Not logged in");
   }
-  if (lastCmd_ != "RNFR" || renameSrcPath_.empty()) {
+  if (lastCmd_ != cmdKey("RNFR") || renameSrcPath_.empty()) {
     return FTPMsgs(FTPReplyCode::COMMANDS_BAD_SEQUENCE,
                    "Please specify target file first");
   }
@@ -823,74 +1186,75 @@ FTPMsgs FTPSession::handleFTPCmdRNTO(std::string const& param) {
       isRenamableErr.replyCode() == FTPReplyCode::COMMAND_OK) {
     fs::path localSrcPath = FTP2LocalPath(renameSrcPath_),
              localDstPath = FTP2LocalPath(param);
-    // Check if the source file exists already. We simple disallow overwriting
-    // a file be renaming (the bahavior of the native rename command on
-    // Windows and Linux differs; Windows will not overwrite files, Linux
-    // will).
-    if (fs::exists(localDstPath)) {
-      return FTPMsgs(FTPReplyCode::FILE_ACTION_NOT_TAKEN,
-                     "Target path exists already.");
-    }
-
+    // We simply disallow overwriting a file by renaming (the behavior of the
+    // native rename command on Windows and Linux differs; Windows will not
+    // overwrite files, Linux will).
     std::error_code ec;
-    // TODO2 catch????
-    fs::rename(localSrcPath, localDstPath, ec);
-    return ec ? FTPMsgs(FTPReplyCode::FILE_ACTION_NOT_TAKEN,
-                        "Error renaming file")
-              : FTPMsgs(FTPReplyCode::FILE_ACTION_COMPLETED, "OK");
+    if (sessionUser_->root_.rename(localSrcPath, localDstPath, ec)) {
+      return FTPMsgs(FTPReplyCode::FILE_ACTION_COMPLETED, "OK");
+    }
+    return ec == std::errc::file_exists
+               ? FTPMsgs(FTPReplyCode::FILE_ACTION_NOT_TAKEN,
+                         "Target path exists already.")
+               : FTPMsgs(FTPReplyCode::FILE_ACTION_NOT_TAKEN,
+                         "Error renaming file");
   } else {
     return isRenamableErr;
   }
 }
 
-FTPMsgs FTPSession::handleFTPCmdABOR(std::string const& /*param*/) {
+FTPMsgs FTPSession::handleFTPCmdABOR(std::string_view /*param*/) {
   return FTPMsgs(FTPReplyCode::COMMAND_NOT_IMPLEMENTED,
                  "Command not implemented");
 }
 
-FTPMsgs FTPSession::handleFTPCmdDELE(std::string const& param) {
+FTPMsgs FTPSession::handleFTPCmdDELE(std::string_view param) {
   if (!sessionUser_) {
     return FTPMsgs(FTPReplyCode::NOT_LOGGED_IN, "Not logged in");
   }
 
-  fs::path localPath = FTP2LocalPath(param);
-  if (!fs::exists(localPath)) {
+  std::error_code ec;
+  if (sessionUser_->root_.remove(FTP2LocalPath(param), false, ec)) {
+    return FTPMsgs(FTPReplyCode::FILE_ACTION_COMPLETED,
+                   "Successfully deleted file");
+  } else if (ec == std::errc::no_such_file_or_directory) {
     return FTPMsgs(FTPReplyCode::ACTION_NOT_TAKEN, "Resource does not exist");
-  } else if (!fs::is_regular_file(localPath)) {
+  } else if (ec == std::errc::is_a_directory) {
     return FTPMsgs(FTPReplyCode::ACTION_NOT_TAKEN, "Resource is not a file");
   } else {
-    return fs::remove(localPath) ? FTPMsgs(FTPReplyCode::FILE_ACTION_COMPLETED,
-                                           "Successfully deleted file")
-                                 : FTPMsgs(FTPReplyCode::FILE_ACTION_NOT_TAKEN,
-                                           "Unable to delete file");
+    return FTPMsgs(FTPReplyCode::FILE_ACTION_NOT_TAKEN,
+                   "Unable to delete file");
   }
 }
 
-FTPMsgs FTPSession::handleFTPCmdRMD(std::string const& param) {
+FTPMsgs FTPSession::handleFTPCmdRMD(std::string_view param) {
   if (!sessionUser_) {
     return FTPMsgs(FTPReplyCode::NOT_LOGGED_IN, "Not logged in");
   }
-  fs::path localPath = FTP2LocalPath(param);
-  return fs::remove_all(localPath)
+  // RMD has always removed plain files too, and the bundled clients rely
+  // on it
+  std::error_code ec;
+  return sessionUser_->root_.remove(FTP2LocalPath(param), true, ec)
              ? FTPMsgs(FTPReplyCode::FILE_ACTION_COMPLETED,
                        "Successfully removed directory")
              : FTPMsgs(FTPReplyCode::ACTION_NOT_TAKEN,
                        "Unable to remove directory");
 }
 
-FTPMsgs FTPSession::handleFTPCmdMKD(std::string const& param) {
+FTPMsgs FTPSession::handleFTPCmdMKD(std::string_view param) {
   if (!sessionUser_) {
     return FTPMsgs(FTPReplyCode::NOT_LOGGED_IN, "Not logged in");
   }
   fs::path localPath = FTP2LocalPath(param);
-  return fs::create_directory(localPath)
+  std::error_code ec;
+  return sessionUser_->root_.createDirectory(localPath, ec)
              ? FTPMsgs(FTPReplyCode::PATHNAME_CREATED,
                        "Successfully created directory " + localPath.string())
              : FTPMsgs(FTPReplyCode::ACTION_NOT_TAKEN,
                        "Unable to create directory");
 }
 
-FTPMsgs FTPSession::handleFTPCmdPWD(std::string const& /*param*/) {
+FTPMsgs FTPSession::handleFTPCmdPWD(std::string_view /*param*/) {
   // RFC 959 does not allow returning NOT_LOGGED_IN here, so we abuse
   // ACTION_NOT_TAKEN for that.
   if (!sessionUser_) {
@@ -900,66 +1264,58 @@ FTPMsgs FTPSession::handleFTPCmdPWD(std::string const& /*param*/) {
   return FTPMsgs(FTPReplyCode::PATHNAME_CREATED, Local2FTPPath(ftpWorkingDir_));
 }
 
-FTPMsgs FTPSession::handleFTPCmdLIST(std::string const& param) {
+FTPMsgs FTPSession::handleFTPCmdLIST(std::string_view param) {
   if (!sessionUser_) {
     return FTPMsgs(FTPReplyCode::NOT_LOGGED_IN, "Not logged in");
   }
 
   fs::path localPath = FTP2LocalPath(param);
-  try {
-    if (fs::exists(localPath)) {
-      if (fs::is_directory(localPath)) {
-        sendDirListing(dirContent(localPath));
-        return FTPMsgs(FTPReplyCode::FILE_STATUS_OK_OPENING_DATA_CONNECTION,
-                       "Sending directory list");
-      } else {
-        // TODO3: RFC959: If the pathname specifies a file then the server
-        // should send current information on the file.
-        return FTPMsgs(FTPReplyCode::FILE_ACTION_NOT_TAKEN,
-                       "Path is not a directory");
-      }
-    } else {
-      return FTPMsgs(FTPReplyCode::FILE_ACTION_NOT_TAKEN,
-                     "Path does not exist");
-    }
-  } catch (fs::filesystem_error const&) {
+  std::error_code ec;
+  if (listing_source dir = openListing(localPath, true, ec)) {
+    sendListing(dir, DirListingCache::Format::LIST, readDirListing);
+    return FTPMsgs(FTPReplyCode::FILE_STATUS_OK_OPENING_DATA_CONNECTION,
+                   "Sending directory list");
+  } else if (ec == std::errc::not_a_directory) {
+    // TODO3: RFC959: If the pathname specifies a file then the server
+    // should send current information on the file.
+    return FTPMsgs(FTPReplyCode::FILE_ACTION_NOT_TAKEN,
+                   "Path is not a directory");
+  } else if (ec == std::errc::permission_denied) {
     return FTPMsgs(FTPReplyCode::FILE_ACTION_NOT_TAKEN, "Permission denied");
+  } else {
+    return FTPMsgs(FTPReplyCode::FILE_ACTION_NOT_TAKEN, "Path does not exist");
   }
 }
 
-FTPMsgs FTPSession::handleFTPCmdNLST(std::string const& param) {
+FTPMsgs FTPSession::handleFTPCmdNLST(std::string_view param) {
   if (!sessionUser_) {
     return FTPMsgs(FTPReplyCode::NOT_LOGGED_IN, "Not logged in");
   }
 
   fs::path localPath = FTP2LocalPath(param);
-  try {
-    if (fs::exists(localPath)) {
-      if (fs::is_directory(localPath)) {
-        sendNameList(dirContent(localPath));
-        return FTPMsgs(FTPReplyCode::FILE_STATUS_OK_OPENING_DATA_CONNECTION,
-                       "Sending name list");
-      } else {
-        // TODO3: RFC959: If the pathname specifies a file then the server
-        // should send current information on the file.
-        return FTPMsgs(FTPReplyCode::FILE_ACTION_NOT_TAKEN,
-                       "Path is not a directory");
-      }
-    } else {
-      return FTPMsgs(FTPReplyCode::FILE_ACTION_NOT_TAKEN,
-                     "Path does not exist");
-    }
-  } catch (fs::filesystem_error const&) {
+  std::error_code ec;
+  if (listing_source dir = openListing(localPath, true, ec)) {
+    sendListing(dir, DirListingCache::Format::NLST, readNameList);
+    return FTPMsgs(FTPReplyCode::FILE_STATUS_OK_OPENING_DATA_CONNECTION,
+                   "Sending name list");
+  } else if (ec == std::errc::not_a_directory) {
+    // TODO3: RFC959: If the pathname specifies a file then the server
+    // should send current information on the file.
+    return FTPMsgs(FTPReplyCode::FILE_ACTION_NOT_TAKEN,
+                   "Path is not a directory");
+  } else if (ec == std::errc::permission_denied) {
     return FTPMsgs(FTPReplyCode::FILE_ACTION_NOT_TAKEN, "Permission denied");
+  } else {
+    return FTPMsgs(FTPReplyCode::FILE_ACTION_NOT_TAKEN, "Path does not exist");
   }
 }
 
-FTPMsgs FTPSession::handleFTPCmdSITE(std::string const& /*param*/) {
+FTPMsgs FTPSession::handleFTPCmdSITE(std::string_view /*param*/) {
   return FTPMsgs(FTPReplyCode::SYNTAX_ERROR_UNRECOGNIZED_COMMAND,
                  "Command not implemented");
 }
 
-FTPMsgs FTPSession::handleFTPCmdSYST(std::string const& /*param*/) {
+FTPMsgs FTPSession::handleFTPCmdSYST(std::string_view /*param*/) {
 #if defined _WIN32 || defined _WIN64
   return FTPMsgs(FTPReplyCode::NAME_SYSTEM_TYPE, "WIN32");
 #elif defined __ANDROID__
@@ -979,20 +1335,331 @@ FTPMsgs FTPSession::handleFTPCmdSYST(std::string const& /*param*/) {
 #endif
 }
 
-FTPMsgs FTPSession::handleFTPCmdSTAT(std::string const& /*param*/) {
-  return FTPMsgs(FTPReplyCode::COMMAND_NOT_IMPLEMENTED,
-                 "Command not implemented");
+FTPMsgs FTPSession::handleFTPCmdSTAT(std::string_view param) {
+  if (!sessionUser_) {
+    return FTPMsgs(FTPReplyCode::NOT_LOGGED_IN, "Not logged in");
+  }
+  if (!param.empty()) {
+    // Status of a file or of the current transfer is not supported
+    return FTPMsgs(FTPReplyCode::COMMAND_NOT_IMPLEMENTED_FOR_PARAMETER,
+                   "Only server status is available");
+  }
+  return FTPMsgs(FTPReplyCode::REPLY_SYSTEM_STATUS, "Server status:",
+                 Metrics::instance().statusReport());
 }
 
-FTPMsgs FTPSession::handleFTPCmdHELP(std::string const& /*param*/) {
+FTPMsgs FTPSession::handleFTPCmdHELP(std::string_view /*param*/) {
   return FTPMsgs(FTPReplyCode::COMMAND_NOT_IMPLEMENTED,
                  "Command not implemented");
 }
 
-FTPMsgs FTPSession::handleFTPCmdNOOP(std::string const& /*param*/) {
+FTPMsgs FTPSession::handleFTPCmdNOOP(std::string_view /*param*/) {
   return FTPMsgs(FTPReplyCode::COMMAND_OK, "OK");
 }
 
+FTPMsgs FTPSession::handleFTPCmdFEAT(std::string_view /*param*/) {
+  // The algorithm HASH currently uses is marked with a '*'
+  std::string hashFeature = " HASH ";
+  for (std::size_t i = 0; i < kNbHashAlgorithms; ++i) {
+    HashAlgorithm algorithm = static_cast<HashAlgorithm>(i);
+    hashFeature += hashAlgorithmName(algorithm);
+    hashFeature += algorithm == hashAlgorithm_ ? "*;" : ";";
+  }
+  hashFeature.back() = '\r';
+  hashFeature += '\n';
+  return FTPMsgs(FTPReplyCode::REPLY_SYSTEM_STATUS, "Features:",
+                 hashFeature +
+#if defined(FTP_HAVE_ZLIB)
+                     " MODE Z\r\n"
+#endif
+                     " MLST type*;size*;modify*;unique*;\r\n"
+                     " REST STREAM\r\n"
+                     " SIZE\r\n"
+                     " XCRC\r\n"
+                     " XMD5\r\n"
+                     " XSHA1\r\n"
+                     " XSHA256\r\n");
+}
+
+FTPMsgs FTPSession::handleFTPCmdOPTS(std::string_view param) {
+  // Known options are "HASH [<algorithm>]" and "MODE Z LEVEL <0-9>"
+  std::string option(param);
+  std::transform(option.begin(), option.end(), option.begin(),
+                 [](unsigned char c) { return std::toupper(c); });
+  if (option == "HASH") {
+    return FTPMsgs(FTPReplyCode::COMMAND_OK,
+                   std::string(hashAlgorithmName(hashAlgorithm_)));
+  }
+  if (option.compare(0, 5, "HASH ") == 0) {
+    std::optional<HashAlgorithm> algorithm =
+        parseHashAlgorithm(param.substr(5));
+    if (!algorithm) {
+      return FTPMsgs(FTPReplyCode::SYNTAX_ERROR_PARAMETERS,
+                     "Unknown algorithm");
+    }
+    hashAlgorithm_ = *algorithm;
+    return FTPMsgs(FTPReplyCode::COMMAND_OK,
+                   std::string(hashAlgorithmName(hashAlgorithm_)));
+  }
+  std::string_view prefix = "MODE Z LEVEL ";
+  if (option.compare(0, prefix.size(), prefix) != 0) {
+    return FTPMsgs(FTPReplyCode::SYNTAX_ERROR_PARAMETERS,
+                   "Option not understood");
+  }
+  std::string_view level = param.substr(prefix.size());
+  if (level.size() != 1 || level[0] < '0' || level[0] > '9') {
+    return FTPMsgs(FTPReplyCode::SYNTAX_ERROR_PARAMETERS,
+                   "Level must be between 0 and 9");
+  }
+  modeZLevel_ = level[0] - '0';
+  return FTPMsgs(FTPReplyCode::COMMAND_OK,
+                 "MODE Z level set to " + std::string(level));
+}
+
+FTPMsgs FTPSession::handleFTPCmdMLST(std::string_view param) {
+  if (!sessionUser_) {
+    return FTPMsgs(FTPReplyCode::NOT_LOGGED_IN, "Not logged in");
+  }
+  fs::path localPath = FTP2LocalPath(param);
+  std::error_code ec;
+  listing_source file = openListing(localPath, false, ec);
+  std::string facts = file ? renderMachineEntry(*file) : std::string();
+  if (facts.empty()) {
+    return FTPMsgs(FTPReplyCode::ACTION_NOT_TAKEN, "Path does not exist");
+  }
+  std::string ftpPath = Local2FTPPath(localPath);
+  return FTPMsgs(FTPReplyCode::FILE_ACTION_COMPLETED, "Listing " + ftpPath,
+                 " " + facts + ftpPath + "\r\n");
+}
+
+FTPMsgs FTPSession::handleFTPCmdMLSD(std::string_view param) {
+  if (!sessionUser_) {
+    return FTPMsgs(FTPReplyCode::NOT_LOGGED_IN, "Not logged in");
+  }
+  fs::path localPath = FTP2LocalPath(param);
+  std::error_code ec;
+  listing_source dir = openListing(localPath, true, ec);
+  if (!dir) {
+    // RFC 3659 wants 501 when the path is not a directory
+    return ec != std::errc::not_a_directory
+               ? FTPMsgs(FTPReplyCode::ACTION_NOT_TAKEN, "Path does not exist")
+               : FTPMsgs(FTPReplyCode::SYNTAX_ERROR_PARAMETERS,
+                         "Path is not a directory");
+  }
+  sendListing(dir, DirListingCache::Format::MLSD, readMachineListing);
+  return FTPMsgs(FTPReplyCode::FILE_STATUS_OK_OPENING_DATA_CONNECTION,
+                 "Sending machine list");
+}
+
+// "<first> <last>" as sent with RANG and the X digest commands
+static bool parseByteRange(std::string_view range, uint64_t& first,
+                           uint64_t& last) {
+  std::size_t space = range.find(' ');
+  if (space == std::string_view::npos) {
+    return false;
+  }
+  for (auto [number, value] :
+       {std::pair(range.substr(0, space), &first),
+        std::pair(range.substr(space + 1), &last)}) {
+    auto [end, errc] =
+        std::from_chars(number.data(), number.data() + number.size(), *value);
+    if (number.empty() || errc != std::errc() ||
+        end != number.data() + number.size()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+FTPMsgs FTPSession::handleFTPCmdHASH(std::string_view param) {
+  return digestReply(param, hashAlgorithm_, rangeFirst_, rangeLast_, true);
+}
+
+FTPMsgs FTPSession::handleFTPCmdRANG(std::string_view param) {
+  if (!sessionUser_) {
+    return FTPMsgs(FTPReplyCode::NOT_LOGGED_IN, "Not logged in");
+  }
+  uint64_t first = 0;
+  uint64_t last = 0;
+  if (!parseByteRange(param, first, last)) {
+    return FTPMsgs(FTPReplyCode::SYNTAX_ERROR_PARAMETERS, "Invalid range");
+  }
+  if (first == 1 && last == 0) {
+    return FTPMsgs(FTPReplyCode::FILE_ACTION_NEEDS_FURTHER_INFO,
+                   "Range reset");
+  }
+  if (first > last) {
+    return FTPMsgs(FTPReplyCode::SYNTAX_ERROR_PARAMETERS, "Invalid range");
+  }
+  // Only good for the next command, handleFTPCmd resets it afterwards
+  rangeFirst_ = first;
+  rangeLast_ = last;
+  return FTPMsgs(FTPReplyCode::FILE_ACTION_NEEDS_FURTHER_INFO,
+                 "Restarting at " + std::to_string(first) +
+                     ". Ending byte at " + std::to_string(last) + ".");
+}
+
+FTPMsgs FTPSession::handleFTPCmdXCRC(std::string_view param) {
+  return handleXDigestCmd(param, HashAlgorithm::CRC32);
+}
+
+FTPMsgs FTPSession::handleFTPCmdXMD5(std::string_view param) {
+  return handleXDigestCmd(param, HashAlgorithm::MD5);
+}
+
+FTPMsgs FTPSession::handleFTPCmdXSHA1(std::string_view param) {
+  return handleXDigestCmd(param, HashAlgorithm::SHA1);
+}
+
+FTPMsgs FTPSession::handleFTPCmdXSHA256(std::string_view param) {
+  return handleXDigestCmd(param, HashAlgorithm::SHA256);
+}
+
+FTPMsgs FTPSession::handleXDigestCmd(std::string_view para,
+                                     HashAlgorithm algorithm) {
+  // <path> [<first> <last>], where a path with spaces may be quoted
+  std::string_view path = para;
+  uint64_t first = 0;
+  uint64_t last = kToEndOfFile;
+  if (!para.empty() && para.front() == '"') {
+    std::size_t quote = para.find('"', 1);
+    if (quote == std::string_view::npos) {
+      return FTPMsgs(FTPReplyCode::SYNTAX_ERROR_PARAMETERS,
+                     "Missing closing quote");
+    }
+    path = para.substr(1, quote - 1);
+    std::string_view range = para.substr(quote + 1);
+    if (!range.empty() &&
+        (range.front() != ' ' ||
+         !parseByteRange(range.substr(1), first, last))) {
+      return FTPMsgs(FTPReplyCode::SYNTAX_ERROR_PARAMETERS, "Invalid range");
+    }
+  } else if (std::size_t lastSpace = para.rfind(' ');
+             lastSpace != std::string_view::npos && lastSpace > 0) {
+    // Unquoted paths only end with a range when both numbers parse
+    std::size_t firstSpace = para.rfind(' ', lastSpace - 1);
+    if (firstSpace != std::string_view::npos && firstSpace > 0 &&
+        parseByteRange(para.substr(firstSpace + 1), first, last)) {
+      path = para.substr(0, firstSpace);
+    } else {
+      first = 0;
+      last = kToEndOfFile;
+    }
+  }
+  if (first > last) {
+    return FTPMsgs(FTPReplyCode::SYNTAX_ERROR_PARAMETERS, "Invalid range");
+  }
+  return digestReply(path, algorithm, first, last, false);
+}
+
+FTPMsgs FTPSession::digestReply(std::string_view ftpPath,
+                                HashAlgorithm algorithm, uint64_t first,
+                                uint64_t last, bool hashReply) {
+  if (!sessionUser_) {
+    return FTPMsgs(FTPReplyCode::NOT_LOGGED_IN, "Not logged in");
+  }
+  fs::path localPath = FTP2LocalPath(ftpPath);
+  std::error_code ec;
+#if defined(__linux__)
+  // Hashed from the file that was opened, not from whatever the path leads
+  // to by the time it is read
+  rawFile_ptr file(std::make_shared<RawFile>(
+      sessionUser_->root_.open(localPath, O_RDONLY, 0, ec)));
+  std::optional<DigestCache::FileStamp> stamp =
+      file->good() ? DigestCache::stamp(file->fd_) : std::nullopt;
+#else
+  sessionUser_->root_.status(localPath, ec);
+  std::optional<DigestCache::FileStamp> stamp =
+      ec ? std::nullopt : DigestCache::stamp(localPath);
+#endif
+  if (!stamp) {
+    return FTPMsgs(FTPReplyCode::ACTION_NOT_TAKEN, "File not found");
+  }
+  // A last byte past the end of the file means up to the end of the file,
+  // which also suits clients sending an exclusive end
+  uint64_t end = last >= stamp->size ? stamp->size : last + 1;
+  if (first > end || (first == end && first != 0)) {
+    return FTPMsgs(FTPReplyCode::SYNTAX_ERROR_PARAMETERS,
+                   "Invalid byte range");
+  }
+  auto reply = [hashReply, algorithm, first, end,
+                ftpFile = Local2FTPPath(localPath)](std::string const& digest) {
+    if (!hashReply) {
+      return FTPMsgs(FTPReplyCode::FILE_ACTION_COMPLETED, digest);
+    }
+    return FTPMsgs(FTPReplyCode::FILE_STATUS,
+                   std::string(hashAlgorithmName(algorithm)) + " " +
+                       std::to_string(first) + "-" +
+                       std::to_string(end ? end - 1 : 0) + " " + digest +
+                       " " + ftpFile);
+  };
+  bool wholeFile = first == 0 && end == stamp->size;
+  DigestCache& cache = DigestCache::instance();
+  if (wholeFile) {
+    if (std::optional<std::string> digest =
+            cache.find(localPath, *stamp, algorithm)) {
+      return reply(*digest);
+    }
+  }
+#if defined(__linux__)
+  // A large file takes a while, which the other transfers and sessions of
+  // this thread should not have to wait for
+  unsigned weight = sessionUser_->transferWeight_.load();
+  std::size_t turnBytes =
+      TransferScheduler::kQuantum *
+      std::clamp(weight, 1u, TransferScheduler::kMaxWeight);
+  hashInTurns(
+      std::make_shared<FileHasher>(file->fd_, algorithm, first, end - first),
+      turnBytes,
+      [me = shared_from_this(), file, localPath, stamp, wholeFile, algorithm,
+       reply](std::optional<std::string> const& digest) {
+        if (!digest) {
+          me->sendDeferredReply(FTPMsgs(
+              FTPReplyCode::ACTION_ABORTED_LOCAL_ERROR, "Error reading file"));
+          return;
+        }
+        // Not cached if the file was written to while it was read
+        if (wholeFile && DigestCache::stamp(file->fd_) == stamp) {
+          DigestCache::instance().store(localPath, *stamp, algorithm,
+                                        *digest);
+        }
+        me->sendDeferredReply(reply(*digest));
+      });
+  return deferReply();
+#else
+  std::optional<std::string> digest =
+      hashFile(localPath, algorithm, first, end - first);
+  if (!digest) {
+    return FTPMsgs(FTPReplyCode::ACTION_ABORTED_LOCAL_ERROR,
+                   "Error reading file");
+  }
+  // Not cached if the file was written to while it was read
+  if (wholeFile && DigestCache::stamp(localPath) == stamp) {
+    cache.store(localPath, *stamp, algorithm, *digest);
+  }
+  return reply(*digest);
+#endif
+}
+
+#if defined(__linux__)
+void FTPSession::hashInTurns(
+    std::shared_ptr<FileHasher> const& hasher, std::size_t turnBytes,
+    std::function<void(std::optional<std::string> const&)> const& done) {
+  TransferScheduler::of(context_).schedule(
+      [me = shared_from_this(), hasher, turnBytes, done]() {
+        // Hashing is activity too, the client is waiting for its reply
+        if (me->idleTimeout_) {
+          me->idleTimeout_->restart();
+        }
+        if (hasher->step(turnBytes)) {
+          me->hashInTurns(hasher, turnBytes, done);
+          return;
+        }
+        done(hasher->finish());
+      });
+}
+#endif
+
 void FTPSession::sendFile(ioFile_ptr const& file) {
   dataAcceptor_.async_accept(
       [me = shared_from_this(), file](std::error_code const& ec,
@@ -1002,8 +1669,7 @@ void FTPSession::sendFile(ioFile_ptr const& file) {
               FTPMsgs(FTPReplyCode::TRANSFER_ABORTED, "Data transfer aborted"));
           return;
         }
-        socket_ptr dataSocketPtr(
-            std::make_shared<net::ip::tcp::socket>(std::move(peer)));
+        socket_ptr dataSocketPtr(me->openDataSocket(std::move(peer)));
         // Start sending multiple buffers at once
         me->readFileDataAndSend(dataSocketPtr, file);
         me->readFileDataAndSend(dataSocketPtr, file);
@@ -1017,9 +1683,26 @@ void FTPSession::readFileDataAndSend(socket_ptr const& dataSocketPtr,
     if (file->fileStream_.eof()) {
       return;
     }
-    charbuf_ptr buffer(std::make_shared<std::vector<char>>(1 << 20));
+    charbuf_ptr buffer(BufferPool::instance().acquire(1 << 20));
     file->fileStream_.read(buffer->data(), buffer->size());
     buffer->resize(file->fileStream_.gcount());
+#if defined(FTP_HAVE_ZLIB)
+    if (file->zstream_) {
+      charbuf_ptr packed(BufferPool::instance().acquire(1 << 20));
+      packed->clear();
+      if (!file->zstream_->process(
+              buffer->data(), buffer->size(), file->fileStream_.eof(),
+              [&packed](char const* data, std::size_t length) {
+                packed->insert(packed->end(), data, data + length);
+              })) {
+        me->sendFTPMsg(FTPMsgs(FTPReplyCode::ACTION_ABORTED_LOCAL_ERROR,
+                               "Error compressing file"));
+        return;
+      }
+      buffer = packed;
+    }
+#endif
+    Metrics::instance().bytesSent(Metrics::DataPath::STREAM, buffer->size());
 
     if (!file->fileStream_.eof()) {
       me->addDataToBufferAndSend(dataSocketPtr, buffer,
@@ -1038,6 +1721,9 @@ void FTPSession::addDataToBufferAndSend(socket_ptr const& dataSocketPtr,
                                         std::function<void(void)> fetchMore) {
   net::post(dataBufStrand_,
             [me = shared_from_this(), dataSocketPtr, data, fetchMore]() {
+              if (dataSocketPtr->aborted_) {
+                return;
+              }
               bool writeInProgress = !me->dataBuffer_.empty();
               me->dataBuffer_.push_back(data);
               if (!writeInProgress) {
@@ -1051,21 +1737,42 @@ void FTPSession::writeDataToSocket(socket_ptr const& dataSocketPtr,
   net::post(dataBufStrand_, [me = shared_from_this(), dataSocketPtr,
                              fetchMore]() {
     if (auto data = me->dataBuffer_.front(); data) {
+      std::size_t slice = std::min(data->size() - me->dataBufferOffset_,
+                                   me->turnSize(*dataSocketPtr));
       net::async_write(
-          *dataSocketPtr, net::buffer(*data),
+          *dataSocketPtr,
+          net::buffer(data->data() + me->dataBufferOffset_, slice),
+          // Every partial write is progress, a slow client is not stalled
+          [self = me.get(), socket = dataSocketPtr.get()](
+              std::error_code const& ec, std::size_t transferred) {
+            if (transferred > 0) {
+              self->dataMoved(*socket);
+            }
+            return net::transfer_all()(ec, transferred);
+          },
           net::bind_executor(
               me->dataBufStrand_, [me, dataSocketPtr, data, fetchMore](
                                       std::error_code const& ec,
-                                      std::size_t /*bytes_to_transfer*/) {
-                me->dataBuffer_.pop_front();
+                                      std::size_t written) {
                 if (ec) {
-                  std::cerr << "Data write error: " << ec.message()
-                            << std::endl;
+                  FTP_LOG_ERROR("Data write error: " << ec.message());
+                  me->dataBuffer_.clear();
+                  me->dataBufferOffset_ = 0;
+                  me->abortTransfer(*dataSocketPtr);
                   return;
                 }
-                fetchMore();
+                auto wait = me->payBandwidth(*dataSocketPtr, written);
+                me->dataBufferOffset_ += written;
+                if (me->dataBufferOffset_ == data->size()) {
+                  me->dataBuffer_.pop_front();
+                  me->dataBufferOffset_ = 0;
+                  fetchMore();
+                }
                 if (!me->dataBuffer_.empty()) {
-                  me->writeDataToSocket(dataSocketPtr, fetchMore);
+                  me->continueTransfer(
+                      dataSocketPtr, wait, [me, dataSocketPtr, fetchMore]() {
+                        me->writeDataToSocket(dataSocketPtr, fetchMore);
+                      });
                 }
               }));
     } else {
@@ -1076,6 +1783,91 @@ void FTPSession::writeDataToSocket(socket_ptr const& dataSocketPtr,
   });
 }
 
+#if defined(__linux__)
+void FTPSession::sendFileZeroCopy(rawFile_ptr const& file) {
+  dataAcceptor_.async_accept(
+      [me = shared_from_this(), file](std::error_code const& ec,
+                                      net::ip::tcp::socket peer) {
+        if (ec) {
+          me->sendFTPMsg(
+              FTPMsgs(FTPReplyCode::TRANSFER_ABORTED, "Data transfer aborted"));
+          return;
+        }
+        socket_ptr dataSocketPtr(me->openDataSocket(std::move(peer)));
+        // sendfile() must not block the io thread, readiness is reported by
+        // the reactor through async_wait instead.
+        std::error_code nbEc;
+        dataSocketPtr->native_non_blocking(true, nbEc);
+        if (nbEc) {
+          FTP_LOG_ERROR("Unable to set data socket non-blocking: "
+                        << nbEc.message());
+          me->sendFTPMsg(
+              FTPMsgs(FTPReplyCode::TRANSFER_ABORTED, "Data transfer aborted"));
+          return;
+        }
+        me->sendFileChunks(dataSocketPtr, file);
+      });
+}
+
+void FTPSession::sendFileChunks(socket_ptr const& dataSocketPtr,
+                                rawFile_ptr const& file) {
+  // One turn moves at most the transfer's share, then the other transfers
+  // and the commands queued meanwhile go first
+  std::size_t share = turnSize(*dataSocketPtr);
+  std::size_t moved = 0;
+  while (moved < share) {
+    ssize_t sent = ::sendfile(dataSocketPtr->native_handle(), file->fd_,
+                              &file->offset_, share - moved);
+    if (sent > 0) {
+      Metrics::instance().bytesSent(Metrics::DataPath::SENDFILE,
+                                    static_cast<size_t>(sent));
+      dataMoved(*dataSocketPtr);
+      moved += static_cast<size_t>(sent);
+      continue;
+    }
+    if (sent == 0) {
+      // we got to the end of transmission
+      payBandwidth(*dataSocketPtr, moved);
+      sendFTPMsg(FTPMsgs(FTPReplyCode::CLOSING_DATA_CONNECTION, "Done"));
+      return;
+    }
+    if (errno == EINTR) {
+      continue;
+    }
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      break;
+    }
+    FTP_LOG_ERROR("Data write error: " << std::strerror(errno));
+    sendFTPMsg(
+        FTPMsgs(FTPReplyCode::TRANSFER_ABORTED, "Data transfer aborted"));
+    return;
+  }
+  auto wait = payBandwidth(*dataSocketPtr, moved);
+  if (moved == share) {
+    continueTransfer(dataSocketPtr, wait,
+                     [me = shared_from_this(), dataSocketPtr, file]() {
+                       me->sendFileChunks(dataSocketPtr, file);
+                     });
+    return;
+  }
+  // The socket is full: the next turn starts once it drains
+  continueTransfer(dataSocketPtr, wait, [me = shared_from_this(),
+                                         dataSocketPtr, file]() {
+    dataSocketPtr->async_wait(
+        net::ip::tcp::socket::wait_write,
+        [me, dataSocketPtr, file](std::error_code const& ec) {
+          if (ec) {
+            FTP_LOG_ERROR("Data write error: " << ec.message());
+            me->sendFTPMsg(FTPMsgs(FTPReplyCode::TRANSFER_ABORTED,
+                                   "Data transfer aborted"));
+            return;
+          }
+          me->sendFileChunks(dataSocketPtr, file);
+        });
+  });
+}
+#endif
+
 void FTPSession::receiveFile(ioFile_ptr const& file) {
   dataAcceptor_.async_accept(
       [me = shared_from_this(), file](std::error_code const& ec,
@@ -1085,41 +1877,211 @@ void FTPSession::receiveFile(ioFile_ptr const& file) {
               FTPMsgs(FTPReplyCode::TRANSFER_ABORTED, "Data transfer aborted"));
           return;
         }
-        socket_ptr dataSocketPtr(
-            std::make_shared<net::ip::tcp::socket>(std::move(peer)));
+        socket_ptr dataSocketPtr(me->openDataSocket(std::move(peer)));
         me->receiveDataFromSocketAndWriteToFile(dataSocketPtr, file);
       });
 }
 
 void FTPSession::receiveDataFromSocketAndWriteToFile(
     socket_ptr const& dataSocketPtr, ioFile_ptr const& file) {
-  charbuf_ptr buffer = std::make_shared<std::vector<char>>(1 << 20);
+  charbuf_ptr buffer =
+      BufferPool::instance().acquire(turnSize(*dataSocketPtr));
   net::async_read(
       *dataSocketPtr, net::buffer(*buffer),
-      net::transfer_at_least(buffer->size()),
+      // Every partial read is progress, a slow client is not stalled
+      [self = this, socket = dataSocketPtr.get(), size = buffer->size()](
+          std::error_code const& ec, std::size_t transferred) {
+        if (transferred > 0) {
+          self->dataMoved(*socket);
+        }
+        return net::transfer_at_least(size)(ec, transferred);
+      },
       [me = shared_from_this(), dataSocketPtr, buffer, file](
           std::error_code const& ec, std::size_t length) {
         buffer->resize(length);
+        Metrics::instance().bytesReceived(Metrics::DataPath::STREAM, length);
         if (ec) {
-          me->sendFTPMsg(
-              FTPMsgs(FTPReplyCode::CLOSING_DATA_CONNECTION, "Done"));
           if (length > 0) {
             me->writeDataToFile(buffer, file);
           }
+          // A stalled client is cut off, that is no end of file either
+          bool complete = ec == net::error::eof && !dataSocketPtr->stalled_;
+          // Only report completion once the pending writes are done and the
+          // file is released for other uploaders
+          net::post(me->fileRWStrand_, [me, file, complete]() {
+            file->fileStream_.close();
+            if (!complete) {
+              file->writeLock_ = nullptr;
+              me->sendFTPMsg(FTPMsgs(FTPReplyCode::TRANSFER_ABORTED,
+                                     "Data transfer aborted"));
+              return;
+            }
+#if defined(FTP_HAVE_ZLIB)
+            if (file->zstream_ && !file->zstream_->finished()) {
+              file->writeLock_ = nullptr;
+              me->sendFTPMsg(FTPMsgs(FTPReplyCode::ACTION_ABORTED_LOCAL_ERROR,
+                                     "Compressed data is incomplete"));
+              return;
+            }
+#endif
+            // Still under the write lock, nobody else can change the file
+            if (file->digest_ && !file->fileStream_.fail()) {
+#if defined(__linux__)
+              file->digest_->commit(file->fd_);
+#else
+              file->digest_->commit();
+#endif
+            }
+            file->writeLock_ = nullptr;
+            me->sendFTPMsg(
+                FTPMsgs(FTPReplyCode::CLOSING_DATA_CONNECTION, "Done"));
+          });
           return;
         } else if (length > 0) {
-          me->writeDataToFile(buffer, file, [me, dataSocketPtr, file]() {
-            me->receiveDataFromSocketAndWriteToFile(dataSocketPtr, file);
+          auto wait = me->payBandwidth(*dataSocketPtr, length);
+          me->writeDataToFile(buffer, file, [me, dataSocketPtr, file, wait]() {
+            me->continueTransfer(
+                dataSocketPtr, wait, [me, dataSocketPtr, file]() {
+                  me->receiveDataFromSocketAndWriteToFile(dataSocketPtr, file);
+                });
           });
         }
       });
 }
 
+#if defined(__linux__)
+void FTPSession::receiveFileZeroCopy(rawFile_ptr const& file) {
+  dataAcceptor_.async_accept(
+      [me = shared_from_this(), file](std::error_code const& ec,
+                                      net::ip::tcp::socket peer) {
+        if (ec) {
+          me->sendFTPMsg(
+              FTPMsgs(FTPReplyCode::TRANSFER_ABORTED, "Data transfer aborted"));
+          return;
+        }
+        socket_ptr dataSocketPtr(me->openDataSocket(std::move(peer)));
+        std::error_code nbEc;
+        dataSocketPtr->native_non_blocking(true, nbEc);
+        if (nbEc) {
+          FTP_LOG_ERROR("Unable to set data socket non-blocking: "
+                        << nbEc.message());
+          me->sendFTPMsg(
+              FTPMsgs(FTPReplyCode::TRANSFER_ABORTED, "Data transfer aborted"));
+          return;
+        }
+        me->receiveSpliceChunks(dataSocketPtr, file);
+      });
+}
+
+void FTPSession::receiveSpliceChunks(socket_ptr const& dataSocketPtr,
+                                     rawFile_ptr const& file) {
+  std::size_t share = turnSize(*dataSocketPtr);
+  std::size_t moved = 0;
+  while (moved < share) {
+    ssize_t received =
+        ::splice(dataSocketPtr->native_handle(), nullptr, file->pipe_[1],
+                 nullptr, share - moved, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (received == 0) {
+      if (dataSocketPtr->stalled_) {
+        // Shut down by the stall timeout, not closed by the client
+        file->writeLock_ = nullptr;
+        sendFTPMsg(
+            FTPMsgs(FTPReplyCode::TRANSFER_ABORTED, "Data transfer aborted"));
+        return;
+      }
+      // Client closed the data connection: upload complete
+      payBandwidth(*dataSocketPtr, moved);
+      if (file->digest_) {
+        file->digest_->commit(file->fd_);
+      }
+      file->writeLock_ = nullptr;
+      sendFTPMsg(FTPMsgs(FTPReplyCode::CLOSING_DATA_CONNECTION, "Done"));
+      return;
+    }
+    if (received < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        break;
+      }
+      FTP_LOG_ERROR("Data read error: " << std::strerror(errno));
+      sendFTPMsg(
+          FTPMsgs(FTPReplyCode::TRANSFER_ABORTED, "Data transfer aborted"));
+      return;
+    }
+    Metrics::instance().bytesReceived(Metrics::DataPath::SPLICE,
+                                      static_cast<size_t>(received));
+    dataMoved(*dataSocketPtr);
+    if (file->digest_ && !file->digestPipe(static_cast<size_t>(received))) {
+      // A partial digest is worthless, the file is hashed again on demand
+      file->digest_ = nullptr;
+    }
+    moved += static_cast<size_t>(received);
+    // Drain the pipe into the file before reading more from the socket
+    while (received > 0) {
+      ssize_t written = ::splice(file->pipe_[0], nullptr, file->fd_, nullptr,
+                                 received, SPLICE_F_MOVE);
+      if (written < 0 && errno == EINTR) {
+        continue;
+      }
+      if (written <= 0) {
+        FTP_LOG_ERROR("File write error: " << std::strerror(errno));
+        sendFTPMsg(FTPMsgs(FTPReplyCode::ACTION_ABORTED_LOCAL_ERROR,
+                           "Error writing file"));
+        return;
+      }
+      received -= written;
+      file->offset_ += written;
+    }
+  }
+  auto wait = payBandwidth(*dataSocketPtr, moved);
+  if (moved == share) {
+    continueTransfer(dataSocketPtr, wait,
+                     [me = shared_from_this(), dataSocketPtr, file]() {
+                       me->receiveSpliceChunks(dataSocketPtr, file);
+                     });
+    return;
+  }
+  // Nothing more to read yet: the next turn starts once data comes in
+  continueTransfer(dataSocketPtr, wait, [me = shared_from_this(),
+                                         dataSocketPtr, file]() {
+    dataSocketPtr->async_wait(
+        net::ip::tcp::socket::wait_read,
+        [me, dataSocketPtr, file](std::error_code const& ec) {
+          if (ec) {
+            FTP_LOG_ERROR("Data read error: " << ec.message());
+            me->sendFTPMsg(FTPMsgs(FTPReplyCode::TRANSFER_ABORTED,
+                                   "Data transfer aborted"));
+            return;
+          }
+          me->receiveSpliceChunks(dataSocketPtr, file);
+        });
+  });
+}
+#endif
+
 void FTPSession::writeDataToFile(charbuf_ptr const& data,
                                  ioFile_ptr const& file,
                                  std::function<void(void)> fetchMore) {
   net::post(fileRWStrand_, [me = shared_from_this(), data, file, fetchMore] {
     fetchMore();
+#if defined(FTP_HAVE_ZLIB)
+    if (file->zstream_) {
+      // A broken stream is reported once the upload ends
+      file->zstream_->process(data->data(), data->size(), false,
+                              [&file](char const* plain, std::size_t length) {
+                                file->fileStream_.write(plain, length);
+                                if (file->digest_) {
+                                  file->digest_->update(plain, length);
+                                }
+                              });
+      return;
+    }
+#endif
     file->fileStream_.write(data->data(), data->size());
+    if (file->digest_) {
+      file->digest_->update(data->data(), data->size());
+    }
   });
 }
@@ -1,16 +1,38 @@
 #pragma once
 #include <experimental/net>
+#include <experimental/timer>
 
+#include <algorithm>
 #include <atomic>
+#include <cerrno>
+#include <chrono>
 #include <deque>
 #include <filesystem>
 #include <fstream>
 #include <set>
 #include <memory>
+#include <optional>
+#include <string_view>
 
+#if defined(__linux__)
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "BufferPool.hpp"
+#include "DigestCache.hpp"
+#include "DirListing.hpp"
+#include "DirListingCache.hpp"
 #include "FTPMsgs.hpp"
 #include "FTPUser.hpp"
+#include "FTPWriteLocks.hpp"
+#include "FileDigest.hpp"
+#include "Metrics.hpp"
+#include "TimingWheel.hpp"
+#include "TokenBucket.hpp"
+#include "TransferScheduler.hpp"
 #include "UserDatabase.hpp"
+#include "ZStream.hpp"
 
 namespace fs = std::filesystem;
 namespace net = std::experimental::net;
@@ -19,73 +41,280 @@ class FTPSession;
 using session_ptr = std::shared_ptr<FTPSession>;
 
 class FTPSession : public std::enable_shared_from_this<FTPSession> {
+  struct DataSocket;
   using charbuf_ptr = std::shared_ptr<std::vector<char>>;
-  using socket_ptr = std::shared_ptr<net::ip::tcp::socket>;
+  using socket_ptr = std::shared_ptr<DataSocket>;
+  using cmdHandler = FTPMsgs (FTPSession::*)(std::string_view);
 
  public:
   FTPSession(net::io_context& context, net::ip::tcp::socket& cmdSocket,
              UserDatabase& userDb,
              std::function<void(session_ptr, bool)> const& contactHandler);
   virtual ~FTPSession();
+
+  // Control replies queued together are sent with one gathered write of at
+  // most maxReplies messages.
+  struct ReplyWriteStats {
+    size_t writes;
+    size_t replies;
+    double repliesPerWrite() const {
+      return writes ? static_cast<double>(replies) / writes : 0.0;
+    }
+  };
+  static void setMaxRepliesPerWrite(size_t maxReplies);
+  static ReplyWriteStats replyWriteStats();
+
+  // Zero disables a timeout. To be set before the server starts.
+  struct Timeouts {
+    // No command and no data moving: the session is closed with a 421
+    std::chrono::seconds controlIdle;
+    // PASV not followed by a data connection: the data port is closed
+    std::chrono::seconds pasvAccept;
+    // Data connection not moving: the transfer is aborted
+    std::chrono::seconds dataStall;
+  };
+  static void setTimeouts(Timeouts const& timeouts);
+  // Bytes per second for all the transfers of the server together, zero
+  // for no limit
+  static void setGlobalBandwidth(uint64_t bytesPerSecond);
+
   std::string getUserName() const;
   void start();
   void deliver(std::string const& msg);
+  // Runs one command line and returns its reply without sending it, nothing
+  // for unknown commands. Only commands starting a transfer need a socket.
+  std::optional<FTPMsgs> executeFTPCmd(std::string_view cmd);
 
  private:
+  // Data connection, counted as an active transfer while it lives
+  struct DataSocket : net::ip::tcp::socket {
+    DataSocket(net::ip::tcp::socket&& peer,
+               std::shared_ptr<FTPUser> const& user)
+        : net::ip::tcp::socket(std::move(peer)),
+          user_(user),
+          throttle_(get_executor().context()),
+          stalled_(false),
+          aborted_(false) {
+      Metrics::instance().transferStarted();
+    }
+    virtual ~DataSocket() {
+      if (stallTimeout_) {
+        stallTimeout_->cancel();
+      }
+      Metrics::instance().transferEnded();
+    }
+    // Whose bandwidth the transfer uses, as logged in when it started
+    std::shared_ptr<FTPUser> const user_;
+    net::steady_timer throttle_;
+    TimingWheel::timeout_ptr stallTimeout_;
+    // Shut down by the stall timeout: the end of the data is not the end
+    // of the file
+    std::atomic<bool> stalled_;
+    // The transfer was already reported as aborted
+    std::atomic<bool> aborted_;
+  };
+
   struct IoFile {
-    IoFile(fs::path const& path, std::ios::openmode mode)
-        : fileStream_(path, mode), streamBuf_(1 << 20) {
+    IoFile(RootDir const& root, fs::path const& path, std::ios::openmode mode)
+        : streamBuf_(BufferPool::instance().acquire(1 << 20)) {
+      root.openStream(fileStream_, path, mode);
+      fileStream_.rdbuf()->pubsetbuf(
+          streamBuf_->data(),
+          static_cast<std::streamsize>(streamBuf_->size()));
+    }
+#if defined(__linux__)
+    // Takes over fd and opens the stream on the same file
+    IoFile(int fd, std::ios::openmode mode)
+        : streamBuf_(BufferPool::instance().acquire(1 << 20)), fd_(fd) {
+      RootDir::reopenStream(fileStream_, fd, mode);
       fileStream_.rdbuf()->pubsetbuf(
-          streamBuf_.data(), static_cast<std::streamsize>(streamBuf_.size()));
+          streamBuf_->data(),
+          static_cast<std::streamsize>(streamBuf_->size()));
     }
+#endif
     virtual ~IoFile() {
       fileStream_.flush();
       fileStream_.close();
+#if defined(__linux__)
+      if (fd_ >= 0) {
+        ::close(fd_);
+      }
+#endif
     }
     std::fstream fileStream_;
-    std::vector<char> streamBuf_;
+    BufferPool::buffer_ptr streamBuf_;
+#if defined(__linux__)
+    // The file the stream is on, -1 unless opened from a descriptor
+    int fd_ = -1;
+#endif
+    FTPWriteLocks::lock_ptr writeLock_;
+    // Set for uploads that write the whole file
+    std::unique_ptr<UploadDigest> digest_;
+#if defined(FTP_HAVE_ZLIB)
+    // Set for MODE Z transfers
+    std::unique_ptr<ZStream> zstream_;
+#endif
   };
   using ioFile_ptr = std::shared_ptr<IoFile>;
 
-  FTPMsgs handleFTPCmdUADD(std::string const& para);
-  FTPMsgs handleFTPCmdUSER(std::string const& para);
-  FTPMsgs handleFTPCmdNOTI(std::string const& para);
-  FTPMsgs handleFTPCmdPASS(std::string const& para);
-  FTPMsgs handleFTPCmdACCT(std::string const& para);
-  FTPMsgs handleFTPCmdCWD(std::string const& para);
-  FTPMsgs handleFTPCmdCDUP(std::string const& para);
-  FTPMsgs handleFTPCmdREIN(std::string const& para);
-  FTPMsgs handleFTPCmdQUIT(std::string const& para);
+#if defined(__linux__)
+  // Raw file descriptor for the zero-copy transfer paths, which hand the
+  // data to the kernel instead of going through fstream buffers.
+  struct RawFile {
+    // Takes over fd, as opened by RootDir
+    explicit RawFile(int fd)
+        : fd_(fd),
+          offset_(0),
+          pipe_{-1, -1},
+          teePipe_{-1, -1} {}
+    virtual ~RawFile() {
+      for (int fd : {fd_, pipe_[0], pipe_[1], teePipe_[0], teePipe_[1]}) {
+        if (fd >= 0) {
+          ::close(fd);
+        }
+      }
+    }
+    bool good() const { return fd_ >= 0; }
+    // splice() needs a pipe between the socket and the file
+    bool openPipe() {
+      if (::pipe2(pipe_, O_CLOEXEC) != 0) {
+        return false;
+      }
+      ::fcntl(pipe_[1], F_SETPIPE_SZ, 1 << 20);  // best effort
+      return true;
+    }
+    // Spliced uploads are digested from a tee() of pipe_, which must hold
+    // everything pipe_ can
+    bool openTeePipe() {
+      if (::pipe2(teePipe_, O_CLOEXEC) != 0) {
+        return false;
+      }
+      int size = ::fcntl(pipe_[1], F_GETPIPE_SZ);
+      if (size <= 0 || ::fcntl(teePipe_[1], F_SETPIPE_SZ, size) < size) {
+        return false;
+      }
+      teeBuffer_ = BufferPool::instance().acquire(static_cast<size_t>(size));
+      return true;
+    }
+    // Feeds the length bytes that pipe_ holds to digest_ without taking
+    // them out of pipe_
+    bool digestPipe(size_t length) {
+      ssize_t teed = ::tee(pipe_[0], teePipe_[1], length, SPLICE_F_NONBLOCK);
+      while (teed > 0) {
+        ssize_t nbRead = ::read(teePipe_[0], teeBuffer_->data(),
+                                std::min(static_cast<size_t>(teed),
+                                         teeBuffer_->size()));
+        if (nbRead < 0 && errno == EINTR) {
+          continue;
+        }
+        if (nbRead <= 0) {
+          return false;
+        }
+        digest_->update(teeBuffer_->data(), static_cast<size_t>(nbRead));
+        teed -= nbRead;
+        length -= static_cast<size_t>(nbRead);
+      }
+      return length == 0;
+    }
+    int fd_;
+    off_t offset_;
+    int pipe_[2];
+    int teePipe_[2];
+    BufferPool::buffer_ptr teeBuffer_;
+    FTPWriteLocks::lock_ptr writeLock_;
+    std::unique_ptr<UploadDigest> digest_;
+  };
+  using rawFile_ptr = std::shared_ptr<RawFile>;
+#endif
+
+  // A LIST, NLST or MLSD body on its way to the data connection
+  struct ListingTransfer {
+    explicit ListingTransfer(listing_reader reader)
+        : reader_(std::move(reader)), finished_(false) {}
+    virtual ~ListingTransfer() = default;
+    listing_reader const reader_;
+    // Set once the reader has handed out its last chunk
+    bool finished_;
+#if defined(FTP_HAVE_ZLIB)
+    // Set for MODE Z transfers
+    std::unique_ptr<ZStream> zstream_;
+#endif
+  };
+  using listingTransfer_ptr = std::shared_ptr<ListingTransfer>;
+
+  FTPMsgs handleFTPCmdUADD(std::string_view para);
+  FTPMsgs handleFTPCmdUSER(std::string_view para);
+  FTPMsgs handleFTPCmdNOTI(std::string_view para);
+  FTPMsgs handleFTPCmdPASS(std::string_view para);
+  FTPMsgs handleFTPCmdACCT(std::string_view para);
+  FTPMsgs handleFTPCmdCWD(std::string_view para);
+  FTPMsgs handleFTPCmdCDUP(std::string_view para);
+  FTPMsgs handleFTPCmdREIN(std::string_view para);
+  FTPMsgs handleFTPCmdQUIT(std::string_view para);
 
   // Transfer paraeter commands
-  FTPMsgs handleFTPCmdPORT(std::string const& para);
-  FTPMsgs handleFTPCmdPASV(std::string const& para);
-  FTPMsgs handleFTPCmdTYPE(std::string const& para);
-  FTPMsgs handleFTPCmdSTRU(std::string const& para);
-  FTPMsgs handleFTPCmdMODE(std::string const& para);
+  FTPMsgs handleFTPCmdPORT(std::string_view para);
+  FTPMsgs handleFTPCmdPASV(std::string_view para);
+  FTPMsgs handleFTPCmdTYPE(std::string_view para);
+  FTPMsgs handleFTPCmdSTRU(std::string_view para);
+  FTPMsgs handleFTPCmdMODE(std::string_view para);
 
   // Ftp service commands
-  FTPMsgs handleFTPCmdRETR(std::string const& para);
-  FTPMsgs handleFTPCmdSTOR(std::string const& para);
-  FTPMsgs handleFTPCmdSIZE(std::string const& para);
-  FTPMsgs handleFTPCmdSTOU(std::string const& para);
-  FTPMsgs handleFTPCmdAPPE(std::string const& para);
-  FTPMsgs handleFTPCmdALLO(std::string const& para);
-  FTPMsgs handleFTPCmdREST(std::string const& para);
-  FTPMsgs handleFTPCmdRNFR(std::string const& para);
-  FTPMsgs handleFTPCmdRNTO(std::string const& para);
-  FTPMsgs handleFTPCmdABOR(std::string const& para);
-  FTPMsgs handleFTPCmdDELE(std::string const& para);
-  FTPMsgs handleFTPCmdRMD(std::string const& para);
-  FTPMsgs handleFTPCmdMKD(std::string const& para);
-  FTPMsgs handleFTPCmdPWD(std::string const& para);
-  FTPMsgs handleFTPCmdLIST(std::string const& para);
-  FTPMsgs handleFTPCmdNLST(std::string const& para);
-  FTPMsgs handleFTPCmdSITE(std::string const& para);
-  FTPMsgs handleFTPCmdSYST(std::string const& para);
-  FTPMsgs handleFTPCmdSTAT(std::string const& para);
-  FTPMsgs handleFTPCmdHELP(std::string const& para);
-  FTPMsgs handleFTPCmdNOOP(std::string const& para);
+  FTPMsgs handleFTPCmdRETR(std::string_view para);
+  FTPMsgs handleFTPCmdSTOR(std::string_view para);
+  FTPMsgs handleFTPCmdSIZE(std::string_view para);
+  FTPMsgs handleFTPCmdSTOU(std::string_view para);
+  FTPMsgs handleFTPCmdAPPE(std::string_view para);
+  FTPMsgs handleFTPCmdALLO(std::string_view para);
+  FTPMsgs handleFTPCmdREST(std::string_view para);
+  FTPMsgs handleFTPCmdRNFR(std::string_view para);
+  FTPMsgs handleFTPCmdRNTO(std::string_view para);
+  FTPMsgs handleFTPCmdABOR(std::string_view para);
+  FTPMsgs handleFTPCmdDELE(std::string_view para);
+  FTPMsgs handleFTPCmdRMD(std::string_view para);
+  FTPMsgs handleFTPCmdMKD(std::string_view para);
+  FTPMsgs handleFTPCmdPWD(std::string_view para);
+  FTPMsgs handleFTPCmdLIST(std::string_view para);
+  FTPMsgs handleFTPCmdNLST(std::string_view para);
+  FTPMsgs handleFTPCmdSITE(std::string_view para);
+  FTPMsgs handleFTPCmdSYST(std::string_view para);
+  FTPMsgs handleFTPCmdSTAT(std::string_view para);
+  FTPMsgs handleFTPCmdHELP(std::string_view para);
+  FTPMsgs handleFTPCmdNOOP(std::string_view para);
+
+  // RFC 3659 commands
+  FTPMsgs handleFTPCmdFEAT(std::string_view para);
+  FTPMsgs handleFTPCmdOPTS(std::string_view para);
+  FTPMsgs handleFTPCmdMLST(std::string_view para);
+  FTPMsgs handleFTPCmdMLSD(std::string_view para);
+
+  // File digest commands
+  FTPMsgs handleFTPCmdHASH(std::string_view para);
+  FTPMsgs handleFTPCmdRANG(std::string_view para);
+  FTPMsgs handleFTPCmdXCRC(std::string_view para);
+  FTPMsgs handleFTPCmdXMD5(std::string_view para);
+  FTPMsgs handleFTPCmdXSHA1(std::string_view para);
+  FTPMsgs handleFTPCmdXSHA256(std::string_view para);
+
+  // Wraps an accepted data connection and starts its stall timeout
+  socket_ptr openDataSocket(net::ip::tcp::socket&& peer);
+  // Data moved: neither the transfer nor the session is idle
+  void dataMoved(DataSocket& dataSocket);
+  // Sends a single 426 for the transfer, whichever path fails first
+  void abortTransfer(DataSocket& dataSocket);
+  void closeIdleSession();
+  // Data the transfer moves in one turn: its weighted share, and no more
+  // than a tenth of a second at its lowest bandwidth limit, which keeps a
+  // throttled transfer smooth
+  std::size_t turnSize(DataSocket const& dataSocket) const;
+  // Pays for bytes moved and returns how long to hold off
+  TokenBucket::clock::duration payBandwidth(DataSocket& dataSocket,
+                                            std::size_t bytes);
+  // Queues the next turn of the transfer once wait is over, with the io
+  // thread free in between
+  void continueTransfer(socket_ptr const& dataSocketPtr,
+                        TokenBucket::clock::duration wait,
+                        std::function<void(void)> const& turn);
 
   void sendFile(ioFile_ptr const& file);
   void readFileDataAndSend(socket_ptr const& dataSocketPtr,
@@ -96,7 +325,28 @@ class FTPSession : public std::enable_shared_from_this<FTPSession> {
   void writeDataToSocket(socket_ptr const& dataSocketPtr,
                          std::function<void(void)> fetchMore);
 
+#if defined(__linux__)
+  void sendFileZeroCopy(rawFile_ptr const& file);
+  void sendFileChunks(socket_ptr const& dataSocketPtr,
+                      rawFile_ptr const& file);
+#endif
+
+#if defined(__linux__)
+  // Starts receiving into the locked file at offset, where it ends
+  FTPMsgs receiveFileAt(fs::path const& localPath, rawFile_ptr const& file,
+                        uint64_t offset);
+#else
+  // Opens an existing file for writing at offset and starts receiving
+  FTPMsgs receiveFileAt(fs::path const& localPath,
+                        FTPWriteLocks::lock_ptr const& writeLock,
+                        uint64_t offset);
+#endif
   void receiveFile(ioFile_ptr const& file);
+#if defined(__linux__)
+  void receiveFileZeroCopy(rawFile_ptr const& file);
+  void receiveSpliceChunks(socket_ptr const& dataSocketPtr,
+                           rawFile_ptr const& file);
+#endif
   void receiveDataFromSocketAndWriteToFile(socket_ptr const& dataSocketPtr,
                                            ioFile_ptr const& file);
   void writeDataToFile(
@@ -106,22 +356,47 @@ class FTPSession : public std::enable_shared_from_this<FTPSession> {
   fs::path FTP2LocalPath(fs::path const& ftpPath) const;
   std::string Local2FTPPath(fs::path const& ftp_Path) const;
   FTPMsgs checkPathRenamable(fs::path const& ftpPath) const;
-  void sendDirListing(std::set<fs::path> const& dirContent);
-  void sendNameList(std::set<fs::path> const& dirContent);
+  // Adds the MODE Z stage to a transfer, does nothing in MODE S
+  void setUpModeZ(ioFile_ptr const& file, fs::path const& path, bool upload);
+  // Opens what LIST, NLST, MLSD (directory) or MLST list, nullptr and ec
+  // set if it cannot be read
+  listing_source openListing(fs::path const& localPath, bool directory,
+                             std::error_code& ec) const;
+  void sendListing(listing_source const& dir, DirListingCache::Format format,
+                   DirListingCache::renderer const& render);
+  void readListingAndSend(socket_ptr const& dataSocketPtr,
+                          listingTransfer_ptr const& listing);
+  // Digest of bytes first to last (inclusive, kToEndOfFile for the rest of
+  // the file), as a HASH reply or as the 250 reply of the X commands
+  FTPMsgs digestReply(std::string_view ftpPath, HashAlgorithm algorithm,
+                      uint64_t first, uint64_t last, bool hashReply);
+  FTPMsgs handleXDigestCmd(std::string_view para, HashAlgorithm algorithm);
+#if defined(__linux__)
+  // Runs hasher a turn at a time, then hands done the digest
+  void hashInTurns(
+      std::shared_ptr<FileHasher> const& hasher, std::size_t turnBytes,
+      std::function<void(std::optional<std::string> const&)> const& done);
+#endif
 
+  // For a command answered once the work it started is done. The commands
+  // after it wait for sendDeferredReply, so the replies keep their order.
+  FTPMsgs deferReply();
+  void sendDeferredReply(FTPMsgs const& msg);
   void sendFTPMsg(FTPMsgs const& msg);
+  void queueFTPMsg(FTPMsgs const& msg);
   void startSendingMsgs();
   void readFTPCmd();
-  void handleFTPCmd(std::string const& cmd);
+  void handleFTPCmds();
+  void handleFTPCmd(std::string_view cmd);
+  static cmdHandler lookupFTPCmd(uint64_t cmdKey);
 
   std::function<void(session_ptr, bool)> const contactHandler_;
 
   UserDatabase& userDb_;
-  static std::atomic<bool> isUploading_;
-  bool thisClientUploading_;
+  static FTPWriteLocks writeLocks_;
 
   fs::path ftpWorkingDir_;
-  std::string lastCmd_;
+  uint64_t lastCmd_;
   std::string username_;
   std::string renameSrcPath_;
   std::shared_ptr<FTPUser> sessionUser_;
@@ -132,10 +407,37 @@ class FTPSession : public std::enable_shared_from_this<FTPSession> {
   net::ip::tcp::socket notiSocket_;
   net::strand<net::io_context::executor_type> msgWriteStrand_;
   std::deque<std::string> msgOutputQueue_;
+  size_t msgsInFlight_;
+  static std::atomic<size_t> maxRepliesPerWrite_;
+  static std::atomic<size_t> replyWrites_;
+  static std::atomic<size_t> repliesWritten_;
+  bool handlingCmds_;
+  bool replyDeferred_;
+  static Timeouts timeouts_;
+  static TokenBucket globalBandwidth_;
+  // Set at login from the rate the user gives each session
+  TokenBucket bandwidth_;
+  TimingWheel::timeout_ptr idleTimeout_;
+  TimingWheel::timeout_ptr pasvTimeout_;
+  // Tells the PASV timeout apart from the one of an earlier PASV
+  uint64_t pasvGeneration_;
+  // The control connection closes once the queued replies are sent
+  bool closing_;
 
   bool dataTypeBinary_;
+  // Set by REST, used by the next transfer command only
+  uint64_t restOffset_;
+  bool modeZ_;
+  int modeZLevel_;
+  // Chosen with OPTS HASH; also digested during uploads
+  HashAlgorithm hashAlgorithm_;
+  // Set by RANG, used by the next HASH only. Both ends are inclusive.
+  uint64_t rangeFirst_;
+  uint64_t rangeLast_;
   net::ip::tcp::acceptor dataAcceptor_;
   std::deque<charbuf_ptr> dataBuffer_;
+  // Bytes of the front buffer already written
+  std::size_t dataBufferOffset_;
   net::strand<net::io_context::executor_type> fileRWStrand_;
   net::strand<net::io_context::executor_type> dataBufStrand_;
 };
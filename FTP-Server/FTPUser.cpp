@@ -1,6 +1,42 @@
 #include "FTPUser.hpp"
 
+// Absolute and normal, without a trailing separator, so the local paths of
+// the user start with it as a string
+static fs::path normalRoot(fs::path const& localRootPath) {
+  fs::path root = fs::weakly_canonical(
+      localRootPath.empty() ? fs::current_path() : localRootPath);
+  return root.has_filename() || root == root.root_path() ? root
+                                                         : root.parent_path();
+}
+
 FTPUser::FTPUser(std::string const& pass, fs::path const& localRootPath)
     : pass_(pass),
-      localRootPath_(localRootPath.empty() ? fs::current_path()
-                                           : localRootPath) {}
+      localRootPath_(normalRoot(localRootPath)),
+      root_(localRootPath_),
+      sessionBandwidth_(0),
+      transferWeight_(1) {}
+
+fs::path FTPUser::toLocalPath(fs::path const& workingDir,
+                              fs::path const& ftpPath) const {
+  fs::path path = ftpPath.has_root_directory()
+                      ? localRootPath_ / ftpPath.relative_path()
+                      : workingDir / ftpPath;
+  fs::path relPath = path.lexically_normal().lexically_relative(localRootPath_);
+  if (relPath.empty() || relPath == "." || *relPath.begin() == "..") {
+    return localRootPath_;
+  }
+  // "dir/" names dir
+  if (!relPath.has_filename()) {
+    relPath = relPath.parent_path();
+  }
+  return localRootPath_ / relPath;
+}
+
+std::string FTPUser::toFTPPath(fs::path const& localPath) const {
+  std::string ftpPath = localPath.generic_string();
+  std::string::size_type rootLength = localRootPath_.generic_string().size();
+  if (ftpPath.size() <= rootLength) return "/";
+  // A root of "/" keeps its separator
+  return ftpPath.substr(ftpPath[rootLength] == '/' ? rootLength
+                                                   : rootLength - 1);
+}
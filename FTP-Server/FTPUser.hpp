@@ -1,13 +1,34 @@
 #pragma once
+#include <atomic>
+#include <cstdint>
 #include <filesystem>
 #include <string>
 
+#include "RootDir.hpp"
+#include "TokenBucket.hpp"
+
 namespace fs = std::filesystem;
 
 class FTPUser {
  public:
   FTPUser(std::string const& pass, fs::path const& localRootPath);
 
+  // Local path of ftpPath, relative to workingDir unless absolute. Only
+  // the string is worked on: paths leading out of the root are clamped to
+  // the root, while symlinks are left for root_ to resolve.
+  fs::path toLocalPath(fs::path const& workingDir,
+                       fs::path const& ftpPath) const;
+  // FTP path of localPath, which must be inside the root
+  std::string toFTPPath(fs::path const& localPath) const;
+
   std::string const pass_;
   fs::path const localRootPath_;
+  // Every file command goes through here
+  RootDir const root_;
+  // Shared by all the sessions of the user
+  TokenBucket bandwidth_;
+  // Rate each session of the user gets on its own, zero for no limit
+  std::atomic<uint64_t> sessionBandwidth_;
+  // Share of the io threads a transfer of the user gets against the others
+  std::atomic<unsigned> transferWeight_;
 };
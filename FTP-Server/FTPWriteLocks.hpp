@@ -0,0 +1,66 @@
+#pragma once
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <utility>
+
+#if defined(__linux__)
+#include <sys/stat.h>
+#endif
+
+namespace fs = std::filesystem;
+
+// Files currently being written by an upload. A file stays locked as long as
+// the returned handle is alive, which is until the transfer has finished and
+// the file is closed.
+class FTPWriteLocks {
+ public:
+#if defined(__linux__)
+  // Device and inode, so every link to a file shares its lock
+  using key_type = std::pair<dev_t, ino_t>;
+#else
+  using key_type = std::string;
+#endif
+
+  class Lock {
+   public:
+    Lock(FTPWriteLocks& owner, key_type const& key)
+        : owner_(owner), key_(key) {}
+    virtual ~Lock() { owner_.unlock(key_); }
+
+   private:
+    FTPWriteLocks& owner_;
+    key_type const key_;
+  };
+  using lock_ptr = std::shared_ptr<Lock>;
+
+  // Returns nullptr when another transfer is writing to the same file
+#if defined(__linux__)
+  // st is the fstat of the opened file
+  lock_ptr tryLock(struct stat const& st) {
+    return lockKey(key_type(st.st_dev, st.st_ino));
+  }
+#else
+  lock_ptr tryLock(fs::path const& path) {
+    return lockKey(path.lexically_normal().string());
+  }
+#endif
+
+ private:
+  lock_ptr lockKey(key_type const& key) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!files_.insert(key).second) {
+      return nullptr;
+    }
+    return std::make_shared<Lock>(*this, key);
+  }
+  void unlock(key_type const& key) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    files_.erase(key);
+  }
+
+  std::mutex mutex_;
+  std::set<key_type> files_;
+};
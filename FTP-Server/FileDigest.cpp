@@ -0,0 +1,608 @@
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <fstream>
+
+#if defined(__unix__)
+#include <cerrno>
+
+#include <unistd.h>
+#endif
+
+// Same zlib condition as ZStream.hpp
+#if defined(_MSC_VER) ? defined(FTP_WITH_ZLIB) : __has_include(<zlib.h>)
+#include <zlib.h>
+#define FTP_HAVE_ZLIB 1
+#endif
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <cpuid.h>
+#include <immintrin.h>
+#define FTP_X86_DISPATCH 1
+#define FTP_TARGET(features) __attribute__((target(features)))
+#elif defined(_M_X64)
+#include <immintrin.h>
+#include <intrin.h>
+#define FTP_X86_DISPATCH 1
+#define FTP_TARGET(features)
+#endif
+
+#include "BufferPool.hpp"
+#include "FileDigest.hpp"
+
+namespace {
+
+constexpr std::string_view kAlgorithmNames[kNbHashAlgorithms] = {
+    "CRC32", "CRC32C", "MD5", "SHA-1", "SHA-256"};
+
+#if defined(FTP_X86_DISPATCH)
+enum CpuidRegister { EAX = 0, EBX, ECX, EDX };
+
+bool cpuHas(unsigned int leaf, CpuidRegister reg, int bit) {
+#if defined(_M_X64)
+  int regs[4];
+  __cpuid(regs, 0);
+  if (static_cast<unsigned int>(regs[0]) < leaf) {
+    return false;
+  }
+  __cpuidex(regs, static_cast<int>(leaf), 0);
+#else
+  unsigned int regs[4];
+  if (!__get_cpuid_count(leaf, 0, &regs[0], &regs[1], &regs[2], &regs[3])) {
+    return false;
+  }
+#endif
+  return (static_cast<unsigned int>(regs[reg]) >> bit) & 1;
+}
+
+bool hasSse42() {
+  static bool const supported = cpuHas(1, ECX, 20);
+  return supported;
+}
+
+bool hasShaNi() {
+  // The SHA-NI rounds also need SSSE3 shuffles and SSE4.1 blends
+  static bool const supported =
+      cpuHas(7, EBX, 29) && cpuHas(1, ECX, 19) && cpuHas(1, ECX, 9);
+  return supported;
+}
+#endif
+
+inline uint32_t rotl(uint32_t value, int bits) {
+  return (value << bits) | (value >> (32 - bits));
+}
+
+inline uint32_t rotr(uint32_t value, int bits) {
+  return (value >> bits) | (value << (32 - bits));
+}
+
+inline uint32_t loadBigEndian(uint8_t const* bytes) {
+  return (uint32_t(bytes[0]) << 24) | (uint32_t(bytes[1]) << 16) |
+         (uint32_t(bytes[2]) << 8) | uint32_t(bytes[3]);
+}
+
+inline uint32_t loadLittleEndian(uint8_t const* bytes) {
+  return uint32_t(bytes[0]) | (uint32_t(bytes[1]) << 8) |
+         (uint32_t(bytes[2]) << 16) | (uint32_t(bytes[3]) << 24);
+}
+
+std::string toHex(uint32_t const* words, std::size_t nbWords,
+                  bool bigEndian) {
+  static char const hexDigits[] = "0123456789abcdef";
+  std::string hex;
+  hex.reserve(nbWords * 8);
+  for (std::size_t i = 0; i < nbWords; ++i) {
+    for (int byte = 0; byte < 4; ++byte) {
+      int shift = bigEndian ? 24 - 8 * byte : 8 * byte;
+      uint8_t value = static_cast<uint8_t>(words[i] >> shift);
+      hex.push_back(hexDigits[value >> 4]);
+      hex.push_back(hexDigits[value & 0xf]);
+    }
+  }
+  return hex;
+}
+
+// Slice-by-8 tables of a reflected CRC-32 polynomial
+struct CrcTables {
+  explicit CrcTables(uint32_t polynomial) {
+    for (uint32_t i = 0; i < 256; ++i) {
+      uint32_t crc = i;
+      for (int bit = 0; bit < 8; ++bit) {
+        crc = (crc & 1) ? (crc >> 1) ^ polynomial : crc >> 1;
+      }
+      table[0][i] = crc;
+    }
+    for (uint32_t i = 0; i < 256; ++i) {
+      for (int slice = 1; slice < 8; ++slice) {
+        uint32_t prev = table[slice - 1][i];
+        table[slice][i] = (prev >> 8) ^ table[0][prev & 0xff];
+      }
+    }
+  }
+
+  uint32_t update(uint32_t crc, uint8_t const* data,
+                  std::size_t length) const {
+    for (; length >= 8; data += 8, length -= 8) {
+      uint32_t low = crc ^ loadLittleEndian(data);
+      uint32_t high = loadLittleEndian(data + 4);
+      crc = table[7][low & 0xff] ^ table[6][(low >> 8) & 0xff] ^
+            table[5][(low >> 16) & 0xff] ^ table[4][low >> 24] ^
+            table[3][high & 0xff] ^ table[2][(high >> 8) & 0xff] ^
+            table[1][(high >> 16) & 0xff] ^ table[0][high >> 24];
+    }
+    for (; length > 0; ++data, --length) {
+      crc = (crc >> 8) ^ table[0][(crc ^ *data) & 0xff];
+    }
+    return crc;
+  }
+
+  uint32_t table[8][256];
+};
+
+class Crc32Hasher : public Hasher {
+ public:
+  void update(void const* data, std::size_t length) override {
+    auto bytes = static_cast<uint8_t const*>(data);
+#if defined(FTP_HAVE_ZLIB)
+    // zlib counts in uInt
+    while (length > 0) {
+      auto round = static_cast<uInt>(std::min<std::size_t>(length, 1u << 30));
+      crc_ = static_cast<uint32_t>(crc32(crc_, bytes, round));
+      bytes += round;
+      length -= round;
+    }
+#else
+    static CrcTables const tables(0xEDB88320);
+    crc_ = ~tables.update(~crc_, bytes, length);
+#endif
+  }
+  std::string finish() override { return toHex(&crc_, 1, true); }
+
+ private:
+  uint32_t crc_ = 0;
+};
+
+#if defined(FTP_X86_DISPATCH)
+FTP_TARGET("sse4.2")
+uint32_t crc32cSse42(uint32_t crc, uint8_t const* data, std::size_t length) {
+  uint64_t crc64 = crc;
+  for (; length >= 8; data += 8, length -= 8) {
+    uint64_t word;
+    std::memcpy(&word, data, sizeof(word));
+    crc64 = _mm_crc32_u64(crc64, word);
+  }
+  crc = static_cast<uint32_t>(crc64);
+  for (; length > 0; ++data, --length) {
+    crc = _mm_crc32_u8(crc, *data);
+  }
+  return crc;
+}
+#endif
+
+class Crc32cHasher : public Hasher {
+ public:
+  void update(void const* data, std::size_t length) override {
+    auto bytes = static_cast<uint8_t const*>(data);
+#if defined(FTP_X86_DISPATCH)
+    if (hasSse42()) {
+      crc_ = crc32cSse42(crc_, bytes, length);
+      return;
+    }
+#endif
+    static CrcTables const tables(0x82F63B78);
+    crc_ = tables.update(crc_, bytes, length);
+  }
+  std::string finish() override {
+    uint32_t crc = ~crc_;
+    return toHex(&crc, 1, true);
+  }
+
+ private:
+  uint32_t crc_ = ~0u;
+};
+
+// Buffering and padding shared by MD5 and the SHAs, which all work on 64
+// byte blocks and end with the message length in bits.
+class BlockHasher : public Hasher {
+ public:
+  void update(void const* data, std::size_t length) override {
+    auto bytes = static_cast<uint8_t const*>(data);
+    totalLength_ += length;
+    if (buffered_ > 0) {
+      std::size_t taken = std::min(sizeof(block_) - buffered_, length);
+      std::memcpy(block_ + buffered_, bytes, taken);
+      buffered_ += taken;
+      bytes += taken;
+      length -= taken;
+      if (buffered_ < sizeof(block_)) {
+        return;
+      }
+      processBlocks(block_, 1);
+      buffered_ = 0;
+    }
+    if (std::size_t nbBlocks = length / sizeof(block_)) {
+      processBlocks(bytes, nbBlocks);
+      bytes += nbBlocks * sizeof(block_);
+      length -= nbBlocks * sizeof(block_);
+    }
+    std::memcpy(block_, bytes, length);
+    buffered_ = length;
+  }
+
+ protected:
+  explicit BlockHasher(bool bigEndian) : bigEndian_(bigEndian) {}
+
+  virtual void processBlocks(uint8_t const* data, std::size_t nbBlocks) = 0;
+
+  void pad() {
+    uint64_t bits = totalLength_ * 8;
+    uint8_t padding[64] = {0x80};
+    update(padding, (buffered_ < 56 ? 56 : 120) - buffered_);
+    uint8_t lengthBytes[8];
+    for (int i = 0; i < 8; ++i) {
+      lengthBytes[i] =
+          static_cast<uint8_t>(bits >> (bigEndian_ ? 56 - 8 * i : 8 * i));
+    }
+    update(lengthBytes, sizeof(lengthBytes));
+  }
+
+ private:
+  bool const bigEndian_;
+  uint8_t block_[64];
+  std::size_t buffered_ = 0;
+  uint64_t totalLength_ = 0;
+};
+
+class Md5Hasher : public BlockHasher {
+ public:
+  Md5Hasher() : BlockHasher(false) {}
+  std::string finish() override {
+    pad();
+    return toHex(state_, 4, false);
+  }
+
+ private:
+  void processBlocks(uint8_t const* data, std::size_t nbBlocks) override {
+    static constexpr uint32_t k[64] = {
+        0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf,
+        0x4787c62a, 0xa8304613, 0xfd469501, 0x698098d8, 0x8b44f7af,
+        0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e,
+        0x49b40821, 0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa,
+        0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8, 0x21e1cde6,
+        0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8,
+        0x676f02d9, 0x8d2a4c8a, 0xfffa3942, 0x8771f681, 0x6d9d6122,
+        0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+        0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039,
+        0xe6db99e5, 0x1fa27cf8, 0xc4ac5665, 0xf4292244, 0x432aff97,
+        0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d,
+        0x85845dd1, 0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1,
+        0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391};
+    static constexpr int shifts[4][4] = {
+        {7, 12, 17, 22}, {5, 9, 14, 20}, {4, 11, 16, 23}, {6, 10, 15, 21}};
+    for (; nbBlocks > 0; --nbBlocks, data += 64) {
+      uint32_t m[16];
+      for (int i = 0; i < 16; ++i) {
+        m[i] = loadLittleEndian(data + 4 * i);
+      }
+      uint32_t a = state_[0], b = state_[1], c = state_[2], d = state_[3];
+      for (int i = 0; i < 64; ++i) {
+        uint32_t f;
+        int g;
+        if (i < 16) {
+          f = (b & c) | (~b & d);
+          g = i;
+        } else if (i < 32) {
+          f = (d & b) | (~d & c);
+          g = (5 * i + 1) % 16;
+        } else if (i < 48) {
+          f = b ^ c ^ d;
+          g = (3 * i + 5) % 16;
+        } else {
+          f = c ^ (b | ~d);
+          g = (7 * i) % 16;
+        }
+        f += a + k[i] + m[g];
+        a = d;
+        d = c;
+        c = b;
+        b += rotl(f, shifts[i / 16][i % 4]);
+      }
+      state_[0] += a;
+      state_[1] += b;
+      state_[2] += c;
+      state_[3] += d;
+    }
+  }
+
+  uint32_t state_[4] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476};
+};
+
+class Sha1Hasher : public BlockHasher {
+ public:
+  Sha1Hasher() : BlockHasher(true) {}
+  std::string finish() override {
+    pad();
+    return toHex(state_, 5, true);
+  }
+
+ private:
+  void processBlocks(uint8_t const* data, std::size_t nbBlocks) override {
+    for (; nbBlocks > 0; --nbBlocks, data += 64) {
+      uint32_t w[80];
+      for (int i = 0; i < 16; ++i) {
+        w[i] = loadBigEndian(data + 4 * i);
+      }
+      for (int i = 16; i < 80; ++i) {
+        w[i] = rotl(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+      }
+      uint32_t a = state_[0], b = state_[1], c = state_[2], d = state_[3],
+               e = state_[4];
+      for (int i = 0; i < 80; ++i) {
+        uint32_t f, k;
+        if (i < 20) {
+          f = (b & c) | (~b & d);
+          k = 0x5a827999;
+        } else if (i < 40) {
+          f = b ^ c ^ d;
+          k = 0x6ed9eba1;
+        } else if (i < 60) {
+          f = (b & c) | (b & d) | (c & d);
+          k = 0x8f1bbcdc;
+        } else {
+          f = b ^ c ^ d;
+          k = 0xca62c1d6;
+        }
+        uint32_t temp = rotl(a, 5) + f + e + k + w[i];
+        e = d;
+        d = c;
+        c = rotl(b, 30);
+        b = a;
+        a = temp;
+      }
+      state_[0] += a;
+      state_[1] += b;
+      state_[2] += c;
+      state_[3] += d;
+      state_[4] += e;
+    }
+  }
+
+  uint32_t state_[5] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476,
+                        0xc3d2e1f0};
+};
+
+alignas(16) constexpr uint32_t kSha256K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+void sha256Portable(uint32_t state[8], uint8_t const* data,
+                    std::size_t nbBlocks) {
+  for (; nbBlocks > 0; --nbBlocks, data += 64) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; ++i) {
+      w[i] = loadBigEndian(data + 4 * i);
+    }
+    for (int i = 16; i < 64; ++i) {
+      uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+      uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+      w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3],
+             e = state[4], f = state[5], g = state[6], h = state[7];
+    for (int i = 0; i < 64; ++i) {
+      uint32_t s1 = rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25);
+      uint32_t t1 = h + s1 + ((e & f) ^ (~e & g)) + kSha256K[i] + w[i];
+      uint32_t s0 = rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22);
+      uint32_t t2 = s0 + ((a & b) ^ (a & c) ^ (b & c));
+      h = g;
+      g = f;
+      f = e;
+      e = d + t1;
+      d = c;
+      c = b;
+      b = a;
+      a = t1 + t2;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+  }
+}
+
+#if defined(FTP_X86_DISPATCH)
+// Four rounds per step; the message schedule for later steps is computed
+// alongside, msg[i % 4] holding the words of step i.
+FTP_TARGET("sha,sse4.1")
+void sha256ShaNi(uint32_t state[8], uint8_t const* data,
+                 std::size_t nbBlocks) {
+  __m128i const byteSwap =
+      _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+  __m128i tmp = _mm_loadu_si128(reinterpret_cast<__m128i const*>(state));
+  __m128i state1 =
+      _mm_loadu_si128(reinterpret_cast<__m128i const*>(state + 4));
+  tmp = _mm_shuffle_epi32(tmp, 0xB1);        // CDAB
+  state1 = _mm_shuffle_epi32(state1, 0x1B);  // EFGH
+  __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);  // ABEF
+  state1 = _mm_blend_epi16(state1, tmp, 0xF0);       // CDGH
+
+  for (; nbBlocks > 0; --nbBlocks, data += 64) {
+    __m128i const abefSave = state0;
+    __m128i const cdghSave = state1;
+    __m128i msg[4];
+    for (int step = 0; step < 16; ++step) {
+      __m128i& current = msg[step % 4];
+      if (step < 4) {
+        current = _mm_shuffle_epi8(
+            _mm_loadu_si128(
+                reinterpret_cast<__m128i const*>(data + 16 * step)),
+            byteSwap);
+      }
+      __m128i rounds = _mm_add_epi32(
+          current, _mm_load_si128(
+                       reinterpret_cast<__m128i const*>(kSha256K + 4 * step)));
+      state1 = _mm_sha256rnds2_epu32(state1, state0, rounds);
+      if (step >= 3 && step < 15) {
+        __m128i& next = msg[(step + 1) % 4];
+        next = _mm_add_epi32(
+            next, _mm_alignr_epi8(current, msg[(step + 3) % 4], 4));
+        next = _mm_sha256msg2_epu32(next, current);
+      }
+      rounds = _mm_shuffle_epi32(rounds, 0x0E);
+      state0 = _mm_sha256rnds2_epu32(state0, state1, rounds);
+      if (step >= 1 && step < 13) {
+        __m128i& previous = msg[(step + 3) % 4];
+        previous = _mm_sha256msg1_epu32(previous, current);
+      }
+    }
+    state0 = _mm_add_epi32(state0, abefSave);
+    state1 = _mm_add_epi32(state1, cdghSave);
+  }
+
+  tmp = _mm_shuffle_epi32(state0, 0x1B);       // FEBA
+  state1 = _mm_shuffle_epi32(state1, 0xB1);    // DCHG
+  state0 = _mm_blend_epi16(tmp, state1, 0xF0);  // DCBA
+  state1 = _mm_alignr_epi8(state1, tmp, 8);     // HGFE
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(state), state0);
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(state + 4), state1);
+}
+#endif
+
+class Sha256Hasher : public BlockHasher {
+ public:
+  Sha256Hasher() : BlockHasher(true) {}
+  std::string finish() override {
+    pad();
+    return toHex(state_, 8, true);
+  }
+
+ private:
+  void processBlocks(uint8_t const* data, std::size_t nbBlocks) override {
+#if defined(FTP_X86_DISPATCH)
+    if (hasShaNi()) {
+      sha256ShaNi(state_, data, nbBlocks);
+      return;
+    }
+#endif
+    sha256Portable(state_, data, nbBlocks);
+  }
+
+  uint32_t state_[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+};
+
+}  // namespace
+
+std::string_view hashAlgorithmName(HashAlgorithm algorithm) {
+  return kAlgorithmNames[static_cast<std::size_t>(algorithm)];
+}
+
+std::optional<HashAlgorithm> parseHashAlgorithm(std::string_view name) {
+  for (std::size_t i = 0; i < kNbHashAlgorithms; ++i) {
+    std::string_view known = kAlgorithmNames[i];
+    if (name.size() == known.size() &&
+        std::equal(name.begin(), name.end(), known.begin(),
+                   [](char a, char b) { return std::toupper(a) == b; })) {
+      return static_cast<HashAlgorithm>(i);
+    }
+  }
+  return std::nullopt;
+}
+
+std::unique_ptr<Hasher> Hasher::create(HashAlgorithm algorithm) {
+  switch (algorithm) {
+    case HashAlgorithm::CRC32: return std::make_unique<Crc32Hasher>();
+    case HashAlgorithm::CRC32C: return std::make_unique<Crc32cHasher>();
+    case HashAlgorithm::MD5: return std::make_unique<Md5Hasher>();
+    case HashAlgorithm::SHA1: return std::make_unique<Sha1Hasher>();
+    case HashAlgorithm::SHA256: return std::make_unique<Sha256Hasher>();
+  }
+  return nullptr;
+}
+
+std::optional<std::string> hashFile(fs::path const& path,
+                                    HashAlgorithm algorithm, uint64_t offset,
+                                    uint64_t length) {
+  std::ifstream file(path, std::ios::in | std::ios::binary);
+  if (offset > 0) {
+    file.seekg(static_cast<std::streamoff>(offset));
+  }
+  if (!file.is_open() || !file.good()) {
+    return std::nullopt;
+  }
+  std::unique_ptr<Hasher> hasher = Hasher::create(algorithm);
+  BufferPool::buffer_ptr buffer = BufferPool::instance().acquire(1 << 20);
+  while (length > 0 && file.good()) {
+    file.read(buffer->data(),
+              static_cast<std::streamsize>(
+                  std::min<uint64_t>(length, buffer->size())));
+    auto nbRead = static_cast<std::size_t>(file.gcount());
+    hasher->update(buffer->data(), nbRead);
+    if (length != kToEndOfFile) {
+      length -= nbRead;
+    }
+  }
+  if (file.bad()) {
+    return std::nullopt;
+  }
+  return hasher->finish();
+}
+
+#if defined(__unix__)
+FileHasher::FileHasher(int fd, HashAlgorithm algorithm, uint64_t offset,
+                       uint64_t length)
+    : fd_(fd),
+      hasher_(Hasher::create(algorithm)),
+      offset_(offset),
+      remaining_(length),
+      failed_(false) {}
+
+bool FileHasher::step(std::size_t maxBytes) {
+  if (remaining_ == 0 || failed_) {
+    return false;
+  }
+  BufferPool::buffer_ptr buffer = BufferPool::instance().acquire(
+      static_cast<std::size_t>(std::min<uint64_t>(remaining_, maxBytes)));
+  std::size_t filled = 0;
+  while (filled < buffer->size()) {
+    ssize_t nbRead = ::pread(fd_, buffer->data() + filled,
+                             buffer->size() - filled,
+                             static_cast<off_t>(offset_ + filled));
+    if (nbRead < 0 && errno == EINTR) {
+      continue;
+    } else if (nbRead < 0) {
+      failed_ = true;
+      return false;
+    } else if (nbRead == 0) {
+      // The file got shorter since its size was taken
+      remaining_ = filled;
+      break;
+    }
+    filled += static_cast<std::size_t>(nbRead);
+  }
+  hasher_->update(buffer->data(), filled);
+  offset_ += filled;
+  remaining_ -= filled;
+  return remaining_ > 0;
+}
+
+std::optional<std::string> FileHasher::finish() {
+  if (failed_) {
+    return std::nullopt;
+  }
+  return hasher_->finish();
+}
+#endif
@@ -0,0 +1,63 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+
+namespace fs = std::filesystem;
+
+// Checksums served by HASH (draft-bryan-ftp-hash) and XCRC/XMD5/XSHA1/
+// XSHA256. CRC32C and SHA-256 use SSE4.2 and SHA-NI when the CPU has them.
+enum class HashAlgorithm { CRC32 = 0, CRC32C, MD5, SHA1, SHA256 };
+static constexpr std::size_t kNbHashAlgorithms = 5;
+
+// Names as HASH and FEAT spell them, "SHA-256" and so on
+std::string_view hashAlgorithmName(HashAlgorithm algorithm);
+// Case insensitive inverse of hashAlgorithmName
+std::optional<HashAlgorithm> parseHashAlgorithm(std::string_view name);
+
+// Digest computed over data handed in piece by piece
+class Hasher {
+ public:
+  static std::unique_ptr<Hasher> create(HashAlgorithm algorithm);
+  virtual ~Hasher() = default;
+
+  virtual void update(void const* data, std::size_t length) = 0;
+  // Lower case hex digest. Nothing may be added afterwards.
+  virtual std::string finish() = 0;
+};
+
+static constexpr uint64_t kToEndOfFile = std::numeric_limits<uint64_t>::max();
+
+// Digest of length bytes of the file from offset on, or of everything from
+// offset on with kToEndOfFile. Nothing if the file cannot be read.
+std::optional<std::string> hashFile(fs::path const& path,
+                                    HashAlgorithm algorithm, uint64_t offset,
+                                    uint64_t length = kToEndOfFile);
+
+#if defined(__unix__)
+// Digest of length bytes of the open file fd from offset on, read a piece
+// at a time so that hashing a large file can take turns with other work.
+// fd stays the caller's and must be open until the digest is finished.
+class FileHasher {
+ public:
+  FileHasher(int fd, HashAlgorithm algorithm, uint64_t offset,
+             uint64_t length);
+
+  // Hashes up to maxBytes more, true while there is more to hash
+  bool step(std::size_t maxBytes);
+  // Nothing if the file could not be read
+  std::optional<std::string> finish();
+
+ private:
+  int const fd_;
+  std::unique_ptr<Hasher> hasher_;
+  uint64_t offset_;
+  uint64_t remaining_;
+  bool failed_;
+};
+#endif
@@ -0,0 +1,56 @@
+#pragma once
+#if defined(__unix__)
+#include <experimental/net>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <string>
+
+namespace net = std::experimental::net;
+
+// Unix domain stream sockets, which the networking TS leaves out. Only what
+// an acceptor bound to a path needs.
+class LocalStream {
+ public:
+  class Endpoint {
+   public:
+    using protocol_type = LocalStream;
+
+    Endpoint() : size_(offsetof(sockaddr_un, sun_path)) {
+      std::memset(&addr_, 0, sizeof(addr_));
+      addr_.sun_family = AF_UNIX;
+    }
+    // Paths longer than sun_path are cut short
+    explicit Endpoint(std::string const& path) : Endpoint() {
+      std::size_t length = std::min(path.size(), sizeof(addr_.sun_path) - 1);
+      std::memcpy(addr_.sun_path, path.data(), length);
+      size_ = offsetof(sockaddr_un, sun_path) + length + 1;
+    }
+
+    protocol_type protocol() const { return protocol_type(); }
+    sockaddr* data() { return reinterpret_cast<sockaddr*>(&addr_); }
+    sockaddr const* data() const {
+      return reinterpret_cast<sockaddr const*>(&addr_);
+    }
+    std::size_t size() const { return size_; }
+    void resize(std::size_t size) { size_ = std::min(size, sizeof(addr_)); }
+    std::size_t capacity() const { return sizeof(addr_); }
+
+   private:
+    sockaddr_un addr_;
+    std::size_t size_;
+  };
+
+  using endpoint = Endpoint;
+  using socket = net::basic_stream_socket<LocalStream>;
+  using acceptor = net::basic_socket_acceptor<LocalStream>;
+
+  int family() const { return AF_UNIX; }
+  int type() const { return SOCK_STREAM; }
+  int protocol() const { return 0; }
+};
+#endif
@@ -0,0 +1,225 @@
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <ctime>
+
+#include "Logger.hpp"
+
+static constexpr auto kFlushInterval = std::chrono::milliseconds(20);
+
+static char const* const kLevelNames[] = {"DEBUG", "INFO ", "WARN ", "ERROR"};
+
+Logger& Logger::instance() {
+  // Never destroyed, so objects destroyed after it can still log. The writer
+  // is stopped at exit instead, once everything logged so far is written.
+  static Logger* logger = new Logger();
+  static struct Stopper {
+    ~Stopper() { logger->stop(); }
+  } stopper;
+  return *logger;
+}
+
+Logger::Logger()
+    : level_(FTP_LOG_MIN_LEVEL),
+      output_(stdout),
+      stopping_(false),
+      stopped_(false),
+      writer_([this]() { writerLoop(); }) {}
+
+bool Logger::setOutput(std::string const& path) {
+  std::FILE* file = std::fopen(path.c_str(), "a");
+  if (!file) {
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(outputMutex_);
+  if (output_ != stdout) {
+    std::fclose(output_);
+  }
+  output_ = file;
+  return true;
+}
+
+Logger::Ring& Logger::threadRing() {
+  thread_local Ring* ring = nullptr;
+  if (!ring) {
+    // Rings outlive their threads: the writer may still be reading one
+    std::lock_guard<std::mutex> lock(ringsMutex_);
+    rings_.push_back(
+        std::make_unique<Ring>(static_cast<unsigned>(rings_.size())));
+    ring = rings_.back().get();
+  }
+  return *ring;
+}
+
+void Logger::push(LogLevel level, char const* text, std::size_t length) {
+  int64_t time = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                     std::chrono::system_clock::now().time_since_epoch())
+                     .count();
+  length = std::min(length, kMaxLineSize);
+  Ring& ring = threadRing();
+  if (stopped_.load(std::memory_order_acquire)) {
+    std::string line;
+    format(line, time, level, ring.threadNo, std::string_view(text, length));
+    write(line);
+    return;
+  }
+  uint64_t tail = ring.tail.load(std::memory_order_relaxed);
+  if (tail - ring.head.load(std::memory_order_acquire) >= kRingSize) {
+    ring.dropped.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  Record& record = ring.records[tail % kRingSize];
+  record.time = time;
+  record.level = level;
+  record.length = static_cast<uint16_t>(length);
+  std::copy(text, text + length, record.text);
+  ring.tail.store(tail + 1, std::memory_order_release);
+}
+
+void Logger::stop() {
+  {
+    std::lock_guard<std::mutex> lock(wakeMutex_);
+    if (stopping_.exchange(true)) {
+      return;
+    }
+  }
+  wake_.notify_one();
+  writer_.join();
+  stopped_.store(true, std::memory_order_release);
+  // Lines pushed while the writer was finishing
+  std::string rest;
+  drain(rest);
+  write(rest);
+}
+
+void Logger::writerLoop() {
+  std::string batch;
+  for (;;) {
+    bool stopping = stopping_.load();
+    drain(batch);
+    write(batch);
+    batch.clear();
+    if (stopping) {
+      return;
+    }
+    std::unique_lock<std::mutex> lock(wakeMutex_);
+    wake_.wait_for(lock, kFlushInterval, [this]() { return stopping_.load(); });
+  }
+}
+
+void Logger::drain(std::string& out) {
+  struct Line {
+    int64_t time;
+    std::string text;
+  };
+  std::vector<Line> lines;
+  {
+    std::lock_guard<std::mutex> lock(ringsMutex_);
+    for (auto& ring : rings_) {
+      uint64_t head = ring->head.load(std::memory_order_relaxed);
+      uint64_t tail = ring->tail.load(std::memory_order_acquire);
+      for (; head != tail; ++head) {
+        Record const& record = ring->records[head % kRingSize];
+        Line& line = lines.emplace_back(Line{record.time, std::string()});
+        format(line.text, record.time, record.level, ring->threadNo,
+               std::string_view(record.text, record.length));
+      }
+      ring->head.store(head, std::memory_order_release);
+      if (uint64_t dropped = ring->dropped.exchange(0); dropped > 0) {
+        std::string note = std::to_string(dropped) + " log lines dropped";
+        int64_t time = lines.empty() ? 0 : lines.back().time;
+        Line& line = lines.emplace_back(Line{time, std::string()});
+        format(line.text, time, LogLevel::WARN, ring->threadNo, note);
+      }
+    }
+  }
+  // Every ring is in order, interleave them
+  std::stable_sort(
+      lines.begin(), lines.end(),
+      [](Line const& a, Line const& b) { return a.time < b.time; });
+  for (Line const& line : lines) {
+    out += line.text;
+  }
+}
+
+void Logger::write(std::string const& text) {
+  if (text.empty()) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(outputMutex_);
+  std::fwrite(text.data(), 1, text.size(), output_);
+  std::fflush(output_);
+}
+
+void Logger::format(std::string& out, int64_t time, LogLevel level,
+                    unsigned threadNo, std::string_view text) {
+  std::time_t seconds = static_cast<std::time_t>(time / 1000000000);
+  std::tm local{};
+#if defined(_WIN32)
+  localtime_s(&local, &seconds);
+#else
+  localtime_r(&seconds, &local);
+#endif
+  char prefix[48];
+  int length = std::snprintf(
+      prefix, sizeof(prefix), "%02d:%02d:%02d.%03d %s [%u] ", local.tm_hour,
+      local.tm_min, local.tm_sec, static_cast<int>(time / 1000000 % 1000),
+      kLevelNames[static_cast<int>(level)], threadNo);
+  out.append(prefix, static_cast<std::size_t>(std::max(length, 0)));
+  // Replies end with CRLF already
+  while (!text.empty() && (text.back() == '\n' || text.back() == '\r')) {
+    text.remove_suffix(1);
+  }
+  out.append(text);
+  out += '\n';
+}
+
+bool LogRateLimiter::allow(uint64_t& suppressed) {
+  int64_t now = std::chrono::duration_cast<std::chrono::seconds>(
+                    std::chrono::steady_clock::now().time_since_epoch())
+                    .count();
+  int64_t second = second_.load(std::memory_order_relaxed);
+  if (second != now &&
+      second_.compare_exchange_strong(second, now, std::memory_order_relaxed)) {
+    lines_.store(0, std::memory_order_relaxed);
+  }
+  if (lines_.fetch_add(1, std::memory_order_relaxed) < kLinesPerSecond) {
+    suppressed = suppressed_.exchange(0, std::memory_order_relaxed);
+    return true;
+  }
+  suppressed_.fetch_add(1, std::memory_order_relaxed);
+  return false;
+}
+
+LogLine::~LogLine() {
+  if (suppressed_ > 0) {
+    *this << " (" << suppressed_ << " similar lines suppressed)";
+  }
+  Logger::instance().push(level_, text_, length_);
+}
+
+LogLine& LogLine::operator<<(std::string_view text) {
+  std::size_t length = std::min(text.size(), sizeof(text_) - length_);
+  std::copy(text.data(), text.data() + length, text_ + length_);
+  length_ += length;
+  return *this;
+}
+
+LogLine& LogLine::operator<<(double value) {
+  char text[32];
+  int length = std::snprintf(text, sizeof(text), "%g", value);
+  return *this << std::string_view(text, static_cast<std::size_t>(
+                                             std::max(length, 0)));
+}
+
+LogLine& LogLine::appendInteger(int64_t value) {
+  char text[24];
+  auto result = std::to_chars(text, text + sizeof(text), value);
+  return *this << std::string_view(text, result.ptr - text);
+}
+
+LogLine& LogLine::appendInteger(uint64_t value) {
+  char text[24];
+  auto result = std::to_chars(text, text + sizeof(text), value);
+  return *this << std::string_view(text, result.ptr - text);
+}
@@ -0,0 +1,179 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+// ERR rather than ERROR, which <windows.h> defines as a macro
+enum class LogLevel : int { DEBUG, INFO, WARN, ERR, OFF };
+
+// Levels below this one are compiled out. The command and reply trace is
+// DEBUG, so release builds leave it out unless built with e.g.
+// -DFTP_LOG_MIN_LEVEL=0.
+#if !defined(FTP_LOG_MIN_LEVEL)
+#if defined(NDEBUG)
+#define FTP_LOG_MIN_LEVEL 1
+#else
+#define FTP_LOG_MIN_LEVEL 0
+#endif
+#endif
+
+// Log lines are formatted on the calling thread into its own ring buffer,
+// which only that thread writes and only the writer thread reads, so
+// logging takes no lock and never waits for the output. A full ring drops
+// the line and counts it instead. The writer thread wakes up every few
+// milliseconds and writes what the rings hold in one go.
+class Logger {
+ public:
+  static constexpr std::size_t kMaxLineSize = 240;
+  static constexpr std::size_t kRingSize = 512;
+
+  static Logger& instance();
+
+  Logger(Logger const&) = delete;
+  Logger& operator=(Logger const&) = delete;
+
+  // Lines below level are skipped at run time
+  void setLevel(LogLevel level) {
+    level_.store(static_cast<int>(level), std::memory_order_relaxed);
+  }
+  bool enabled(LogLevel level) const {
+    return static_cast<int>(level) >= level_.load(std::memory_order_relaxed);
+  }
+  // Appends to the file at path instead of the standard output
+  bool setOutput(std::string const& path);
+
+  void push(LogLevel level, char const* text, std::size_t length);
+  // Writes everything logged so far and stops the writer thread; later
+  // lines are written right away by the thread logging them
+  void stop();
+
+ private:
+  struct Record {
+    int64_t time;  // nanoseconds since the epoch
+    LogLevel level;
+    uint16_t length;
+    char text[kMaxLineSize];
+  };
+  struct Ring {
+    explicit Ring(unsigned threadNo) : threadNo(threadNo) {}
+    unsigned const threadNo;
+    std::array<Record, kRingSize> records;
+    alignas(64) std::atomic<uint64_t> head{0};  // next record to read
+    alignas(64) std::atomic<uint64_t> tail{0};  // next record to write
+    std::atomic<uint64_t> dropped{0};
+  };
+
+  Logger();
+  ~Logger() = delete;
+
+  Ring& threadRing();
+  void writerLoop();
+  // Moves what the rings hold into out, oldest first
+  void drain(std::string& out);
+  void write(std::string const& text);
+  static void format(std::string& out, int64_t time, LogLevel level,
+                     unsigned threadNo, std::string_view text);
+
+  std::atomic<int> level_;
+  std::mutex ringsMutex_;
+  std::vector<std::unique_ptr<Ring>> rings_;
+
+  std::mutex outputMutex_;
+  std::FILE* output_;
+  std::atomic<bool> stopping_;
+  std::atomic<bool> stopped_;
+  std::mutex wakeMutex_;
+  std::condition_variable wake_;
+  std::thread writer_;
+};
+
+// Lets a few lines a second through, counting the ones it holds back so
+// the next line let through can say how many there were
+class LogRateLimiter {
+ public:
+  static constexpr uint32_t kLinesPerSecond = 10;
+
+  bool allow(uint64_t& suppressed);
+
+ private:
+  std::atomic<int64_t> second_{0};
+  std::atomic<uint32_t> lines_{0};
+  std::atomic<uint64_t> suppressed_{0};
+};
+
+// One log line, pushed to the logger when destroyed. Only formats what the
+// server logs: text, integers, floating point numbers and characters.
+class LogLine {
+ public:
+  explicit LogLine(LogLevel level, uint64_t suppressed = 0)
+      : level_(level), length_(0), suppressed_(suppressed) {}
+  ~LogLine();
+  LogLine(LogLine const&) = delete;
+  LogLine& operator=(LogLine const&) = delete;
+
+  LogLine& operator<<(std::string_view text);
+  LogLine& operator<<(char const* text) {
+    return *this << std::string_view(text);
+  }
+  LogLine& operator<<(std::string const& text) {
+    return *this << std::string_view(text);
+  }
+  LogLine& operator<<(char c) { return *this << std::string_view(&c, 1); }
+  LogLine& operator<<(double value);
+  template <typename T,
+            typename = std::enable_if_t<std::is_integral_v<T> &&
+                                        !std::is_same_v<T, char> &&
+                                        !std::is_same_v<T, bool>>>
+  LogLine& operator<<(T value) {
+    if constexpr (std::is_signed_v<T>) {
+      return appendInteger(static_cast<int64_t>(value));
+    } else {
+      return appendInteger(static_cast<uint64_t>(value));
+    }
+  }
+
+ private:
+  LogLine& appendInteger(int64_t value);
+  LogLine& appendInteger(uint64_t value);
+
+  LogLevel const level_;
+  std::size_t length_;
+  uint64_t const suppressed_;
+  char text_[Logger::kMaxLineSize];
+};
+
+#define FTP_LOG(level, expr)                                                   \
+  do {                                                                         \
+    if constexpr (static_cast<int>(level) >= FTP_LOG_MIN_LEVEL) {              \
+      if (Logger::instance().enabled(level)) {                                 \
+        LogLine(level) << expr;                                                \
+      }                                                                        \
+    }                                                                          \
+  } while (0)
+
+#define FTP_LOG_DEBUG(expr) FTP_LOG(LogLevel::DEBUG, expr)
+#define FTP_LOG_INFO(expr) FTP_LOG(LogLevel::INFO, expr)
+#define FTP_LOG_WARN(expr) FTP_LOG(LogLevel::WARN, expr)
+// Errors often come in floods, a client dropping every data connection for
+// instance, so each call site is rate limited on its own
+#define FTP_LOG_ERROR(expr)                                                    \
+  do {                                                                         \
+    if constexpr (static_cast<int>(LogLevel::ERR) >= FTP_LOG_MIN_LEVEL) {      \
+      static LogRateLimiter ftpLogLimiter;                                     \
+      uint64_t ftpLogSuppressed = 0;                                           \
+      if (Logger::instance().enabled(LogLevel::ERR) &&                         \
+          ftpLogLimiter.allow(ftpLogSuppressed)) {                             \
+        LogLine(LogLevel::ERR, ftpLogSuppressed) << expr;                      \
+      }                                                                        \
+    }                                                                          \
+  } while (0)
@@ -0,0 +1,288 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <sstream>
+
+#include "BufferPool.hpp"
+#include "DigestCache.hpp"
+#include "DirListingCache.hpp"
+#include "FTPSession.hpp"
+#include "Metrics.hpp"
+
+static char const* const kDataPathNames[] = {"sendfile", "splice", "stream",
+                                             "listing"};
+
+Metrics& Metrics::instance() {
+  static Metrics metrics;
+  return metrics;
+}
+
+Metrics::Metrics() : start_(std::chrono::steady_clock::now()) {}
+
+Metrics::~Metrics() {
+  for (auto& slot : commands_) {
+    delete slot.load();
+  }
+}
+
+std::size_t Metrics::shard() {
+  static std::atomic<std::size_t> nextShard(0);
+  thread_local std::size_t const idx = nextShard++ % kNbShards;
+  return idx;
+}
+
+int64_t Metrics::Counter::value() const {
+  int64_t total = 0;
+  for (auto const& slot : slots_) {
+    total += slot.value.load(std::memory_order_relaxed);
+  }
+  return total;
+}
+
+std::size_t Metrics::Histogram::bucketIndex(uint64_t value) {
+  value = std::min(value, (uint64_t(1) << kMaxValueBits) - 1);
+  if (value < kSubBuckets) {
+    return static_cast<std::size_t>(value);
+  }
+  unsigned msb = 0;
+  for (uint64_t v = value; v > 1; v >>= 1) {
+    ++msb;
+  }
+  unsigned shift = msb - kSubBucketBits;
+  return (shift + 1) * kSubBuckets + static_cast<std::size_t>(value >> shift) -
+         kSubBuckets;
+}
+
+uint64_t Metrics::Histogram::bucketUpperBound(std::size_t idx) {
+  if (idx < kSubBuckets) {
+    return idx;
+  }
+  std::size_t shift = idx / kSubBuckets - 1;
+  uint64_t subBucket = idx % kSubBuckets + kSubBuckets;
+  return ((subBucket + 1) << shift) - 1;
+}
+
+void Metrics::Histogram::record(uint64_t value) {
+  Shard& shard = shards_[Metrics::shard()];
+  shard.buckets[bucketIndex(value)].fetch_add(1, std::memory_order_relaxed);
+  shard.sum.fetch_add(value, std::memory_order_relaxed);
+}
+
+Metrics::Histogram::Snapshot Metrics::Histogram::snapshot() const {
+  Snapshot snapshot{std::vector<uint64_t>(kNbBuckets, 0), 0, 0};
+  for (auto const& shard : shards_) {
+    for (std::size_t i = 0; i < kNbBuckets; ++i) {
+      uint64_t count = shard.buckets[i].load(std::memory_order_relaxed);
+      snapshot.buckets[i] += count;
+      snapshot.count += count;
+    }
+    snapshot.sum += shard.sum.load(std::memory_order_relaxed);
+  }
+  return snapshot;
+}
+
+uint64_t Metrics::Histogram::Snapshot::percentile(double fraction) const {
+  if (count == 0) {
+    return 0;
+  }
+  auto rank = static_cast<uint64_t>(std::ceil(fraction * count));
+  uint64_t seen = 0;
+  for (std::size_t i = 0; i < buckets.size(); ++i) {
+    seen += buckets[i];
+    if (seen >= std::max<uint64_t>(rank, 1)) {
+      return bucketUpperBound(i);
+    }
+  }
+  return bucketUpperBound(buckets.size() - 1);
+}
+
+Metrics::Histogram& Metrics::commandLatency(uint64_t key) {
+  // Fibonacci hashing of the packed command name
+  auto idx = static_cast<std::size_t>((key * 0x9E3779B97F4A7C15ull) >> 57);
+  for (std::size_t probe = 0; probe < kNbCommandSlots; ++probe) {
+    auto& slot = commands_[(idx + probe) % kNbCommandSlots];
+    CommandEntry* entry = slot.load(std::memory_order_acquire);
+    if (!entry) {
+      auto* created = new CommandEntry(key);
+      if (slot.compare_exchange_strong(entry, created,
+                                       std::memory_order_acq_rel)) {
+        return created->latency;
+      }
+      // Another thread got the slot first, entry now holds its value
+      delete created;
+    }
+    if (entry->key == key) {
+      return entry->latency;
+    }
+  }
+  return overflow_;
+}
+
+// The packed key back to the command name
+static std::string commandName(uint64_t key) {
+  std::string name;
+  for (; key != 0; key >>= 8) {
+    name.insert(name.begin(), static_cast<char>(key & 0xff));
+  }
+  return name;
+}
+
+static std::string formatDuration(uint64_t ns) {
+  char text[32];
+  if (ns < 1000) {
+    std::snprintf(text, sizeof(text), "%lluns",
+                  static_cast<unsigned long long>(ns));
+  } else if (ns < 1000000) {
+    std::snprintf(text, sizeof(text), "%.1fus", ns / 1e3);
+  } else if (ns < 1000000000) {
+    std::snprintf(text, sizeof(text), "%.1fms", ns / 1e6);
+  } else {
+    std::snprintf(text, sizeof(text), "%.2fs", ns / 1e9);
+  }
+  return text;
+}
+
+std::string Metrics::statusReport() const {
+  double uptime = std::chrono::duration<double>(
+                      std::chrono::steady_clock::now() - start_)
+                      .count();
+  int64_t bytesIn = 0;
+  int64_t bytesOut = 0;
+  for (std::size_t i = 0; i < kNbDataPaths; ++i) {
+    bytesIn += bytesIn_[i].value();
+    bytesOut += bytesOut_[i].value();
+  }
+  std::ostringstream out;
+  out << " Sessions: " << sessions_.value() << " active, "
+      << accepted_.value() << " accepted ("
+      << (uptime > 0.0 ? accepted_.value() / uptime : 0.0) << "/s), "
+      << refused_.value() << " refused\r\n"
+      << " Transfers: " << transfers_.value() << " active, " << bytesIn
+      << " bytes in, " << bytesOut << " bytes out\r\n"
+      << " Buffers: " << BufferPool::instance().stats().inUseBytes
+      << " bytes in use\r\n"
+      << " Command latency (count p50 p99 p99.9):\r\n";
+  for (auto const& slot : commands_) {
+    CommandEntry const* entry = slot.load(std::memory_order_acquire);
+    if (!entry) {
+      continue;
+    }
+    Histogram::Snapshot latency = entry->latency.snapshot();
+    out << "  " << commandName(entry->key) << ' ' << latency.count << ' '
+        << formatDuration(latency.percentile(0.5)) << ' '
+        << formatDuration(latency.percentile(0.99)) << ' '
+        << formatDuration(latency.percentile(0.999)) << "\r\n";
+  }
+  if (int64_t unknown = unknownCommands_.value(); unknown > 0) {
+    out << " Unknown commands: " << unknown << "\r\n";
+  }
+  return out.str();
+}
+
+static void writeHistogram(std::ostream& out, std::string const& command,
+                           Metrics::Histogram::Snapshot const& latency) {
+  using Histogram = Metrics::Histogram;
+  // Buckets at every other power of two from 1 us, which are bucket
+  // boundaries of the histogram as well
+  uint64_t cumulative = 0;
+  std::size_t idx = 0;
+  for (unsigned bits = 10; bits <= Histogram::kMaxValueBits; bits += 2) {
+    std::size_t end = Histogram::bucketIndex(uint64_t(1) << bits);
+    if (bits == Histogram::kMaxValueBits) {
+      end = Histogram::kNbBuckets;
+    }
+    for (; idx < end; ++idx) {
+      cumulative += latency.buckets[idx];
+    }
+    out << "ftp_command_duration_seconds_bucket{command=\"" << command
+        << "\",le=\"" << static_cast<double>(uint64_t(1) << bits) / 1e9
+        << "\"} " << cumulative << '\n';
+  }
+  out << "ftp_command_duration_seconds_bucket{command=\"" << command
+      << "\",le=\"+Inf\"} " << latency.count << '\n'
+      << "ftp_command_duration_seconds_count{command=\"" << command << "\"} "
+      << latency.count << '\n'
+      << "ftp_command_duration_seconds_sum{command=\"" << command << "\"} "
+      << latency.sum / 1e9 << '\n';
+}
+
+std::string Metrics::openMetrics() const {
+  std::ostringstream out;
+  auto metric = [&out](char const* name, char const* type, char const* help) {
+    out << "# TYPE " << name << ' ' << type << '\n'
+        << "# HELP " << name << ' ' << help << '\n';
+  };
+
+  metric("ftp_connections_accepted", "counter", "Control connections accepted");
+  out << "ftp_connections_accepted_total " << accepted_.value() << '\n';
+  metric("ftp_connections_refused", "counter",
+         "Control connections closed by admission control");
+  out << "ftp_connections_refused_total " << refused_.value() << '\n';
+  metric("ftp_sessions_active", "gauge", "Sessions alive");
+  out << "ftp_sessions_active " << sessions_.value() << '\n';
+  metric("ftp_transfers_active", "gauge", "Data connections in use");
+  out << "ftp_transfers_active " << transfers_.value() << '\n';
+  metric("ftp_commands_unknown", "counter", "Unrecognized commands");
+  out << "ftp_commands_unknown_total " << unknownCommands_.value() << '\n';
+
+  metric("ftp_data_bytes", "counter", "Bytes moved on data connections");
+  out << "# UNIT ftp_data_bytes bytes\n";
+  for (std::size_t i = 0; i < kNbDataPaths; ++i) {
+    out << "ftp_data_bytes_total{path=\"" << kDataPathNames[i]
+        << "\",direction=\"in\"} " << bytesIn_[i].value() << '\n'
+        << "ftp_data_bytes_total{path=\"" << kDataPathNames[i]
+        << "\",direction=\"out\"} " << bytesOut_[i].value() << '\n';
+  }
+
+  metric("ftp_command_duration_seconds", "histogram",
+         "Time spent handling a command");
+  out << "# UNIT ftp_command_duration_seconds seconds\n";
+  for (auto const& slot : commands_) {
+    if (CommandEntry const* entry = slot.load(std::memory_order_acquire)) {
+      writeHistogram(out, commandName(entry->key), entry->latency.snapshot());
+    }
+  }
+  if (Histogram::Snapshot other = overflow_.snapshot(); other.count > 0) {
+    writeHistogram(out, "other", other);
+  }
+
+  BufferPool::Stats buffers = BufferPool::instance().stats();
+  metric("ftp_buffer_pool_hits", "counter", "Buffers reused from the pool");
+  out << "ftp_buffer_pool_hits_total " << buffers.hits << '\n';
+  metric("ftp_buffer_pool_misses", "counter", "Buffers newly allocated");
+  out << "ftp_buffer_pool_misses_total " << buffers.misses << '\n';
+  metric("ftp_buffer_pool_in_use_bytes", "gauge", "Buffer bytes in use");
+  out << "ftp_buffer_pool_in_use_bytes " << buffers.inUseBytes << '\n';
+  metric("ftp_buffer_pool_high_water_bytes", "gauge",
+         "Most buffer bytes ever in use at once");
+  out << "ftp_buffer_pool_high_water_bytes " << buffers.highWaterBytes << '\n';
+  metric("ftp_buffer_pool_pooled_bytes", "gauge", "Buffer bytes kept free");
+  out << "ftp_buffer_pool_pooled_bytes " << buffers.pooledBytes << '\n';
+
+  DirListingCache::Stats listings = DirListingCache::instance().stats();
+  metric("ftp_listing_cache_hits", "counter", "Listings served from cache");
+  out << "ftp_listing_cache_hits_total " << listings.hits << '\n';
+  metric("ftp_listing_cache_misses", "counter", "Listings rendered");
+  out << "ftp_listing_cache_misses_total " << listings.misses << '\n';
+  metric("ftp_listing_cache_invalidations", "counter",
+         "Cached listings dropped after a change");
+  out << "ftp_listing_cache_invalidations_total " << listings.invalidations
+      << '\n';
+  metric("ftp_listing_cache_bytes", "gauge", "Bytes of cached listings");
+  out << "ftp_listing_cache_bytes " << listings.bytes << '\n';
+
+  DigestCache::Stats digests = DigestCache::instance().stats();
+  metric("ftp_digest_cache_hits", "counter", "Digests served from cache");
+  out << "ftp_digest_cache_hits_total " << digests.hits << '\n';
+  metric("ftp_digest_cache_misses", "counter", "Digests computed");
+  out << "ftp_digest_cache_misses_total " << digests.misses << '\n';
+
+  FTPSession::ReplyWriteStats replies = FTPSession::replyWriteStats();
+  metric("ftp_reply_writes", "counter", "Writes on control connections");
+  out << "ftp_reply_writes_total " << replies.writes << '\n';
+  metric("ftp_replies", "counter", "Replies sent");
+  out << "ftp_replies_total " << replies.replies << '\n';
+
+  out << "# EOF\n";
+  return out.str();
+}
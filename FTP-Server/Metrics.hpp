@@ -0,0 +1,132 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Server-wide counters and latency histograms. Every thread updates its own
+// shard, so the hot paths never share a cache line; readers add the shards
+// up, which makes a snapshot approximate but never torn per shard.
+class Metrics {
+ public:
+  static constexpr std::size_t kNbShards = 8;
+
+  class Counter {
+   public:
+    Counter() = default;
+    Counter(Counter const&) = delete;
+    Counter& operator=(Counter const&) = delete;
+
+    // Gauges are counters going both ways
+    void add(int64_t delta) {
+      slots_[shard()].value.fetch_add(delta, std::memory_order_relaxed);
+    }
+    int64_t value() const;
+
+   private:
+    struct alignas(64) Slot {
+      std::atomic<int64_t> value{0};
+    };
+    std::array<Slot, kNbShards> slots_;
+  };
+
+  // Log-linear buckets as in HdrHistogram: 16 per power of two, so a value
+  // is known to within 1/16 of itself, up to 2^40 ns (about 18 minutes).
+  class Histogram {
+   public:
+    static constexpr unsigned kSubBucketBits = 4;
+    static constexpr unsigned kSubBuckets = 1u << kSubBucketBits;
+    static constexpr unsigned kMaxValueBits = 40;
+    static constexpr std::size_t kNbBuckets =
+        (kMaxValueBits - kSubBucketBits + 1) * kSubBuckets;
+
+    struct Snapshot {
+      std::vector<uint64_t> buckets;
+      uint64_t count;
+      uint64_t sum;
+      // Upper bound of the bucket holding that fraction of the values
+      uint64_t percentile(double fraction) const;
+    };
+
+    Histogram() = default;
+    Histogram(Histogram const&) = delete;
+    Histogram& operator=(Histogram const&) = delete;
+
+    void record(uint64_t value);
+    Snapshot snapshot() const;
+
+    static std::size_t bucketIndex(uint64_t value);
+    // Largest value that falls in bucket idx
+    static uint64_t bucketUpperBound(std::size_t idx);
+
+   private:
+    struct alignas(64) Shard {
+      std::array<std::atomic<uint64_t>, kNbBuckets> buckets{};
+      std::atomic<uint64_t> sum{0};
+    };
+    std::array<Shard, kNbShards> shards_;
+  };
+
+  enum class DataPath { SENDFILE, SPLICE, STREAM, LISTING };
+  static constexpr std::size_t kNbDataPaths = 4;
+
+  static Metrics& instance();
+
+  virtual ~Metrics();
+  Metrics(Metrics const&) = delete;
+  Metrics& operator=(Metrics const&) = delete;
+
+  // Latency of the command packed in key, created on first use
+  Histogram& commandLatency(uint64_t key);
+
+  void connectionAccepted() { accepted_.add(1); }
+  // Accepted, then closed at once by admission control
+  void connectionRefused() { refused_.add(1); }
+  void sessionStarted() { sessions_.add(1); }
+  void sessionEnded() { sessions_.add(-1); }
+  void transferStarted() { transfers_.add(1); }
+  void transferEnded() { transfers_.add(-1); }
+  void unknownCommand() { unknownCommands_.add(1); }
+  void bytesSent(DataPath path, std::size_t bytes) {
+    bytesOut_[static_cast<std::size_t>(path)].add(
+        static_cast<int64_t>(bytes));
+  }
+  void bytesReceived(DataPath path, std::size_t bytes) {
+    bytesIn_[static_cast<std::size_t>(path)].add(static_cast<int64_t>(bytes));
+  }
+
+  // STAT reply body: one line per command seen, then the counters
+  std::string statusReport() const;
+  // Everything above and the pools and caches in the OpenMetrics text format
+  std::string openMetrics() const;
+
+ private:
+  static constexpr std::size_t kNbCommandSlots = 128;
+  struct CommandEntry {
+    explicit CommandEntry(uint64_t cmdKey) : key(cmdKey) {}
+    uint64_t const key;
+    Histogram latency;
+  };
+
+  Metrics();
+  // This thread's shard, handed out in turn on first use
+  static std::size_t shard();
+
+  // Open addressing without removal: an entry is published with a single
+  // compare-and-swap and stays in its slot until the server exits.
+  std::array<std::atomic<CommandEntry*>, kNbCommandSlots> commands_{};
+  // Commands that found the table full
+  Histogram overflow_;
+
+  std::chrono::steady_clock::time_point const start_;
+  Counter accepted_;
+  Counter refused_;
+  Counter sessions_;
+  Counter transfers_;
+  Counter unknownCommands_;
+  std::array<Counter, kNbDataPaths> bytesIn_;
+  std::array<Counter, kNbDataPaths> bytesOut_;
+};
@@ -0,0 +1,364 @@
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+
+#if defined(__linux__)
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <atomic>
+#if __has_include(<linux/openat2.h>)
+#include <linux/openat2.h>
+#endif
+#endif
+
+#include "RootDir.hpp"
+#include "Logger.hpp"
+
+#if defined(__linux__)
+namespace {
+
+// A descriptor from openBeneath or openParent, which may be the root
+class Descriptor {
+ public:
+  Descriptor(int fd, int rootFd) : fd_(fd), owned_(fd >= 0 && fd != rootFd) {}
+  ~Descriptor() {
+    if (owned_) {
+      ::close(fd_);
+    }
+  }
+  Descriptor(Descriptor const&) = delete;
+  Descriptor& operator=(Descriptor const&) = delete;
+
+  int get() const { return fd_; }
+
+ private:
+  int const fd_;
+  bool const owned_;
+};
+
+}  // namespace
+
+// Cleared when the kernel turns out to be older than openat2 (5.6)
+static std::atomic<bool> haveOpenat2(true);
+
+// Set once reopening through /proc has failed and been logged
+static std::atomic<bool> procMissing(false);
+
+static std::error_code lastError() {
+  return std::error_code(errno, std::generic_category());
+}
+
+static fs::file_type fileType(mode_t mode) {
+  if (S_ISREG(mode)) return fs::file_type::regular;
+  if (S_ISDIR(mode)) return fs::file_type::directory;
+  if (S_ISLNK(mode)) return fs::file_type::symlink;
+  return fs::file_type::unknown;
+}
+
+// Removes name from dirFd with everything below it. Symlinks are removed,
+// never followed.
+static bool removeTree(int dirFd, char const* name) {
+  int fd = ::openat(dirFd, name,
+                    O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+  DIR* dir = ::fdopendir(fd);
+  if (!dir) {
+    ::close(fd);
+    return false;
+  }
+  bool emptied = true;
+  while (dirent* entry = ::readdir(dir)) {
+    char const* entryName = entry->d_name;
+    if (entryName[0] == '.' &&
+        (entryName[1] == '\0' ||
+         (entryName[1] == '.' && entryName[2] == '\0'))) {
+      continue;
+    }
+    // Trying unlink first saves a stat per file
+    if (::unlinkat(fd, entryName, 0) != 0 &&
+        (errno != EISDIR || !removeTree(fd, entryName))) {
+      emptied = false;
+      break;
+    }
+  }
+  int error = errno;
+  ::closedir(dir);
+  errno = error;
+  return emptied && ::unlinkat(dirFd, name, AT_REMOVEDIR) == 0;
+}
+#endif
+
+RootDir::RootDir(fs::path const& path)
+    : path_(path)
+#if defined(__linux__)
+      ,
+      fd_(::open(path.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC))
+#endif
+{
+}
+
+RootDir::~RootDir() {
+#if defined(__linux__)
+  if (fd_ >= 0) {
+    ::close(fd_);
+  }
+#endif
+}
+
+#if defined(__linux__)
+std::string RootDir::relative(fs::path const& localPath) const {
+  std::string const& local = localPath.native();
+  std::string const& root = path_.native();
+  assert(local.compare(0, root.size(), root) == 0);
+  if (local.size() <= root.size()) {
+    return ".";
+  }
+  return local.substr(root.size() + (root.back() == '/' ? 0 : 1));
+}
+
+int RootDir::openBeneath(std::string const& relPath, int flags,
+                         mode_t mode) const {
+  flags |= O_CLOEXEC;
+#if defined(SYS_openat2) && defined(RESOLVE_BENEATH)
+  if (haveOpenat2.load(std::memory_order_relaxed)) {
+    struct open_how how = {};
+    how.flags = static_cast<uint64_t>(flags);
+    how.mode = (flags & O_CREAT) ? mode : 0;
+    how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+    long fd;
+    do {
+      // EAGAIN when a concurrent rename could have led the lookup astray
+      fd = ::syscall(SYS_openat2, fd_, relPath.c_str(), &how, sizeof(how));
+    } while (fd < 0 && (errno == EAGAIN || errno == EINTR));
+    if (fd >= 0 || errno != ENOSYS) {
+      return static_cast<int>(fd);
+    }
+    haveOpenat2.store(false, std::memory_order_relaxed);
+  }
+#endif
+  // Without openat2 the path is walked a component at a time. The path
+  // has no ".." left, so refusing all symlinks keeps the walk beneath.
+  int dirFd = fd_;
+  std::size_t start = 0;
+  for (;;) {
+    std::size_t slash = relPath.find('/', start);
+    std::string name = relPath.substr(start, slash - start);
+    int fd = slash == std::string::npos
+                 ? ::openat(dirFd, name.c_str(), flags | O_NOFOLLOW, mode)
+                 : ::openat(dirFd, name.c_str(),
+                            O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (dirFd != fd_) {
+      int error = errno;
+      ::close(dirFd);
+      errno = error;
+    }
+    if (fd < 0 || slash == std::string::npos) {
+      return fd;
+    }
+    dirFd = fd;
+    start = slash + 1;
+  }
+}
+
+int RootDir::openParent(std::string const& relPath, std::string& leaf) const {
+  std::size_t slash = relPath.rfind('/');
+  leaf = relPath.substr(slash + 1);
+  if (leaf == ".") {
+    // The root itself is not for changing
+    errno = EPERM;
+    return -1;
+  }
+  return slash == std::string::npos
+             ? fd_
+             : openBeneath(relPath.substr(0, slash), O_PATH | O_DIRECTORY, 0);
+}
+
+int RootDir::open(fs::path const& localPath, int flags, mode_t mode,
+                  std::error_code& ec) const {
+  int fd = openBeneath(relative(localPath), flags, mode);
+  ec = fd < 0 ? lastError() : std::error_code();
+  return fd;
+}
+#endif
+
+RootDir::Status RootDir::status(fs::path const& localPath,
+                                std::error_code& ec) const {
+#if defined(__linux__)
+  Descriptor fd(openBeneath(relative(localPath), O_PATH, 0), fd_);
+  struct stat st;
+  if (fd.get() < 0 || ::fstat(fd.get(), &st) != 0) {
+    ec = lastError();
+    return Status{fs::file_type::not_found, 0};
+  }
+  ec.clear();
+  return Status{fileType(st.st_mode), static_cast<uintmax_t>(st.st_size)};
+#else
+  Status status{fs::status(localPath, ec).type(), 0};
+  if (!ec && status.type == fs::file_type::regular) {
+    status.size = fs::file_size(localPath, ec);
+  }
+  return status;
+#endif
+}
+
+bool RootDir::isListable(fs::path const& localPath,
+                         std::error_code& ec) const {
+#if defined(__linux__)
+  Descriptor fd(
+      openBeneath(relative(localPath), O_RDONLY | O_DIRECTORY, 0), fd_);
+  ec = fd.get() < 0 ? lastError() : std::error_code();
+#else
+  fs::directory_iterator it(localPath, ec);
+#endif
+  return !ec;
+}
+
+bool RootDir::createDirectory(fs::path const& localPath,
+                              std::error_code& ec) const {
+#if defined(__linux__)
+  std::string leaf;
+  Descriptor parent(openParent(relative(localPath), leaf), fd_);
+  ec = parent.get() < 0 || ::mkdirat(parent.get(), leaf.c_str(), 0777) != 0
+           ? lastError()
+           : std::error_code();
+#else
+  if (!fs::create_directory(localPath, ec) && !ec) {
+    ec = std::make_error_code(std::errc::file_exists);
+  }
+#endif
+  return !ec;
+}
+
+bool RootDir::remove(fs::path const& localPath, bool recursive,
+                     std::error_code& ec) const {
+#if defined(__linux__)
+  std::string leaf;
+  Descriptor parent(openParent(relative(localPath), leaf), fd_);
+  // Linux refuses to unlink a directory with EISDIR
+  bool removed = parent.get() >= 0 &&
+                 (::unlinkat(parent.get(), leaf.c_str(), 0) == 0 ||
+                  (recursive && errno == EISDIR &&
+                   removeTree(parent.get(), leaf.c_str())));
+  ec = removed ? std::error_code() : lastError();
+#else
+  fs::file_status status = fs::symlink_status(localPath, ec);
+  if (ec) {
+    return false;
+  }
+  if (!fs::exists(status)) {
+    ec = std::make_error_code(std::errc::no_such_file_or_directory);
+  } else if (fs::is_directory(status) && !recursive) {
+    ec = std::make_error_code(std::errc::is_a_directory);
+  } else if (recursive) {
+    fs::remove_all(localPath, ec);
+  } else {
+    fs::remove(localPath, ec);
+  }
+#endif
+  return !ec;
+}
+
+bool RootDir::rename(fs::path const& from, fs::path const& to,
+                     std::error_code& ec) const {
+#if defined(__linux__)
+  std::string fromLeaf, toLeaf;
+  Descriptor fromParent(openParent(relative(from), fromLeaf), fd_);
+  Descriptor toParent(
+      fromParent.get() < 0 ? -1 : openParent(relative(to), toLeaf), fd_);
+  if (toParent.get() < 0) {
+    ec = lastError();
+    return false;
+  }
+#if defined(RENAME_NOREPLACE)
+  if (::renameat2(fromParent.get(), fromLeaf.c_str(), toParent.get(),
+                  toLeaf.c_str(), RENAME_NOREPLACE) == 0) {
+    ec.clear();
+    return true;
+  }
+  if (errno != EINVAL && errno != ENOSYS) {
+    ec = lastError();
+    return false;
+  }
+#endif
+  // The file system cannot rename without replacing, so look first
+  struct stat st;
+  if (::fstatat(toParent.get(), toLeaf.c_str(), &st, AT_SYMLINK_NOFOLLOW) ==
+      0) {
+    ec = std::make_error_code(std::errc::file_exists);
+  } else {
+    ec = ::renameat(fromParent.get(), fromLeaf.c_str(), toParent.get(),
+                    toLeaf.c_str()) != 0
+             ? lastError()
+             : std::error_code();
+  }
+#else
+  if (fs::exists(to, ec) || ec) {
+    if (!ec) {
+      ec = std::make_error_code(std::errc::file_exists);
+    }
+  } else {
+    fs::rename(from, to, ec);
+  }
+#endif
+  return !ec;
+}
+
+bool RootDir::resize(fs::path const& localPath, uintmax_t size,
+                     std::error_code& ec) const {
+#if defined(__linux__)
+  Descriptor fd(openBeneath(relative(localPath), O_WRONLY, 0), fd_);
+  ec = fd.get() < 0 || ::ftruncate(fd.get(), static_cast<off_t>(size)) != 0
+           ? lastError()
+           : std::error_code();
+#else
+  fs::resize_file(localPath, size, ec);
+#endif
+  return !ec;
+}
+
+void RootDir::openStream(std::fstream& stream, fs::path const& localPath,
+                         std::ios::openmode mode) const {
+#if defined(__linux__)
+  // fstream cannot take a descriptor, but it can reopen the one found
+  // beneath the root through /proc without looking the path up again
+  int flags = !(mode & std::ios::out) ? O_RDONLY
+              : (mode & std::ios::in) ? O_RDWR
+                                      : O_WRONLY | O_CREAT | O_TRUNC;
+  Descriptor fd(openBeneath(relative(localPath), flags, 0666), fd_);
+  if (fd.get() < 0) {
+    FTP_LOG_DEBUG("Cannot open " << localPath.string() << ": "
+                                 << std::strerror(errno));
+    stream.setstate(std::ios::failbit);
+    return;
+  }
+  reopenStream(stream, fd.get(), mode);
+#else
+  stream.open(localPath, mode);
+#endif
+}
+
+#if defined(__linux__)
+bool RootDir::reopenStream(std::fstream& stream, int fd,
+                           std::ios::openmode mode) {
+  stream.open("/proc/self/fd/" + std::to_string(fd), mode);
+  if (!stream.is_open()) {
+    // Chroots and small containers may have no /proc. Opening the path
+    // instead would look it up once more, so the transfer fails.
+    int error = errno;
+    if (!procMissing.exchange(true, std::memory_order_relaxed)) {
+      FTP_LOG_WARN("Cannot reopen files through /proc ("
+                   << std::strerror(error)
+                   << "), ASCII and MODE Z transfers will fail");
+    }
+    return false;
+  }
+  return true;
+}
+#endif
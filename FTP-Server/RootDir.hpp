@@ -0,0 +1,70 @@
+#pragma once
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <system_error>
+
+#if defined(__linux__)
+#include <sys/types.h>
+#endif
+
+namespace fs = std::filesystem;
+
+// The directory a user is confined to. The local paths handed in are the
+// ones FTPUser::toLocalPath makes, which are inside the root as strings.
+// On Linux the root is held open and every path is looked up by the
+// kernel from there, in one go, refusing to step out of the root through
+// symlinks as well. Elsewhere the paths are used as they are.
+class RootDir {
+ public:
+  struct Status {
+    fs::file_type type;
+    uintmax_t size;
+  };
+
+  explicit RootDir(fs::path const& path);
+  virtual ~RootDir();
+  RootDir(RootDir const&) = delete;
+  RootDir& operator=(RootDir const&) = delete;
+
+  fs::path const& path() const { return path_; }
+
+  Status status(fs::path const& localPath, std::error_code& ec) const;
+  // A directory the user may list, or why not
+  bool isListable(fs::path const& localPath, std::error_code& ec) const;
+  bool createDirectory(fs::path const& localPath, std::error_code& ec) const;
+  // Removes a file or symlink. With recursive, a directory goes as well,
+  // along with all it holds.
+  bool remove(fs::path const& localPath, bool recursive,
+              std::error_code& ec) const;
+  // Never replaces an existing target
+  bool rename(fs::path const& from, fs::path const& to,
+              std::error_code& ec) const;
+  bool resize(fs::path const& localPath, uintmax_t size,
+              std::error_code& ec) const;
+  void openStream(std::fstream& stream, fs::path const& localPath,
+                  std::ios::openmode mode) const;
+#if defined(__linux__)
+  // Like openat(2), -1 with ec set on failure
+  int open(fs::path const& localPath, int flags, mode_t mode,
+           std::error_code& ec) const;
+  // Opens stream on the file fd was opened on, false if it cannot
+  static bool reopenStream(std::fstream& stream, int fd,
+                           std::ios::openmode mode);
+#endif
+
+ private:
+#if defined(__linux__)
+  // Path of localPath relative to the root, "." for the root itself
+  std::string relative(fs::path const& localPath) const;
+  int openBeneath(std::string const& relPath, int flags, mode_t mode) const;
+  // The directory holding relPath, with the last component in leaf
+  int openParent(std::string const& relPath, std::string& leaf) const;
+#endif
+
+  fs::path const path_;
+#if defined(__linux__)
+  int fd_;
+#endif
+};
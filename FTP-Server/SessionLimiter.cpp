@@ -0,0 +1,38 @@
+#include "SessionLimiter.hpp"
+
+SessionLimiter::SessionLimiter()
+    : maxSessions_(0), maxPerAddress_(0), sessions_(0) {}
+
+void SessionLimiter::setLimits(std::size_t maxSessions,
+                               std::size_t maxPerAddress) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  maxSessions_ = maxSessions;
+  maxPerAddress_ = maxPerAddress;
+}
+
+SessionLimiter::Verdict SessionLimiter::admit(net::ip::address const& address,
+                                              ticket_ptr& ticket) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (maxSessions_ > 0 && sessions_ >= maxSessions_) {
+      return Verdict::SERVER_FULL;
+    }
+    std::size_t& count = perAddress_[address];
+    if (maxPerAddress_ > 0 && count >= maxPerAddress_) {
+      return Verdict::ADDRESS_FULL;
+    }
+    ++count;
+    ++sessions_;
+  }
+  ticket = std::make_shared<Ticket>(*this, address);
+  return Verdict::ADMITTED;
+}
+
+void SessionLimiter::release(net::ip::address const& address) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  --sessions_;
+  auto it = perAddress_.find(address);
+  if (it != perAddress_.end() && --it->second == 0) {
+    perAddress_.erase(it);
+  }
+}
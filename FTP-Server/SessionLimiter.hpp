@@ -0,0 +1,50 @@
+#pragma once
+#include <experimental/internet>
+
+#include <cstddef>
+#include <map>
+#include <memory>
+#include <mutex>
+
+namespace net = std::experimental::net;
+
+// Caps the sessions alive at once, over the whole server and per client
+// address. Only the accept path takes the lock, once when a connection
+// comes in and once when its session goes away.
+class SessionLimiter {
+ public:
+  enum class Verdict { ADMITTED, SERVER_FULL, ADDRESS_FULL };
+
+  // Held by a session for as long as it lives, the place is given back
+  // when the last copy goes
+  class Ticket {
+   public:
+    Ticket(SessionLimiter& limiter, net::ip::address const& address)
+        : limiter_(limiter), address_(address) {}
+    virtual ~Ticket() { limiter_.release(address_); }
+    Ticket(Ticket const&) = delete;
+    Ticket& operator=(Ticket const&) = delete;
+
+   private:
+    SessionLimiter& limiter_;
+    net::ip::address const address_;
+  };
+  using ticket_ptr = std::shared_ptr<Ticket>;
+
+  SessionLimiter();
+
+  // Zero means no cap
+  void setLimits(std::size_t maxSessions, std::size_t maxPerAddress);
+  // ticket is only set when the connection is admitted
+  Verdict admit(net::ip::address const& address, ticket_ptr& ticket);
+
+ private:
+  void release(net::ip::address const& address);
+
+  std::mutex mutex_;
+  std::size_t maxSessions_;
+  std::size_t maxPerAddress_;
+  std::size_t sessions_;
+  // Addresses with at least one session
+  std::map<net::ip::address, std::size_t> perAddress_;
+};
@@ -0,0 +1,84 @@
+#include <algorithm>
+
+#include "TimingWheel.hpp"
+
+TimingWheel& TimingWheel::instance() {
+  static TimingWheel wheel;
+  return wheel;
+}
+
+TimingWheel::TimingWheel()
+    : tick_(0), stopping_(false), ticker_([this]() { run(); }) {}
+
+TimingWheel::~TimingWheel() {
+  {
+    std::lock_guard<std::mutex> lock(stopMutex_);
+    stopping_ = true;
+  }
+  stopCondition_.notify_one();
+  ticker_.join();
+}
+
+TimingWheel::timeout_ptr TimingWheel::start(
+    clock::duration timeout, std::function<void()> const& expire) {
+  // Rounded up, so a timeout never expires early
+  auto ticks = static_cast<uint64_t>((timeout + kTick - clock::duration(1)) /
+                                     kTick);
+  auto entry = std::make_shared<Timeout>(*this, ticks, expire);
+  if (ticks > 0) {
+    insert(entry, entry->deadline_.load(std::memory_order_relaxed));
+  }
+  return entry;
+}
+
+void TimingWheel::insert(timeout_ptr const& timeout, uint64_t deadline) {
+  for (;;) {
+    deadline = std::max(deadline, currentTick() + 1);
+    Slot& slot = slots_[deadline % kNbSlots];
+    std::lock_guard<std::mutex> lock(slot.mutex);
+    // The wheel moves the tick before it takes the slot: if the tick is
+    // still short of the deadline, the wheel has yet to visit this slot
+    if (deadline > currentTick()) {
+      slot.timeouts.push_back(timeout);
+      return;
+    }
+  }
+}
+
+void TimingWheel::run() {
+  clock::time_point next = clock::now() + kTick;
+  std::unique_lock<std::mutex> lock(stopMutex_);
+  for (;;) {
+    if (stopCondition_.wait_until(lock, next, [this]() { return stopping_; })) {
+      return;
+    }
+    lock.unlock();
+    // A late wake-up catches up one tick at a time
+    for (clock::time_point now = clock::now(); next <= now; next += kTick) {
+      expireSlot(tick_.fetch_add(1, std::memory_order_relaxed) + 1);
+    }
+    lock.lock();
+  }
+}
+
+void TimingWheel::expireSlot(uint64_t tick) {
+  std::vector<timeout_ptr> due;
+  {
+    Slot& slot = slots_[tick % kNbSlots];
+    std::lock_guard<std::mutex> lock(slot.mutex);
+    due.swap(slot.timeouts);
+  }
+  for (timeout_ptr const& timeout : due) {
+    if (timeout->cancelled_.load(std::memory_order_relaxed)) {
+      continue;
+    }
+    // Restarted since it was put here, or due in a later turn of the wheel
+    uint64_t deadline = timeout->deadline_.load(std::memory_order_relaxed);
+    if (deadline > tick) {
+      insert(timeout, deadline);
+      continue;
+    }
+    timeout->cancelled_.store(true, std::memory_order_relaxed);
+    timeout->expire_();
+  }
+}
@@ -0,0 +1,87 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Server-wide hashed timing wheel for the session timeouts. A timeout sits
+// in the slot of its deadline modulo the wheel size; the wheel thread visits
+// one slot per tick. Restarting a timeout only moves its deadline forward,
+// without touching the wheel: when its slot comes up the timeout is put
+// back in the slot of its new deadline instead of expiring. So pushing a
+// deadline back on every command costs a single atomic store.
+class TimingWheel {
+ public:
+  using clock = std::chrono::steady_clock;
+  static constexpr clock::duration kTick = std::chrono::milliseconds(100);
+  static constexpr std::size_t kNbSlots = 1024;
+
+  class Timeout {
+   public:
+    Timeout(TimingWheel& wheel, uint64_t ticks,
+            std::function<void()> const& expire)
+        : wheel_(wheel),
+          ticks_(ticks),
+          deadline_(wheel.currentTick() + ticks),
+          cancelled_(false),
+          expire_(expire) {}
+
+    // The timeout runs again in full from now
+    void restart() {
+      deadline_.store(wheel_.currentTick() + ticks_,
+                      std::memory_order_relaxed);
+    }
+    // The wheel drops the timeout the next time it comes across it
+    void cancel() { cancelled_.store(true, std::memory_order_relaxed); }
+
+   private:
+    friend class TimingWheel;
+    TimingWheel& wheel_;
+    uint64_t const ticks_;
+    std::atomic<uint64_t> deadline_;
+    std::atomic<bool> cancelled_;
+    std::function<void()> const expire_;
+  };
+  using timeout_ptr = std::shared_ptr<Timeout>;
+
+  static TimingWheel& instance();
+
+  virtual ~TimingWheel();
+  TimingWheel(TimingWheel const&) = delete;
+  TimingWheel& operator=(TimingWheel const&) = delete;
+
+  // expire is called on the wheel thread, so it should only hand the work
+  // over to the right executor, once timeout has passed since the start or
+  // the last restart(). A zero timeout never expires.
+  timeout_ptr start(clock::duration timeout,
+                    std::function<void()> const& expire);
+  uint64_t currentTick() const {
+    return tick_.load(std::memory_order_relaxed);
+  }
+
+ private:
+  struct Slot {
+    std::mutex mutex;
+    std::vector<timeout_ptr> timeouts;
+  };
+
+  TimingWheel();
+
+  void insert(timeout_ptr const& timeout, uint64_t deadline);
+  void run();
+  void expireSlot(uint64_t tick);
+
+  std::array<Slot, kNbSlots> slots_;
+  std::atomic<uint64_t> tick_;
+  std::mutex stopMutex_;
+  std::condition_variable stopCondition_;
+  bool stopping_;
+  std::thread ticker_;
+};
@@ -0,0 +1,21 @@
+#include "TokenBucket.hpp"
+
+TokenBucket::clock::duration TokenBucket::pay(std::size_t bytes) {
+  uint64_t rate = rate_.load(std::memory_order_relaxed);
+  if (rate == 0) {
+    return clock::duration::zero();
+  }
+  clock::rep now = clock::now().time_since_epoch().count();
+  clock::rep cost = std::chrono::duration_cast<clock::duration>(
+                        std::chrono::duration<double>(
+                            static_cast<double>(bytes) / rate))
+                        .count();
+  clock::rep clearedAt = clearedAt_.load(std::memory_order_relaxed);
+  clock::rep next;
+  do {
+    // An idle bucket only saves up a burst
+    next = std::max(clearedAt, now - kBurst.count()) + cost;
+  } while (!clearedAt_.compare_exchange_weak(clearedAt, next,
+                                             std::memory_order_relaxed));
+  return clock::duration(std::max<clock::rep>(next - now, 0));
+}
@@ -0,0 +1,35 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+// Bandwidth limit shared by any number of transfers on any thread. Bytes
+// are paid for once they have moved, which may leave the bucket in debt:
+// the transfer that paid then holds off until the debt is cleared. The
+// whole state is the time at which the debt is cleared, so paying is a
+// compare-and-swap and an unlimited bucket costs a single load.
+class TokenBucket {
+ public:
+  using clock = std::chrono::steady_clock;
+  // Bytes a transfer may move at once after a pause, in time at the rate
+  static constexpr clock::duration kBurst = std::chrono::milliseconds(100);
+
+  TokenBucket() : rate_(0), clearedAt_(0) {}
+  TokenBucket(TokenBucket const&) = delete;
+  TokenBucket& operator=(TokenBucket const&) = delete;
+
+  // Zero means no limit
+  void setRate(uint64_t bytesPerSecond) {
+    rate_.store(bytesPerSecond, std::memory_order_relaxed);
+  }
+  uint64_t rate() const { return rate_.load(std::memory_order_relaxed); }
+
+  // Pays for bytes already moved and returns how long to hold off
+  clock::duration pay(std::size_t bytes);
+
+ private:
+  std::atomic<uint64_t> rate_;
+  std::atomic<clock::rep> clearedAt_;
+};
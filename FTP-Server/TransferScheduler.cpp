@@ -0,0 +1,54 @@
+#include <algorithm>
+
+#include "TransferScheduler.hpp"
+
+net::execution_context::id TransferScheduler::id;
+
+// Only ever made by of(), from an io_context
+TransferScheduler::TransferScheduler(net::execution_context& context)
+    : net::execution_context::service(context),
+      ioContext_(static_cast<net::io_context&>(context)),
+      maxRunners_(1),
+      runners_(0) {}
+
+void TransferScheduler::setConcurrency(std::size_t runners) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  maxRunners_ = std::max<std::size_t>(runners, 1);
+}
+
+void TransferScheduler::schedule(std::function<void(void)> const& turn) {
+  bool startRunner = false;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    turns_.push_back(turn);
+    if (runners_ < maxRunners_) {
+      ++runners_;
+      startRunner = true;
+    }
+  }
+  if (startRunner) {
+    net::post(ioContext_, [this]() { runTurn(); });
+  }
+}
+
+void TransferScheduler::shutdown() {
+  // The turns hold their sessions
+  std::lock_guard<std::mutex> lock(mutex_);
+  turns_.clear();
+}
+
+void TransferScheduler::runTurn() {
+  std::function<void(void)> turn;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (turns_.empty()) {
+      --runners_;
+      return;
+    }
+    turn = std::move(turns_.front());
+    turns_.pop_front();
+  }
+  turn();
+  // The next turn queues behind whatever came in meanwhile
+  net::post(ioContext_, [this]() { runTurn(); });
+}
@@ -0,0 +1,48 @@
+#pragma once
+#include <experimental/executor>
+#include <experimental/io_context>
+
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+
+namespace net = std::experimental::net;
+
+// Takes turns between the transfers of one io_context. A transfer moves a
+// bounded amount of data in a turn, then queues its next turn behind the
+// transfers already waiting. Every turn is a handler of its own, so the
+// commands of other sessions get to run in between. How much a transfer
+// moves per turn is its weight times the quantum, which makes the turns a
+// weighted round-robin.
+class TransferScheduler : public net::execution_context::service {
+ public:
+  using key_type = TransferScheduler;
+  static net::execution_context::id id;
+
+  // Data a transfer of weight 1 moves in a turn
+  static constexpr std::size_t kQuantum = 128 << 10;
+  static constexpr unsigned kMaxWeight = 8;
+
+  // Created on first use, once per io_context
+  static TransferScheduler& of(net::io_context& context) {
+    return net::use_service<TransferScheduler>(context);
+  }
+  explicit TransferScheduler(net::execution_context& context);
+
+  // Turns that may run at the same time, best one per thread running the
+  // io_context
+  void setConcurrency(std::size_t runners);
+  // Runs turn once the turns queued before it have run
+  void schedule(std::function<void(void)> const& turn);
+
+ private:
+  void shutdown() override;
+  void runTurn();
+
+  net::io_context& ioContext_;
+  std::mutex mutex_;
+  std::deque<std::function<void(void)>> turns_;
+  std::size_t maxRunners_;
+  std::size_t runners_;
+};
@@ -1,5 +1,5 @@
-#include <iostream>
 
+#include "Logger.hpp"
 #include "UserDatabase.hpp"
 
 std::shared_ptr<FTPUser> UserDatabase::getUser(
@@ -22,30 +22,65 @@ std::shared_ptr<FTPUser> UserDatabase::addUser(std::string const& username,
 
   if (isUsernameAnonymousUser(username)) {
     if (anonymousUser_) {
-      std::cerr << "The username denotes the anonymous user, which is "
-                   "already present."
-                << std::endl;
+      FTP_LOG_WARN(
+          "The username denotes the anonymous user, which is already "
+          "present.");
       return nullptr;
     } else {
       anonymousUser_ = std::make_shared<FTPUser>(password, localRootPath);
-      std::cout << "Successfully added anonymous user." << std::endl;
+      FTP_LOG_INFO("Successfully added anonymous user.");
       return anonymousUser_;
     }
   } else {
     if (auto userIt = userDb_.find(username); userIt == userDb_.end()) {
       auto newAcc = std::make_shared<FTPUser>(password, localRootPath);
       userDb_.emplace(username, newAcc);
-      std::cout << "Successfully added user \"" << username << "\"."
-                << std::endl;
+      FTP_LOG_INFO("Successfully added user \"" << username << "\".");
       return newAcc;
     } else {
-      std::cerr << "Username \"" << username << "\" already exists."
-                << std::endl;
+      FTP_LOG_WARN("Username \"" << username << "\" already exists.");
       return nullptr;
     }
   }
 }
 
+bool UserDatabase::setBandwidth(std::string const& username,
+                                uint64_t userRate, uint64_t sessionRate) {
+  std::lock_guard<decltype(mutex_)> userDb_lock(mutex_);
+
+  auto user = findUser(username);
+  if (!user) {
+    FTP_LOG_WARN("No user \"" << username << "\" to limit.");
+    return false;
+  }
+  // Sessions already logged in keep their own rate
+  user->bandwidth_.setRate(userRate);
+  user->sessionBandwidth_ = sessionRate;
+  return true;
+}
+
+bool UserDatabase::setTransferWeight(std::string const& username,
+                                     unsigned weight) {
+  std::lock_guard<decltype(mutex_)> userDb_lock(mutex_);
+
+  auto user = findUser(username);
+  if (!user) {
+    FTP_LOG_WARN("No user \"" << username << "\" to weigh.");
+    return false;
+  }
+  user->transferWeight_ = weight;
+  return true;
+}
+
 bool UserDatabase::isUsernameAnonymousUser(std::string const& username) const {
   return username.empty() || username == "ftp" || username == "anonymous";
 }
+
+std::shared_ptr<FTPUser> UserDatabase::findUser(
+    std::string const& username) const {
+  if (isUsernameAnonymousUser(username)) {
+    return anonymousUser_;
+  }
+  auto userIt = userDb_.find(username);
+  return userIt != userDb_.end() ? userIt->second : nullptr;
+}
@@ -1,4 +1,5 @@
 #pragma once
+#include <cstdint>
 #include <map>
 #include <memory>
 #include <mutex>
@@ -13,9 +14,17 @@ class UserDatabase {
   std::shared_ptr<FTPUser> addUser(std::string const& username,
                                    std::string const& password,
                                    fs::path const& localRootPath = "");
+  // Bytes per second for all the sessions of username together and for
+  // each of them, zero for no limit. False if there is no such user.
+  bool setBandwidth(std::string const& username, uint64_t userRate,
+                    uint64_t sessionRate);
+  // A transfer of username moves weight times as much per turn as one of
+  // weight 1, the default. False if there is no such user.
+  bool setTransferWeight(std::string const& username, unsigned weight);
 
  private:
   bool isUsernameAnonymousUser(std::string const& username) const;
+  std::shared_ptr<FTPUser> findUser(std::string const& username) const;
 
   mutable std::mutex mutex_;
   std::map<std::string, std::shared_ptr<FTPUser>> userDb_;
@@ -0,0 +1,77 @@
+#include <algorithm>
+#include <cctype>
+#include <string>
+#include <string_view>
+
+#include "ZStream.hpp"
+
+bool isCompressedFile(fs::path const& path) {
+  static constexpr std::string_view extensions[] = {
+      ".7z",  ".avi", ".bz2", ".flac", ".gif", ".gz",  ".jpeg",
+      ".jpg", ".lz4", ".mkv", ".mov",  ".mp3", ".mp4", ".ogg",
+      ".png", ".rar", ".tgz", ".webm", ".webp", ".xz", ".zip",
+      ".zst"};
+  std::string extension = path.extension().string();
+  std::transform(extension.begin(), extension.end(), extension.begin(),
+                 [](unsigned char c) { return std::tolower(c); });
+  return std::find(std::begin(extensions), std::end(extensions),
+                   extension) != std::end(extensions);
+}
+
+#if defined(FTP_HAVE_ZLIB)
+ZStream::ZStream(Mode mode, int level)
+    : mode_(mode),
+      stream_(),
+      initialized_(false),
+      good_(false),
+      finished_(false) {
+  initialized_ = (mode_ == Mode::DEFLATE ? deflateInit(&stream_, level)
+                                         : inflateInit(&stream_)) == Z_OK;
+  good_ = initialized_;
+}
+
+ZStream::~ZStream() {
+  if (initialized_) {
+    mode_ == Mode::DEFLATE ? deflateEnd(&stream_) : inflateEnd(&stream_);
+  }
+}
+
+bool ZStream::process(char const* data, std::size_t length, bool finish,
+                      sink const& out) {
+  if (!good_) {
+    return false;
+  }
+  char output[kOutputChunkSize];
+  // zlib counts in uInt, feed very large inputs in several rounds
+  do {
+    auto round = static_cast<uInt>(std::min<std::size_t>(length, 1u << 30));
+    stream_.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+    stream_.avail_in = round;
+    data += round;
+    length -= round;
+    int flush = (finish && length == 0) ? Z_FINISH : Z_NO_FLUSH;
+    int result;
+    do {
+      stream_.next_out = reinterpret_cast<Bytef*>(output);
+      stream_.avail_out = sizeof(output);
+      result = mode_ == Mode::DEFLATE ? deflate(&stream_, flush)
+                                      : inflate(&stream_, Z_NO_FLUSH);
+      if (result != Z_OK && result != Z_STREAM_END && result != Z_BUF_ERROR) {
+        good_ = false;
+        return false;
+      }
+      if (std::size_t produced = sizeof(output) - stream_.avail_out) {
+        out(output, produced);
+      }
+      if (result == Z_STREAM_END) {
+        finished_ = true;
+        good_ = false;
+        // Anything after the end of an inflate stream is garbage
+        return stream_.avail_in == 0 && length == 0;
+      }
+    } while (stream_.avail_out == 0 ||
+             (flush == Z_FINISH && result != Z_STREAM_END));
+  } while (length > 0);
+  return true;
+}
+#endif
@@ -0,0 +1,52 @@
+#pragma once
+#include <cstddef>
+#include <filesystem>
+#include <functional>
+
+// Visual Studio projects define FTP_WITH_ZLIB when they link zlib, other
+// builds use it whenever the header is there
+#if defined(_MSC_VER) ? defined(FTP_WITH_ZLIB) : __has_include(<zlib.h>)
+#include <zlib.h>
+#define FTP_HAVE_ZLIB 1
+#endif
+
+namespace fs = std::filesystem;
+
+// Files that are already compressed gain nothing from MODE Z
+bool isCompressedFile(fs::path const& path);
+
+// Only defined when zlib is available; without it MODE Z is refused and
+// ZStream pointers always stay null.
+class ZStream;
+
+#if defined(FTP_HAVE_ZLIB)
+// Deflate or inflate stage of a MODE Z transfer. Data is pushed through in
+// arbitrary pieces and the output handed to a sink as it is produced.
+class ZStream {
+ public:
+  enum class Mode { DEFLATE, INFLATE };
+  using sink = std::function<void(char const* data, std::size_t length)>;
+
+  static constexpr std::size_t kOutputChunkSize = 1 << 16;
+
+  // level is only used when deflating, 0 stores the data uncompressed
+  ZStream(Mode mode, int level = Z_DEFAULT_COMPRESSION);
+  virtual ~ZStream();
+  ZStream(ZStream const&) = delete;
+  ZStream& operator=(ZStream const&) = delete;
+
+  // Runs length bytes through the stream. finish ends a deflate stream; an
+  // inflate stream ends when its input says so. Returns false on bad data.
+  bool process(char const* data, std::size_t length, bool finish,
+               sink const& out);
+  // True once the end of the compressed stream has been written or read
+  bool finished() const { return finished_; }
+
+ private:
+  Mode const mode_;
+  z_stream stream_;
+  bool initialized_;
+  bool good_;
+  bool finished_;
+};
+#endif
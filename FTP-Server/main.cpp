@@ -1,15 +1,62 @@
+#include <charconv>
+#include <chrono>
+#include <filesystem>
 #include <iostream>
 #include <thread>
 #include <string>
+#include <string_view>
 
 #include "FTPServer.hpp"
 
-int main() {
+// Usage: FTP-Server [--reactors <n>] [--pin]
+// By default one io_context is run by 4 pool threads and the main thread.
+// --reactors runs n io_contexts instead, one thread each, which on Linux
+// accept on their own SO_REUSEPORT listeners. --pin then ties each reactor
+// thread to a CPU.
+int main(int argc, char* argv[]) {
+  unsigned int nbReactors = 0;
+  bool pinThreads = false;
+  for (int i = 1; i < argc; ++i) {
+    std::string_view arg = argv[i];
+    if (arg == "--reactors" && i + 1 < argc) {
+      std::string_view value = argv[++i];
+      char const* last = value.data() + value.size();
+      auto [end, errc] = std::from_chars(value.data(), last, nbReactors);
+      if (errc != std::errc() || end != last || nbReactors == 0) {
+        std::cerr << "Invalid number of reactors: " << value << std::endl;
+        return 1;
+      }
+    } else if (arg == "--pin") {
+      pinThreads = true;
+    } else {
+      std::cerr << "Usage: " << argv[0] << " [--reactors <n>] [--pin]"
+                << std::endl;
+      return 1;
+    }
+  }
+
   // Create an FTP Server on port 2121. We use 2121 instead of the default port
   // 21, as your application would need root privileges to open port 21.
   FTPServer server;
   server.addUser("test", "123");
-  server.start(4, 2121);
+  // Shed connection storms before they use up descriptors or slow down the
+  // sessions already in. No cap per address, so the load generator can open
+  // all its sessions over loopback.
+  server.setSessionLimits(4096, 0);
+  server.setAcceptDelayLimit(std::chrono::milliseconds(250));
+#if defined(__unix__)
+  // Read with e.g. socat - UNIX-CONNECT:/tmp/ftp-server-metrics.sock
+  server.serveMetrics(
+      (std::filesystem::temp_directory_path() / "ftp-server-metrics.sock")
+          .string());
+#endif
+  if (nbReactors > 0) {
+    if (!server.startMultiReactor(nbReactors, 2121, pinThreads)) {
+      return 1;
+    }
+  } else {
+    server.start(4, 2121);
+  }
   // Add the well known anonymous user and some normal users. The anonymous user
   // can log in with username "anonyous" or "ftp" and any password. The normal
   // users have to provide their username and password.